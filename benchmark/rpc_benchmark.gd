@@ -0,0 +1,42 @@
+# Headless MessagePackRPC benchmark, prints its report as JSON.
+#
+#   godot --headless -s rpc_benchmark.gd -- --clients=8 --duration=5000 --mix=1,1,0.5 --payloads=16,256,4096 --port=0
+#
+# --mix weighs sync_callv, async_callv and notifyv. --port=0 connects over
+# MessagePackRPCTransportLoopback, any other port over TCP on 127.0.0.1.
+extends SceneTree
+
+
+func _init():
+	var bench := MessagePackRPCBenchmark.new()
+	for arg in OS.get_cmdline_user_args():
+		var pair: PackedStringArray = arg.trim_prefix("--").split("=", true, 1)
+		var value := pair[1] if pair.size() > 1 else ""
+		match pair[0]:
+			"clients":
+				bench.client_count = value.to_int()
+			"duration":
+				bench.duration_msec = value.to_int()
+			"port":
+				bench.port = value.to_int()
+			"in_flight":
+				bench.max_in_flight = value.to_int()
+			"timeout":
+				bench.call_timeout_msec = value.to_int()
+			"mix":
+				var weights := value.split_floats(",")
+				if weights.size() == 3:
+					bench.sync_weight = weights[0]
+					bench.async_weight = weights[1]
+					bench.notify_weight = weights[2]
+			"payloads":
+				var sizes := PackedInt32Array()
+				for size in value.split(",", false):
+					sizes.push_back(size.to_int())
+				bench.payload_sizes = sizes
+			_:
+				printerr("Unknown option: ", arg)
+
+	var report := bench.run()
+	print(JSON.stringify(report, "\t"))
+	quit(0 if not report.is_empty() else 1)
@@ -9,7 +9,18 @@ def configure(env):
 def get_doc_classes():
     return [
         "MessagePack",
+        "MessagePackDelta",
         "MessagePackRPC",
+        "MessagePackRPCBenchmark",
+        "MessagePackRPCCall",
+        "MessagePackRPCPool",
+        "MessagePackRPCReplayer",
+        "MessagePackRPCServer",
+        "MessagePackRPCTransport",
+        "MessagePackRPCTransportLoopback",
+        "MessagePackRPCTransportSharedMemory",
+        "MessagePackRPCTransportTCP",
+        "MessagePackRPCTransportUnix",
     ]
 
 
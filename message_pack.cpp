@@ -29,9 +29,425 @@
 /*************************************************************************/
 
 #include "message_pack.h"
+#include "core/crypto/crypto_core.h"
+#include "core/io/stream_peer_tcp.h"
+#include "core/math/math_funcs.h"
 #include "core/os/memory.h"
 
-Variant MessagePack::_read_recursive(mpack_reader_t &p_reader, int p_depth) {
+// JSON transcoding.
+// Binary data and extension types have no JSON counterpart, they are mapped to
+// the tagged objects {"$bin": "<base64>"} and {"$ext": type, "$data": "<base64>"}.
+
+enum JSONTokenType {
+	JSON_TK_CURLY_OPEN,
+	JSON_TK_CURLY_CLOSE,
+	JSON_TK_BRACKET_OPEN,
+	JSON_TK_BRACKET_CLOSE,
+	JSON_TK_COLON,
+	JSON_TK_COMMA,
+	JSON_TK_STRING,
+	JSON_TK_NUMBER,
+	JSON_TK_TRUE,
+	JSON_TK_FALSE,
+	JSON_TK_NULL,
+	JSON_TK_EOF,
+};
+
+enum JSONNumberType {
+	JSON_NUM_INT,
+	JSON_NUM_UINT,
+	JSON_NUM_DOUBLE,
+};
+
+enum JSONContainerKind {
+	JSON_CONTAINER_ARRAY,
+	JSON_CONTAINER_MAP,
+	JSON_CONTAINER_BIN,
+	JSON_CONTAINER_EXT,
+};
+
+struct JSONToken {
+	JSONTokenType type = JSON_TK_EOF;
+	JSONNumberType num_type = JSON_NUM_INT;
+	int64_t i = 0;
+	uint64_t u = 0;
+	double d = 0.0;
+};
+
+static void _utf8_append(LocalVector<uint8_t> &r_buf, char32_t p_char) {
+	if (p_char < 0x80) {
+		r_buf.push_back(p_char);
+	} else if (p_char < 0x800) {
+		r_buf.push_back(0xC0 | (p_char >> 6));
+		r_buf.push_back(0x80 | (p_char & 0x3F));
+	} else if (p_char < 0x10000) {
+		r_buf.push_back(0xE0 | (p_char >> 12));
+		r_buf.push_back(0x80 | ((p_char >> 6) & 0x3F));
+		r_buf.push_back(0x80 | (p_char & 0x3F));
+	} else {
+		r_buf.push_back(0xF0 | (p_char >> 18));
+		r_buf.push_back(0x80 | ((p_char >> 12) & 0x3F));
+		r_buf.push_back(0x80 | ((p_char >> 6) & 0x3F));
+		r_buf.push_back(0x80 | (p_char & 0x3F));
+	}
+}
+
+static inline bool _json_is_digit(char32_t p_char) {
+	return p_char >= '0' && p_char <= '9';
+}
+
+static bool _json_match(const char32_t *p_str, int p_len, int p_idx, const char *p_word) {
+	for (int i = 0; p_word[i] != 0; i++) {
+		if (p_idx + i >= p_len || p_str[p_idx + i] != (char32_t)p_word[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool _json_key_equals(const LocalVector<uint8_t> &p_key, const char *p_word) {
+	uint32_t len = strlen(p_word);
+	return p_key.size() == len && memcmp(p_key.ptr(), p_word, len) == 0;
+}
+
+static Error _json_parse_hex4(const char32_t *p_str, int p_len, int &r_idx, char32_t &r_char) {
+	if (r_idx + 4 > p_len) {
+		return ERR_PARSE_ERROR;
+	}
+	r_char = 0;
+	for (int i = 0; i < 4; i++) {
+		char32_t c = p_str[r_idx++];
+		uint32_t v;
+		if (c >= '0' && c <= '9') {
+			v = c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			v = c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			v = c - 'A' + 10;
+		} else {
+			return ERR_PARSE_ERROR;
+		}
+		r_char = (r_char << 4) | v;
+	}
+	return OK;
+}
+
+static Error _json_get_number(const char32_t *p_str, int p_len, int &r_idx, JSONToken &r_token, LocalVector<uint8_t> &r_buf, String &r_err_str) {
+	int start = r_idx;
+	bool negative = false;
+	if (p_str[r_idx] == '-') {
+		negative = true;
+		r_idx++;
+	}
+	if (r_idx >= p_len || !_json_is_digit(p_str[r_idx])) {
+		r_err_str = "Invalid number.";
+		return ERR_PARSE_ERROR;
+	}
+
+	uint64_t mag = 0;
+	bool overflow = false;
+	if (p_str[r_idx] == '0') {
+		r_idx++;
+	} else {
+		while (r_idx < p_len && _json_is_digit(p_str[r_idx])) {
+			uint32_t digit = p_str[r_idx] - '0';
+			if (mag > (UINT64_MAX - digit) / 10) {
+				overflow = true;
+			} else {
+				mag = mag * 10 + digit;
+			}
+			r_idx++;
+		}
+	}
+
+	bool is_float = false;
+	if (r_idx < p_len && p_str[r_idx] == '.') {
+		is_float = true;
+		r_idx++;
+		if (r_idx >= p_len || !_json_is_digit(p_str[r_idx])) {
+			r_err_str = "Invalid number.";
+			return ERR_PARSE_ERROR;
+		}
+		while (r_idx < p_len && _json_is_digit(p_str[r_idx])) {
+			r_idx++;
+		}
+	}
+	if (r_idx < p_len && (p_str[r_idx] == 'e' || p_str[r_idx] == 'E')) {
+		is_float = true;
+		r_idx++;
+		if (r_idx < p_len && (p_str[r_idx] == '+' || p_str[r_idx] == '-')) {
+			r_idx++;
+		}
+		if (r_idx >= p_len || !_json_is_digit(p_str[r_idx])) {
+			r_err_str = "Invalid number.";
+			return ERR_PARSE_ERROR;
+		}
+		while (r_idx < p_len && _json_is_digit(p_str[r_idx])) {
+			r_idx++;
+		}
+	}
+
+	r_token.type = JSON_TK_NUMBER;
+	// Keep integers exact, only fall back to double when they don't fit in 64 bits.
+	if (!is_float && !overflow) {
+		if (!negative) {
+			if (mag <= (uint64_t)INT64_MAX) {
+				r_token.num_type = JSON_NUM_INT;
+				r_token.i = mag;
+			} else {
+				r_token.num_type = JSON_NUM_UINT;
+				r_token.u = mag;
+			}
+			return OK;
+		} else if (mag <= (uint64_t)INT64_MAX) {
+			r_token.num_type = JSON_NUM_INT;
+			r_token.i = -int64_t(mag);
+			return OK;
+		} else if (mag == (uint64_t)INT64_MAX + 1) {
+			r_token.num_type = JSON_NUM_INT;
+			r_token.i = INT64_MIN;
+			return OK;
+		}
+	}
+
+	r_buf.clear();
+	for (int i = start; i < r_idx; i++) {
+		r_buf.push_back(p_str[i]);
+	}
+	r_buf.push_back(0);
+	r_token.num_type = JSON_NUM_DOUBLE;
+	r_token.d = String::to_float((const char *)r_buf.ptr());
+	return OK;
+}
+
+static Error _json_get_token(const char32_t *p_str, int p_len, int &r_idx, JSONToken &r_token, LocalVector<uint8_t> &r_buf, String &r_err_str) {
+	while (r_idx < p_len && (p_str[r_idx] == ' ' || p_str[r_idx] == '\t' || p_str[r_idx] == '\n' || p_str[r_idx] == '\r')) {
+		r_idx++;
+	}
+	if (r_idx >= p_len) {
+		r_token.type = JSON_TK_EOF;
+		return OK;
+	}
+
+	switch (p_str[r_idx]) {
+		case '{':
+			r_token.type = JSON_TK_CURLY_OPEN;
+			r_idx++;
+			return OK;
+		case '}':
+			r_token.type = JSON_TK_CURLY_CLOSE;
+			r_idx++;
+			return OK;
+		case '[':
+			r_token.type = JSON_TK_BRACKET_OPEN;
+			r_idx++;
+			return OK;
+		case ']':
+			r_token.type = JSON_TK_BRACKET_CLOSE;
+			r_idx++;
+			return OK;
+		case ':':
+			r_token.type = JSON_TK_COLON;
+			r_idx++;
+			return OK;
+		case ',':
+			r_token.type = JSON_TK_COMMA;
+			r_idx++;
+			return OK;
+		case '"': {
+			r_idx++;
+			// NOTE: Strings are collected as utf8, the way they are written to MessagePack.
+			r_buf.clear();
+			while (true) {
+				if (r_idx >= p_len) {
+					r_err_str = "Unterminated string.";
+					return ERR_PARSE_ERROR;
+				}
+				char32_t c = p_str[r_idx++];
+				if (c == '"') {
+					break;
+				}
+				if (c < 0x20) {
+					r_err_str = "Control character in string.";
+					return ERR_PARSE_ERROR;
+				}
+				if (c == '\\') {
+					if (r_idx >= p_len) {
+						r_err_str = "Unterminated string.";
+						return ERR_PARSE_ERROR;
+					}
+					char32_t esc = p_str[r_idx++];
+					switch (esc) {
+						case '"':
+						case '\\':
+						case '/':
+							c = esc;
+							break;
+						case 'b':
+							c = '\b';
+							break;
+						case 'f':
+							c = '\f';
+							break;
+						case 'n':
+							c = '\n';
+							break;
+						case 'r':
+							c = '\r';
+							break;
+						case 't':
+							c = '\t';
+							break;
+						case 'u': {
+							if (_json_parse_hex4(p_str, p_len, r_idx, c) != OK) {
+								r_err_str = "Invalid unicode escape.";
+								return ERR_PARSE_ERROR;
+							}
+							if (c >= 0xD800 && c <= 0xDBFF) {
+								// Surrogate pair.
+								char32_t low = 0;
+								if (!_json_match(p_str, p_len, r_idx, "\\u")) {
+									r_err_str = "Invalid unicode surrogate pair.";
+									return ERR_PARSE_ERROR;
+								}
+								r_idx += 2;
+								if (_json_parse_hex4(p_str, p_len, r_idx, low) != OK || low < 0xDC00 || low > 0xDFFF) {
+									r_err_str = "Invalid unicode surrogate pair.";
+									return ERR_PARSE_ERROR;
+								}
+								c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+							} else if (c >= 0xDC00 && c <= 0xDFFF) {
+								r_err_str = "Invalid unicode surrogate pair.";
+								return ERR_PARSE_ERROR;
+							}
+						} break;
+						default:
+							r_err_str = "Invalid escape sequence.";
+							return ERR_PARSE_ERROR;
+					}
+				}
+				_utf8_append(r_buf, c);
+			}
+			r_token.type = JSON_TK_STRING;
+			return OK;
+		} break;
+		default:
+			break;
+	}
+
+	if (p_str[r_idx] == '-' || _json_is_digit(p_str[r_idx])) {
+		return _json_get_number(p_str, p_len, r_idx, r_token, r_buf, r_err_str);
+	}
+	if (_json_match(p_str, p_len, r_idx, "true")) {
+		r_token.type = JSON_TK_TRUE;
+		r_idx += 4;
+		return OK;
+	}
+	if (_json_match(p_str, p_len, r_idx, "false")) {
+		r_token.type = JSON_TK_FALSE;
+		r_idx += 5;
+		return OK;
+	}
+	if (_json_match(p_str, p_len, r_idx, "null")) {
+		r_token.type = JSON_TK_NULL;
+		r_idx += 4;
+		return OK;
+	}
+	r_err_str = "Unexpected character.";
+	return ERR_PARSE_ERROR;
+}
+
+static Error _json_decode_base64(const LocalVector<uint8_t> &p_src, LocalVector<uint8_t> &r_dst, size_t &r_len) {
+	r_dst.resize(p_src.size() / 4 * 3 + 3);
+	r_len = 0;
+	return CryptoCore::b64_decode(r_dst.ptr(), r_dst.size(), &r_len, p_src.ptr(), p_src.size());
+}
+
+static void _json_append(LocalVector<uint8_t> &r_out, const char *p_str, int p_len = -1) {
+	if (p_len < 0) {
+		p_len = strlen(p_str);
+	}
+	uint32_t from = r_out.size();
+	r_out.resize(from + p_len);
+	memcpy(r_out.ptr() + from, p_str, p_len);
+}
+
+static void _json_append_escaped(LocalVector<uint8_t> &r_out, const char *p_str, uint32_t p_len) {
+	r_out.push_back('"');
+	for (uint32_t i = 0; i < p_len; i++) {
+		uint8_t c = p_str[i];
+		switch (c) {
+			case '"':
+				_json_append(r_out, "\\\"", 2);
+				break;
+			case '\\':
+				_json_append(r_out, "\\\\", 2);
+				break;
+			case '\b':
+				_json_append(r_out, "\\b", 2);
+				break;
+			case '\f':
+				_json_append(r_out, "\\f", 2);
+				break;
+			case '\n':
+				_json_append(r_out, "\\n", 2);
+				break;
+			case '\r':
+				_json_append(r_out, "\\r", 2);
+				break;
+			case '\t':
+				_json_append(r_out, "\\t", 2);
+				break;
+			default:
+				if (c < 0x20) {
+					char buf[8];
+					int len = snprintf(buf, sizeof(buf), "\\u%04x", c);
+					_json_append(r_out, buf, len);
+				} else {
+					r_out.push_back(c);
+				}
+				break;
+		}
+	}
+	r_out.push_back('"');
+}
+
+static void _json_append_base64(LocalVector<uint8_t> &r_out, const char *p_data, uint32_t p_len) {
+	r_out.push_back('"');
+	if (p_len > 0) {
+		uint32_t from = r_out.size();
+		r_out.resize(from + (p_len + 2) / 3 * 4 + 1);
+		size_t written = 0;
+		CryptoCore::b64_encode(r_out.ptr() + from, r_out.size() - from, &written, (const uint8_t *)p_data, p_len);
+		r_out.resize(from + written);
+	}
+	r_out.push_back('"');
+}
+
+static void _json_append_double(LocalVector<uint8_t> &r_out, double p_val, bool p_single) {
+	if (Math::is_nan(p_val) || Math::is_inf(p_val)) {
+		// Not representable in JSON.
+		_json_append(r_out, "null", 4);
+		return;
+	}
+	// Use the shortest form which reads back to the same value.
+	char buf[32];
+	int len = 0;
+	for (int precision = p_single ? 6 : 15; precision <= (p_single ? 9 : 17); precision++) {
+		len = snprintf(buf, sizeof(buf), "%.*g", precision, p_val);
+		double back = String::to_float(buf);
+		if (p_single ? float(back) == float(p_val) : back == p_val) {
+			break;
+		}
+	}
+	_json_append(r_out, buf, len);
+	// Keep the decimal point, so it will be read back as a float.
+	if (strpbrk(buf, ".e") == nullptr) {
+		_json_append(r_out, ".0", 2);
+	}
+}
+
+Variant MessagePack::_read_recursive(mpack_reader_t &p_reader, DecodeBudget &r_budget, int p_depth) {
 	// critical check!
 	if (p_depth >= _RECURSION_MAX_DEPTH) {
 		mpack_reader_flag_error(&p_reader, mpack_error_too_big);
@@ -44,6 +460,18 @@ Variant MessagePack::_read_recursive(mpack_reader_t &p_reader, int p_depth) {
 		return Variant();
 	}
 
+	// critical check! every value takes from the message's budget.
+	uint64_t bytes = 0;
+	if (mpack_tag_type(&tag) == mpack_type_str) {
+		bytes = mpack_tag_str_length(&tag);
+	} else if (mpack_tag_type(&tag) == mpack_type_bin) {
+		bytes = mpack_tag_bin_length(&tag);
+	}
+	if (!r_budget.take(bytes)) {
+		mpack_reader_flag_error(&p_reader, mpack_error_too_big);
+		return Variant();
+	}
+
 	switch (mpack_tag_type(&tag)) {
 		case mpack_type_nil:
 			return Variant();
@@ -66,11 +494,6 @@ Variant MessagePack::_read_recursive(mpack_reader_t &p_reader, int p_depth) {
 			// NOTE: Use utf8 encoding
 			String str;
 			uint32_t len = mpack_tag_str_length(&tag);
-			// critical check! limit length to avoid a huge allocation
-			if (len >= _STR_MAX_SIZE) {
-				mpack_reader_flag_error(&p_reader, mpack_error_too_big);
-				return str;
-			}
 			const char *buf = mpack_read_bytes_inplace(&p_reader, len);
 			if (mpack_reader_error(&p_reader) == mpack_ok) {
 				if (len > 0) {
@@ -84,11 +507,6 @@ Variant MessagePack::_read_recursive(mpack_reader_t &p_reader, int p_depth) {
 		case mpack_type_bin: {
 			PackedByteArray bin_buf;
 			uint32_t len = mpack_tag_bin_length(&tag);
-			// critical check! limit length to avoid a huge allocation
-			if (len >= _BIN_MAX_SIZE) {
-				mpack_reader_flag_error(&p_reader, mpack_error_too_big);
-				return bin_buf;
-			}
 			const char *buf = mpack_read_bytes_inplace(&p_reader, len);
 			if (mpack_reader_error(&p_reader) == mpack_ok) {
 				if (len > 0) {
@@ -102,10 +520,15 @@ Variant MessagePack::_read_recursive(mpack_reader_t &p_reader, int p_depth) {
 		case mpack_type_array: {
 			Array arr;
 			uint32_t cnt = mpack_tag_array_count(&tag);
+			// critical check! limit length to avoid a huge allocation
+			if (!r_budget.fits_container(cnt)) {
+				mpack_reader_flag_error(&p_reader, mpack_error_too_big);
+				return arr;
+			}
 			if (cnt > 0) {
 				arr.resize(cnt);
 				for (uint32_t i = 0; i < cnt; i++) {
-					arr[i] = _read_recursive(p_reader, p_depth + 1);
+					arr[i] = _read_recursive(p_reader, r_budget, p_depth + 1);
 					if (mpack_reader_error(&p_reader) != mpack_ok) {
 						break;
 					}
@@ -117,10 +540,15 @@ Variant MessagePack::_read_recursive(mpack_reader_t &p_reader, int p_depth) {
 		case mpack_type_map: {
 			Dictionary map;
 			uint32_t cnt = mpack_tag_map_count(&tag);
+			// critical check! limit length to avoid a huge allocation
+			if (!r_budget.fits_container(uint64_t(cnt) * 2)) {
+				mpack_reader_flag_error(&p_reader, mpack_error_too_big);
+				return map;
+			}
 			Variant key, val;
 			for (uint32_t i = 0; i < cnt; i++) {
-				key = _read_recursive(p_reader, p_depth + 1);
-				val = _read_recursive(p_reader, p_depth + 1);
+				key = _read_recursive(p_reader, r_budget, p_depth + 1);
+				val = _read_recursive(p_reader, r_budget, p_depth + 1);
 				map[key] = val;
 				if (mpack_reader_error(&p_reader) != mpack_ok) {
 					break;
@@ -137,7 +565,84 @@ Variant MessagePack::_read_recursive(mpack_reader_t &p_reader, int p_depth) {
 	ERR_FAIL_V_MSG(Variant(), "The data type [" + String::num_int64(mpack_tag_type(&tag)) + "] is unsupported.");
 }
 
-void MessagePack::_write_recursive(mpack_writer_t &p_writer, Variant p_val, int p_depth) {
+// Canonical order of map keys: by type, then by value. Strings compare by code
+// point, which is the order of their utf8 bytes.
+struct CanonicalKeyLess {
+	static int _rank(const Variant &p_val) {
+		switch (p_val.get_type()) {
+			case Variant::NIL:
+				return 0;
+			case Variant::BOOL:
+				return 1;
+			case Variant::INT:
+				return 2;
+			case Variant::FLOAT:
+				return 3;
+			case Variant::STRING:
+			case Variant::STRING_NAME:
+				return 4;
+			case Variant::PACKED_BYTE_ARRAY:
+				return 5;
+			default:
+				return 6;
+		}
+	}
+
+	bool operator()(const Variant &p_a, const Variant &p_b) const {
+		int rank_a = _rank(p_a);
+		int rank_b = _rank(p_b);
+		if (rank_a != rank_b) {
+			return rank_a < rank_b;
+		}
+		switch (rank_a) {
+			case 1:
+			case 2:
+				return int64_t(p_a) < int64_t(p_b);
+			case 3:
+				return double(p_a) < double(p_b);
+			case 4:
+				return String(p_a) < String(p_b);
+			case 5: {
+				PackedByteArray a = p_a;
+				PackedByteArray b = p_b;
+				int cmp = memcmp(a.ptr(), b.ptr(), MIN(a.size(), b.size()));
+				return cmp != 0 ? cmp < 0 : a.size() < b.size();
+			}
+			case 6:
+				// Containers as keys, any stable order will do.
+				return uint64_t(MessagePack::hash(p_a)) < uint64_t(MessagePack::hash(p_b));
+			default:
+				return false;
+		}
+	}
+};
+
+void MessagePack::_write_real(mpack_writer_t &p_writer, double p_val, bool p_canonical) {
+	if (p_canonical) {
+		if (Math::is_nan(p_val)) {
+			// All the NaNs are written as the single precision quiet NaN.
+			uint32_t bits = 0x7FC00000;
+			float nan;
+			memcpy(&nan, &bits, sizeof(nan));
+			mpack_write_float(&p_writer, nan);
+			return;
+		}
+		if (p_val == 0.0) {
+			// -0.0 is written as 0.0
+			p_val = 0.0;
+		}
+	}
+	float f = p_val;
+	if (double(f) != p_val) {
+		// double precision float
+		mpack_write_double(&p_writer, p_val);
+	} else {
+		// single precision float
+		mpack_write_float(&p_writer, f);
+	}
+}
+
+void MessagePack::_write_recursive(mpack_writer_t &p_writer, Variant p_val, int p_depth, bool p_canonical) {
 	// critical check!
 	if (p_depth >= _RECURSION_MAX_DEPTH) {
 		mpack_writer_flag_error(&p_writer, mpack_error_too_big);
@@ -154,17 +659,9 @@ void MessagePack::_write_recursive(mpack_writer_t &p_writer, Variant p_val, int
 		case Variant::INT:
 			mpack_write_int(&p_writer, p_val);
 			break;
-		case Variant::FLOAT: {
-			double d = p_val;
-			float f = d;
-			if (double(f) != d) {
-				// double precision float
-				mpack_write_double(&p_writer, p_val);
-			} else {
-				// single precision float
-				mpack_write_float(&p_writer, p_val);
-			}
-		} break;
+		case Variant::FLOAT:
+			_write_real(p_writer, p_val, p_canonical);
+			break;
 		case Variant::STRING_NAME:
 		case Variant::STRING: {
 			// NOTE: Use utf8 encoding
@@ -184,7 +681,7 @@ void MessagePack::_write_recursive(mpack_writer_t &p_writer, Variant p_val, int
 			Array arr = p_val;
 			mpack_start_array(&p_writer, arr.size());
 			for (int i = 0; i < arr.size(); i++) {
-				_write_recursive(p_writer, arr[i], p_depth + 1);
+				_write_recursive(p_writer, arr[i], p_depth + 1, p_canonical);
 			}
 			mpack_finish_array(&p_writer);
 		} break;
@@ -203,7 +700,11 @@ void MessagePack::_write_recursive(mpack_writer_t &p_writer, Variant p_val, int
 			mpack_start_array(&p_writer, arr.size());
 			// Typed array write elememt one by one.
 			for (int i = 0; i < arr.size(); i++) {
-				mpack_write_float(&p_writer, arr[i]);
+				if (p_canonical) {
+					_write_real(p_writer, arr[i], true);
+				} else {
+					mpack_write_float(&p_writer, arr[i]);
+				}
 			}
 			mpack_finish_array(&p_writer);
 		} break;
@@ -212,7 +713,11 @@ void MessagePack::_write_recursive(mpack_writer_t &p_writer, Variant p_val, int
 			mpack_start_array(&p_writer, arr.size());
 			// Typed array write elememt one by one.
 			for (int i = 0; i < arr.size(); i++) {
-				mpack_write_double(&p_writer, arr[i]);
+				if (p_canonical) {
+					_write_real(p_writer, arr[i], true);
+				} else {
+					mpack_write_double(&p_writer, arr[i]);
+				}
 			}
 			mpack_finish_array(&p_writer);
 		} break;
@@ -230,6 +735,23 @@ void MessagePack::_write_recursive(mpack_writer_t &p_writer, Variant p_val, int
 		} break;
 		case Variant::DICTIONARY: {
 			Dictionary dict = p_val;
+			if (p_canonical) {
+				// Sorted keys, so equal dictionaries are encoded to the same bytes.
+				LocalVector<Variant> keys;
+				keys.reserve(dict.size());
+				const Variant *key = nullptr;
+				while ((key = dict.next(key))) {
+					keys.push_back(*key);
+				}
+				keys.sort_custom<CanonicalKeyLess>();
+				mpack_start_map(&p_writer, keys.size());
+				for (uint32_t i = 0; i < keys.size(); i++) {
+					_write_recursive(p_writer, keys[i], p_depth + 1, true);
+					_write_recursive(p_writer, *dict.getptr(keys[i]), p_depth + 1, true);
+				}
+				mpack_finish_map(&p_writer);
+				break;
+			}
 			Array keys = dict.keys();
 			Array vals = dict.values();
 			mpack_start_map(&p_writer, keys.size());
@@ -258,6 +780,16 @@ Variant MessagePack::_parse_node_recursive(mpack_node_t p_node, int p_depth) {
 				Variant(), "Parse recursive too deep.");
 	}
 
+	// critical check! every value takes from the message's budget.
+	uint64_t bytes = 0;
+	if (p_node.data->type == mpack_type_str || p_node.data->type == mpack_type_bin) {
+		bytes = p_node.data->len;
+	}
+	if (!budget.take(bytes)) {
+		mpack_tree_flag_error(p_node.tree, mpack_error_too_big);
+		return Variant();
+	}
+
 	switch (p_node.data->type) {
 		case mpack_type_nil:
 			mpack_node_nil(p_node);
@@ -298,10 +830,17 @@ Variant MessagePack::_parse_node_recursive(mpack_node_t p_node, int p_depth) {
 		case mpack_type_array: {
 			uint32_t len = mpack_node_array_length(p_node);
 			Array arr;
+			if (!budget.fits_container(len)) {
+				mpack_tree_flag_error(p_node.tree, mpack_error_too_big);
+				return arr;
+			}
 			if (len > 0) {
 				arr.resize(len);
 				for (uint32_t i = 0; i < len; i++) {
 					arr[i] = _parse_node_recursive(mpack_node_array_at(p_node, i), p_depth + 1);
+					if (mpack_tree_error(p_node.tree) != mpack_ok) {
+						break;
+					}
 				}
 			}
 			return arr;
@@ -309,11 +848,18 @@ Variant MessagePack::_parse_node_recursive(mpack_node_t p_node, int p_depth) {
 		case mpack_type_map: {
 			uint32_t len = mpack_node_map_count(p_node);
 			Dictionary map;
+			if (!budget.fits_container(uint64_t(len) * 2)) {
+				mpack_tree_flag_error(p_node.tree, mpack_error_too_big);
+				return map;
+			}
 			Variant key, val;
 			for (uint32_t i = 0; i < len; i++) {
 				key = _parse_node_recursive(mpack_node_map_key_at(p_node, i), p_depth + 1);
 				val = _parse_node_recursive(mpack_node_map_value_at(p_node, i), p_depth + 1);
 				map[key] = val;
+				if (mpack_tree_error(p_node.tree) != mpack_ok) {
+					break;
+				}
 			}
 			return map;
 		} break;
@@ -387,13 +933,17 @@ Error MessagePack::_got_error_or_not(mpack_error_t p_err, String &r_err_str) {
 	return FAILED;
 }
 
-Array MessagePack::decode(const PackedByteArray &p_msg_buf) {
+Array MessagePack::decode(const PackedByteArray &p_msg_buf, int64_t p_max_bytes, int64_t p_max_elements, int64_t p_max_container_length) {
 	mpack_reader_t reader;
 	PackedByteArray msg_buf = p_msg_buf;
 	const char *raw_ptr = (const char *)(msg_buf.ptr());
 	mpack_reader_init_data(&reader, raw_ptr, p_msg_buf.size());
 
-	Variant val = _read_recursive(reader, 0);
+	DecodeBudget msg_budget;
+	msg_budget.max_bytes = MAX(p_max_bytes, 0);
+	msg_budget.max_elements = MAX(p_max_elements, 0);
+	msg_budget.max_container_length = MAX(p_max_container_length, 0);
+	Variant val = _read_recursive(reader, msg_budget, 0);
 
 	int err_idx = 0;
 	if (mpack_reader_error(&reader) != mpack_ok) {
@@ -417,7 +967,7 @@ Array MessagePack::decode(const PackedByteArray &p_msg_buf) {
 	return result;
 }
 
-Array MessagePack::encode(const Variant &p_val) {
+Array MessagePack::encode(const Variant &p_val, bool p_canonical) {
 	String err_str = "";
 
 	char *buf;
@@ -425,7 +975,7 @@ Array MessagePack::encode(const Variant &p_val) {
 	mpack_writer_t writer;
 	mpack_writer_init_growable(&writer, &buf, &size);
 
-	_write_recursive(writer, p_val, 0);
+	_write_recursive(writer, p_val, 0, p_canonical);
 	Error err = _got_error_or_not(mpack_writer_destroy(&writer), err_str);
 
 	PackedByteArray msg_buf;
@@ -447,6 +997,583 @@ Array MessagePack::encode(const Variant &p_val) {
 	return result;
 }
 
+Error MessagePack::_json_transcode(const String &p_json, mpack_writer_t *p_writer, LocalVector<uint32_t> &r_counts, LocalVector<uint8_t> &r_kinds, String &r_err_str, int &r_err_idx) {
+	// NOTE: MessagePack needs the element count before the elements, so this runs twice.
+	// The first pass (without writer) validates the text and counts the elements of
+	// every container, the second pass writes the tokens straight to the writer.
+	enum State {
+		ST_VALUE,
+		ST_VALUE_OR_CLOSE,
+		ST_KEY,
+		ST_KEY_OR_CLOSE,
+		ST_COLON,
+		ST_COMMA_OR_CLOSE,
+		ST_EOF,
+	};
+
+	struct Frame {
+		uint32_t container = 0; // Index into r_counts and r_kinds.
+		uint32_t items = 0; // Values for arrays, keys for objects.
+		bool is_object = false;
+		JSONContainerKind kind = JSON_CONTAINER_ARRAY;
+		int8_t ext_type = 0;
+	};
+
+	const char32_t *str = p_json.ptr();
+	const int len = p_json.length();
+	const bool counting = p_writer == nullptr;
+	int idx = 0;
+
+	Frame stack[_RECURSION_MAX_DEPTH];
+	int depth = 0;
+	uint32_t next_container = 0;
+	State state = ST_VALUE;
+	JSONToken tk;
+	// Reused for every string token and base64 payload.
+	LocalVector<uint8_t> str_buf;
+	LocalVector<uint8_t> bin_buf;
+
+	while (true) {
+		r_err_idx = idx;
+		Error err = _json_get_token(str, len, idx, tk, str_buf, r_err_str);
+		if (err != OK) {
+			return err;
+		}
+
+		if (state == ST_EOF) {
+			if (tk.type != JSON_TK_EOF) {
+				r_err_str = "Expected end of data after the root value.";
+				return ERR_PARSE_ERROR;
+			}
+			return OK;
+		}
+		if (tk.type == JSON_TK_EOF) {
+			r_err_str = "Unexpected end of data.";
+			return ERR_PARSE_ERROR;
+		}
+		if (state == ST_COLON) {
+			if (tk.type != JSON_TK_COLON) {
+				r_err_str = "Expected ':'.";
+				return ERR_PARSE_ERROR;
+			}
+			state = ST_VALUE;
+			continue;
+		}
+
+		if (state == ST_COMMA_OR_CLOSE || state == ST_KEY_OR_CLOSE || state == ST_VALUE_OR_CLOSE) {
+			Frame &f = stack[depth - 1];
+			if (tk.type == (f.is_object ? JSON_TK_CURLY_CLOSE : JSON_TK_BRACKET_CLOSE)) {
+				if (counting) {
+					r_counts[f.container] = f.items;
+					if (f.kind == JSON_CONTAINER_BIN && f.items != 1) {
+						f.kind = JSON_CONTAINER_MAP;
+					} else if (f.kind == JSON_CONTAINER_EXT && f.items != 2) {
+						f.kind = JSON_CONTAINER_MAP;
+					}
+					r_kinds[f.container] = f.kind;
+				} else if (f.kind == JSON_CONTAINER_MAP) {
+					mpack_finish_map(p_writer);
+				} else if (f.kind == JSON_CONTAINER_ARRAY) {
+					mpack_finish_array(p_writer);
+				}
+				depth--;
+				state = depth == 0 ? ST_EOF : ST_COMMA_OR_CLOSE;
+				continue;
+			}
+			if (state == ST_COMMA_OR_CLOSE) {
+				if (tk.type != JSON_TK_COMMA) {
+					r_err_str = "Expected ',' or the end of the container.";
+					return ERR_PARSE_ERROR;
+				}
+				state = f.is_object ? ST_KEY : ST_VALUE;
+				continue;
+			}
+			state = f.is_object ? ST_KEY : ST_VALUE;
+		}
+
+		if (state == ST_KEY) {
+			if (tk.type != JSON_TK_STRING) {
+				r_err_str = "Expected a string key.";
+				return ERR_PARSE_ERROR;
+			}
+			Frame &f = stack[depth - 1];
+			f.items++;
+			if (counting) {
+				// Detect the tagged objects of binary data and extension types.
+				if (f.items == 1) {
+					if (_json_key_equals(str_buf, "$bin")) {
+						f.kind = JSON_CONTAINER_BIN;
+					} else if (_json_key_equals(str_buf, "$ext")) {
+						f.kind = JSON_CONTAINER_EXT;
+					}
+				} else if (f.items > 2 || f.kind != JSON_CONTAINER_EXT || !_json_key_equals(str_buf, "$data")) {
+					f.kind = JSON_CONTAINER_MAP;
+				}
+			} else if (f.kind == JSON_CONTAINER_MAP) {
+				mpack_write_str(p_writer, (const char *)str_buf.ptr(), str_buf.size());
+			}
+			state = ST_COLON;
+			continue;
+		}
+
+		// ST_VALUE
+		Frame *parent = depth > 0 ? &stack[depth - 1] : nullptr;
+		if (parent && !parent->is_object) {
+			parent->items++;
+		}
+		if (parent && parent->kind != JSON_CONTAINER_ARRAY && parent->kind != JSON_CONTAINER_MAP) {
+			bool is_payload = parent->kind == JSON_CONTAINER_BIN || parent->items == 2;
+			if (counting) {
+				bool valid = is_payload ? tk.type == JSON_TK_STRING : (tk.type == JSON_TK_NUMBER && tk.num_type == JSON_NUM_INT && tk.i >= INT8_MIN && tk.i <= INT8_MAX);
+				if (!valid) {
+					parent->kind = JSON_CONTAINER_MAP;
+				}
+			} else if (!is_payload) {
+				parent->ext_type = tk.i;
+				state = ST_COMMA_OR_CLOSE;
+				continue;
+			} else {
+				size_t bin_len = 0;
+				if (_json_decode_base64(str_buf, bin_buf, bin_len) != OK) {
+					r_err_str = "Invalid base64 data.";
+					return ERR_INVALID_DATA;
+				}
+				if (parent->kind == JSON_CONTAINER_BIN) {
+					mpack_write_bin(p_writer, (const char *)bin_buf.ptr(), bin_len);
+				} else {
+#if MPACK_EXTENSIONS
+					mpack_write_ext(p_writer, parent->ext_type, (const char *)bin_buf.ptr(), bin_len);
+#else
+					r_err_str = "Extension types are not supported by this configuration of MPack.";
+					return ERR_UNCONFIGURED;
+#endif
+				}
+				state = ST_COMMA_OR_CLOSE;
+				continue;
+			}
+		}
+
+		switch (tk.type) {
+			case JSON_TK_CURLY_OPEN:
+			case JSON_TK_BRACKET_OPEN: {
+				if (depth >= _RECURSION_MAX_DEPTH) {
+					r_err_str = "Parse recursive too deep.";
+					return ERR_OUT_OF_MEMORY;
+				}
+				Frame &f = stack[depth++];
+				f.items = 0;
+				f.is_object = tk.type == JSON_TK_CURLY_OPEN;
+				if (counting) {
+					f.container = r_counts.size();
+					f.kind = f.is_object ? JSON_CONTAINER_MAP : JSON_CONTAINER_ARRAY;
+					r_counts.push_back(0);
+					r_kinds.push_back(f.kind);
+				} else {
+					ERR_FAIL_COND_V(next_container >= r_counts.size(), ERR_BUG);
+					f.container = next_container++;
+					f.kind = JSONContainerKind(r_kinds[f.container]);
+					if (f.kind == JSON_CONTAINER_MAP) {
+						mpack_start_map(p_writer, r_counts[f.container]);
+					} else if (f.kind == JSON_CONTAINER_ARRAY) {
+						mpack_start_array(p_writer, r_counts[f.container]);
+					}
+				}
+				state = f.is_object ? ST_KEY_OR_CLOSE : ST_VALUE_OR_CLOSE;
+				continue;
+			} break;
+			case JSON_TK_STRING:
+				if (!counting) {
+					mpack_write_str(p_writer, (const char *)str_buf.ptr(), str_buf.size());
+				}
+				break;
+			case JSON_TK_NUMBER:
+				if (counting) {
+					break;
+				}
+				if (tk.num_type == JSON_NUM_INT) {
+					mpack_write_int(p_writer, tk.i);
+				} else if (tk.num_type == JSON_NUM_UINT) {
+					mpack_write_uint(p_writer, tk.u);
+				} else if (double(float(tk.d)) != tk.d) {
+					mpack_write_double(p_writer, tk.d);
+				} else {
+					mpack_write_float(p_writer, tk.d);
+				}
+				break;
+			case JSON_TK_TRUE:
+			case JSON_TK_FALSE:
+				if (!counting) {
+					mpack_write_bool(p_writer, tk.type == JSON_TK_TRUE);
+				}
+				break;
+			case JSON_TK_NULL:
+				if (!counting) {
+					mpack_write_nil(p_writer);
+				}
+				break;
+			default:
+				r_err_str = "Unexpected token.";
+				return ERR_PARSE_ERROR;
+		}
+		state = depth == 0 ? ST_EOF : ST_COMMA_OR_CLOSE;
+	}
+}
+
+Array MessagePack::from_json(const String &p_json) {
+	LocalVector<uint32_t> counts;
+	LocalVector<uint8_t> kinds;
+	String err_str = "";
+	int err_idx = 0;
+
+	PackedByteArray msg_buf;
+	Error err = _json_transcode(p_json, nullptr, counts, kinds, err_str, err_idx);
+	if (err == OK) {
+		char *buf = nullptr;
+		size_t size = 0;
+		mpack_writer_t writer;
+		mpack_writer_init_growable(&writer, &buf, &size);
+
+		err = _json_transcode(p_json, &writer, counts, kinds, err_str, err_idx);
+		if (err != OK) {
+			mpack_writer_flag_error(&writer, mpack_error_data);
+			mpack_writer_destroy(&writer);
+		} else {
+			err = _got_error_or_not(mpack_writer_destroy(&writer), err_str);
+		}
+		if (err == OK && size > 0) {
+			msg_buf.resize(size);
+			memcpy(msg_buf.ptrw(), buf, size);
+		}
+		if (buf) {
+			free(buf);
+		}
+	}
+
+	Array result;
+	if (err == OK) {
+		result.resize(2);
+		result[0] = err;
+		result[1] = msg_buf;
+	} else {
+		result.resize(3);
+		result[0] = err;
+		result[1] = err_str;
+		result[2] = err_idx;
+	}
+	return result;
+}
+
+Array MessagePack::to_json(const PackedByteArray &p_msg_buf) {
+	struct Frame {
+		uint32_t total = 0;
+		uint32_t left = 0;
+		bool is_map = false;
+	};
+
+	mpack_reader_t reader;
+	const char *raw_ptr = (const char *)(p_msg_buf.ptr());
+	mpack_reader_init_data(&reader, raw_ptr, p_msg_buf.size());
+
+	// Containers are tracked with an explicit stack, the output is the only allocation.
+	Frame stack[_RECURSION_MAX_DEPTH];
+	int depth = 0;
+	bool root_read = false;
+	LocalVector<uint8_t> out;
+	char num_buf[32];
+	String err_str = "";
+	Error err = OK;
+
+	while (err == OK && mpack_reader_error(&reader) == mpack_ok) {
+		while (depth > 0 && stack[depth - 1].left == 0) {
+			if (stack[depth - 1].is_map) {
+				out.push_back('}');
+				mpack_done_map(&reader);
+			} else {
+				out.push_back(']');
+				mpack_done_array(&reader);
+			}
+			depth--;
+		}
+		if (depth == 0 && root_read) {
+			break;
+		}
+		root_read = true;
+
+		bool is_key = false;
+		if (depth > 0) {
+			Frame &f = stack[depth - 1];
+			uint32_t pos = f.total - f.left;
+			if (f.is_map) {
+				is_key = (pos % 2) == 0;
+				if (pos > 0) {
+					out.push_back(is_key ? ',' : ':');
+				}
+			} else if (pos > 0) {
+				out.push_back(',');
+			}
+			f.left--;
+		}
+
+		mpack_tag_t tag = mpack_read_tag(&reader);
+		if (mpack_reader_error(&reader) != mpack_ok) {
+			break;
+		}
+
+		// JSON keys must be strings, scalar keys are written as quoted text.
+		switch (mpack_tag_type(&tag)) {
+			case mpack_type_nil:
+				_json_append(out, is_key ? "\"null\"" : "null");
+				break;
+			case mpack_type_bool:
+				if (mpack_tag_bool_value(&tag)) {
+					_json_append(out, is_key ? "\"true\"" : "true");
+				} else {
+					_json_append(out, is_key ? "\"false\"" : "false");
+				}
+				break;
+			case mpack_type_int:
+			case mpack_type_uint: {
+				int len;
+				if (mpack_tag_type(&tag) == mpack_type_int) {
+					len = snprintf(num_buf, sizeof(num_buf), is_key ? "\"%lld\"" : "%lld", (long long)mpack_tag_int_value(&tag));
+				} else {
+					len = snprintf(num_buf, sizeof(num_buf), is_key ? "\"%llu\"" : "%llu", (unsigned long long)mpack_tag_uint_value(&tag));
+				}
+				_json_append(out, num_buf, len);
+			} break;
+			case mpack_type_float:
+			case mpack_type_double: {
+				if (is_key) {
+					out.push_back('"');
+				}
+				if (mpack_tag_type(&tag) == mpack_type_float) {
+					_json_append_double(out, mpack_tag_float_value(&tag), true);
+				} else {
+					_json_append_double(out, mpack_tag_double_value(&tag), false);
+				}
+				if (is_key) {
+					out.push_back('"');
+				}
+			} break;
+			case mpack_type_str: {
+				uint32_t len = mpack_tag_str_length(&tag);
+				const char *buf = len > 0 ? mpack_read_bytes_inplace(&reader, len) : "";
+				if (mpack_reader_error(&reader) == mpack_ok) {
+					_json_append_escaped(out, buf, len);
+				}
+				mpack_done_str(&reader);
+			} break;
+			case mpack_type_bin: {
+				if (is_key) {
+					err = ERR_INVALID_DATA;
+					err_str = "Binary data can't be used as a JSON key.";
+					break;
+				}
+				uint32_t len = mpack_tag_bin_length(&tag);
+				const char *buf = len > 0 ? mpack_read_bytes_inplace(&reader, len) : "";
+				if (mpack_reader_error(&reader) == mpack_ok) {
+					_json_append(out, "{\"$bin\":");
+					_json_append_base64(out, buf, len);
+					out.push_back('}');
+				}
+				mpack_done_bin(&reader);
+			} break;
+#if MPACK_EXTENSIONS
+			case mpack_type_ext: {
+				if (is_key) {
+					err = ERR_INVALID_DATA;
+					err_str = "Extension data can't be used as a JSON key.";
+					break;
+				}
+				uint32_t len = mpack_tag_ext_length(&tag);
+				const char *buf = len > 0 ? mpack_read_bytes_inplace(&reader, len) : "";
+				if (mpack_reader_error(&reader) == mpack_ok) {
+					int num_len = snprintf(num_buf, sizeof(num_buf), "{\"$ext\":%d,\"$data\":", (int)mpack_tag_ext_exttype(&tag));
+					_json_append(out, num_buf, num_len);
+					_json_append_base64(out, buf, len);
+					out.push_back('}');
+				}
+				mpack_done_ext(&reader);
+			} break;
+#endif
+			case mpack_type_array:
+			case mpack_type_map: {
+				if (is_key) {
+					err = ERR_INVALID_DATA;
+					err_str = "Containers can't be used as a JSON key.";
+					break;
+				}
+				if (depth >= _RECURSION_MAX_DEPTH) {
+					mpack_reader_flag_error(&reader, mpack_error_too_big);
+					break;
+				}
+				Frame &f = stack[depth++];
+				f.is_map = mpack_tag_type(&tag) == mpack_type_map;
+				f.total = f.is_map ? mpack_tag_map_count(&tag) * 2 : mpack_tag_array_count(&tag);
+				f.left = f.total;
+				out.push_back(f.is_map ? '{' : '[');
+			} break;
+			default:
+				mpack_reader_flag_error(&reader, mpack_error_unsupported);
+				break;
+		}
+	}
+
+	int err_idx = int(reader.data - raw_ptr);
+	if (err != OK) {
+		mpack_reader_flag_error(&reader, mpack_error_data);
+		mpack_reader_destroy(&reader);
+	} else {
+		err = _got_error_or_not(mpack_reader_destroy(&reader), err_str);
+	}
+
+	Array result;
+	if (err == OK) {
+		String json;
+		json.parse_utf8((const char *)out.ptr(), out.size());
+		result.resize(2);
+		result[0] = err;
+		result[1] = json;
+	} else {
+		result.resize(3);
+		result[0] = err;
+		result[1] = err_str;
+		result[2] = err_idx;
+	}
+	return result;
+}
+
+// Streaming xxHash64, fed by the writer's flush callback.
+struct CanonicalHasher {
+	static const uint64_t PRIME1 = 11400714785074694791ULL;
+	static const uint64_t PRIME2 = 14029467366897019727ULL;
+	static const uint64_t PRIME3 = 1609587929392839161ULL;
+	static const uint64_t PRIME4 = 9650029242287828579ULL;
+	static const uint64_t PRIME5 = 2870177450012600261ULL;
+
+	uint64_t acc[4] = { PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1 };
+	uint64_t total = 0;
+	uint8_t mem[32];
+	uint32_t mem_size = 0;
+
+	static _FORCE_INLINE_ uint64_t _rotl(uint64_t p_val, int p_bits) {
+		return (p_val << p_bits) | (p_val >> (64 - p_bits));
+	}
+	static _FORCE_INLINE_ uint64_t _read64(const uint8_t *p_ptr) {
+		uint64_t val = 0;
+		for (int i = 7; i >= 0; i--) {
+			val = (val << 8) | p_ptr[i];
+		}
+		return val;
+	}
+	static _FORCE_INLINE_ uint64_t _round(uint64_t p_acc, uint64_t p_input) {
+		p_acc += p_input * PRIME2;
+		return _rotl(p_acc, 31) * PRIME1;
+	}
+	static _FORCE_INLINE_ uint64_t _merge(uint64_t p_acc, uint64_t p_val) {
+		p_acc ^= _round(0, p_val);
+		return p_acc * PRIME1 + PRIME4;
+	}
+
+	void update(const uint8_t *p_data, size_t p_len) {
+		total += p_len;
+		if (mem_size + p_len < 32) {
+			memcpy(mem + mem_size, p_data, p_len);
+			mem_size += p_len;
+			return;
+		}
+		if (mem_size > 0) {
+			uint32_t fill = 32 - mem_size;
+			memcpy(mem + mem_size, p_data, fill);
+			for (int i = 0; i < 4; i++) {
+				acc[i] = _round(acc[i], _read64(mem + i * 8));
+			}
+			p_data += fill;
+			p_len -= fill;
+			mem_size = 0;
+		}
+		while (p_len >= 32) {
+			for (int i = 0; i < 4; i++) {
+				acc[i] = _round(acc[i], _read64(p_data + i * 8));
+			}
+			p_data += 32;
+			p_len -= 32;
+		}
+		memcpy(mem, p_data, p_len);
+		mem_size = p_len;
+	}
+
+	uint64_t digest() const {
+		uint64_t h;
+		if (total >= 32) {
+			h = _rotl(acc[0], 1) + _rotl(acc[1], 7) + _rotl(acc[2], 12) + _rotl(acc[3], 18);
+			for (int i = 0; i < 4; i++) {
+				h = _merge(h, acc[i]);
+			}
+		} else {
+			h = acc[2] + PRIME5;
+		}
+		h += total;
+
+		const uint8_t *p = mem;
+		uint32_t len = mem_size;
+		while (len >= 8) {
+			h ^= _round(0, _read64(p));
+			h = _rotl(h, 27) * PRIME1 + PRIME4;
+			p += 8;
+			len -= 8;
+		}
+		if (len >= 4) {
+			uint64_t val = uint64_t(p[0]) | (uint64_t(p[1]) << 8) | (uint64_t(p[2]) << 16) | (uint64_t(p[3]) << 24);
+			h ^= val * PRIME1;
+			h = _rotl(h, 23) * PRIME2 + PRIME3;
+			p += 4;
+			len -= 4;
+		}
+		while (len > 0) {
+			h ^= (*p) * PRIME5;
+			h = _rotl(h, 11) * PRIME1;
+			p++;
+			len--;
+		}
+
+		h ^= h >> 33;
+		h *= PRIME2;
+		h ^= h >> 29;
+		h *= PRIME3;
+		h ^= h >> 32;
+		return h;
+	}
+};
+
+void MessagePack::_hash_flush(mpack_writer_t *p_writer, const char *p_buffer, size_t p_count) {
+	CanonicalHasher *hasher = (CanonicalHasher *)mpack_writer_context(p_writer);
+	hasher->update((const uint8_t *)p_buffer, p_count);
+}
+
+uint64_t MessagePack::hash_bytes(const uint8_t *p_data, uint32_t p_size) {
+	CanonicalHasher hasher;
+	hasher.update(p_data, p_size);
+	return hasher.digest();
+}
+
+int64_t MessagePack::hash(const Variant &p_val) {
+	// The canonical bytes go through a small buffer straight into the hash,
+	// the encoded message is never built.
+	char buf[4096];
+	CanonicalHasher hasher;
+	mpack_writer_t writer;
+	mpack_writer_init(&writer, buf, sizeof(buf));
+	mpack_writer_set_context(&writer, &hasher);
+	mpack_writer_set_flush(&writer, _hash_flush);
+
+	_write_recursive(writer, p_val, 0, true);
+	String err_str;
+	Error err = _got_error_or_not(mpack_writer_destroy(&writer), err_str);
+	ERR_FAIL_COND_V_MSG(err != OK, 0, "Hash failed: " + err_str);
+	return hasher.digest();
+}
+
 size_t MessagePack::_read_stream(mpack_tree_t *p_tree, char *r_buffer, size_t p_count) {
 	MessagePack *msgpack = (MessagePack *)mpack_tree_context(p_tree);
 	size_t bytes_left = msgpack->stream_tail - msgpack->stream_head;
@@ -459,10 +1586,44 @@ size_t MessagePack::_read_stream(mpack_tree_t *p_tree, char *r_buffer, size_t p_
 	return read_size;
 }
 
+size_t MessagePack::_read_source(mpack_tree_t *p_tree, char *r_buffer, size_t p_count) {
+	// NOTE: Must not block, returning 0 makes the parser wait for more data.
+	MessagePack *msgpack = (MessagePack *)mpack_tree_context(p_tree);
+	if (msgpack->source_peer.is_valid()) {
+		int available = msgpack->source_peer->get_available_bytes();
+		if (available <= 0) {
+			return 0;
+		}
+		int read = 0;
+		Error err = msgpack->source_peer->get_partial_data((uint8_t *)r_buffer, MIN(p_count, (size_t)available), read);
+		if (err != OK) {
+			mpack_tree_flag_error(p_tree, mpack_error_io);
+			return 0;
+		}
+		msgpack->source_read += read;
+		return read;
+	} else if (msgpack->source_file.is_valid()) {
+		// The length is checked every time, so a file still being written can be followed.
+		uint64_t left = msgpack->source_file->get_length() - msgpack->source_file->get_position();
+		if (left == 0) {
+			return 0;
+		}
+		uint64_t read = msgpack->source_file->get_buffer((uint8_t *)r_buffer, MIN((uint64_t)p_count, left));
+		msgpack->source_read += read;
+		return read;
+	}
+	mpack_tree_flag_error(p_tree, mpack_error_io);
+	return 0;
+}
+
 void MessagePack::start_stream_with_reader(const Callback p_reader, void *context, int p_msgs_max) {
 	if (started) {
 		mpack_tree_destroy(&tree);
 	}
+	source_peer.unref();
+	source_file.unref();
+	source_read = 0;
+	source_parsed = 0;
 	err_msg = "";
 	data = Variant();
 	mpack_tree_init_stream(&tree, p_reader, context, p_msgs_max, _NODE_MAX_SIZE);
@@ -470,6 +1631,14 @@ void MessagePack::start_stream_with_reader(const Callback p_reader, void *contex
 }
 
 Error MessagePack::try_parse_stream() {
+	Error err = try_parse_stream_tree();
+	if (err != OK) {
+		return err;
+	}
+	return decode_stream_tree();
+}
+
+Error MessagePack::try_parse_stream_tree() {
 	if (!mpack_tree_try_parse(&tree)) {
 		// if false, error or wating.
 		Error err = _got_error_or_not(mpack_tree_error(&tree), err_msg);
@@ -477,9 +1646,19 @@ Error MessagePack::try_parse_stream() {
 		err_msg = "Waiting for new data.";
 		return ERR_SKIP;
 	}
+	return OK;
+}
+
+Error MessagePack::decode_stream_tree() {
 	// if true, got data.
 	mpack_node_t root = mpack_tree_root(&tree);
+	budget.reset();
 	data = _parse_node_recursive(root, 0);
+	Error err = _got_error_or_not(mpack_tree_error(&tree), err_msg);
+	if (err != OK) {
+		data = Variant();
+		ERR_FAIL_V_MSG(err, "Parse failed: " + err_msg);
+	}
 
 	return OK;
 }
@@ -498,12 +1677,73 @@ Error MessagePack::update_stream(const PackedByteArray &p_data, int p_from, int
 	return try_parse_stream();
 }
 
+Error MessagePack::start_stream_from(Object *p_source, int p_msgs_max) {
+	Ref<StreamPeer> peer = Object::cast_to<StreamPeer>(p_source);
+	Ref<FileAccess> file = Object::cast_to<FileAccess>(p_source);
+	ERR_FAIL_COND_V_MSG(peer.is_null() && file.is_null(), ERR_INVALID_PARAMETER, "The source must be a StreamPeer or a FileAccess.");
+
+	start_stream_with_reader(_read_source, this, p_msgs_max);
+	source_peer = peer;
+	source_file = file;
+	return OK;
+}
+
+Error MessagePack::poll_stream() {
+	ERR_FAIL_COND_V_MSG(source_peer.is_null() && source_file.is_null(), ERR_UNCONFIGURED, "Call start_stream_from first.");
+	StreamPeerTCP *tcp = Object::cast_to<StreamPeerTCP>(source_peer.ptr());
+	if (tcp) {
+		tcp->poll();
+	}
+	Error err = try_parse_stream_tree();
+	if (err == OK) {
+		source_parsed += mpack_tree_size(&tree);
+		return decode_stream_tree();
+	}
+	if (err != ERR_SKIP || !tcp || tcp->get_status() == StreamPeerTCP::STATUS_CONNECTED || tcp->get_available_bytes() > 0) {
+		return err;
+	}
+	// The peer is gone and everything it sent has been parsed, or never will be.
+	if (source_read > source_parsed) {
+		err_msg = "Connection closed in the middle of a message.";
+		return ERR_CONNECTION_ERROR;
+	}
+	err_msg = "Connection closed.";
+	return ERR_FILE_EOF;
+}
+
 #if MPACK_EXTENSIONS
 void MessagePack::register_extension_type(int8_t p_ext_type, const Callable &p_decoder) {
 	ext_decoder[p_ext_type] = p_decoder;
 }
 #endif
 
+void MessagePack::set_max_decode_bytes(int64_t p_max_bytes) {
+	ERR_FAIL_COND(p_max_bytes < 0);
+	budget.max_bytes = p_max_bytes;
+}
+
+int64_t MessagePack::get_max_decode_bytes() const {
+	return budget.max_bytes;
+}
+
+void MessagePack::set_max_decode_elements(int64_t p_max_elements) {
+	ERR_FAIL_COND(p_max_elements < 0);
+	budget.max_elements = p_max_elements;
+}
+
+int64_t MessagePack::get_max_decode_elements() const {
+	return budget.max_elements;
+}
+
+void MessagePack::set_max_container_length(int64_t p_max_length) {
+	ERR_FAIL_COND(p_max_length < 0);
+	budget.max_container_length = p_max_length;
+}
+
+int64_t MessagePack::get_max_container_length() const {
+	return budget.max_container_length;
+}
+
 MessagePack::MessagePack() {
 }
 
@@ -514,8 +1754,11 @@ MessagePack::~MessagePack() {
 }
 
 void MessagePack::_bind_methods() {
-	ClassDB::bind_static_method("MessagePack", D_METHOD("decode", "msg_buf"), &MessagePack::decode);
-	ClassDB::bind_static_method("MessagePack", D_METHOD("encode", "data"), &MessagePack::encode);
+	ClassDB::bind_static_method("MessagePack", D_METHOD("decode", "msg_buf", "max_bytes", "max_elements", "max_container_length"), &MessagePack::decode, DEFVAL(_DECODE_MAX_BYTES), DEFVAL(_DECODE_MAX_ELEMENTS), DEFVAL(_DECODE_MAX_CONTAINER_LENGTH));
+	ClassDB::bind_static_method("MessagePack", D_METHOD("encode", "data", "canonical"), &MessagePack::encode, DEFVAL(false));
+	ClassDB::bind_static_method("MessagePack", D_METHOD("hash", "data"), &MessagePack::hash);
+	ClassDB::bind_static_method("MessagePack", D_METHOD("from_json", "json"), &MessagePack::from_json);
+	ClassDB::bind_static_method("MessagePack", D_METHOD("to_json", "msg_buf"), &MessagePack::to_json);
 
 #if MPACK_EXTENSIONS
 	ClassDB::bind_method(D_METHOD("register_extension_type", "type_id", "decoder"), &MessagePack::register_extension_type);
@@ -523,7 +1766,20 @@ void MessagePack::_bind_methods() {
 
 	ClassDB::bind_method(D_METHOD("start_stream", "msgs_max"), &MessagePack::start_stream, DEFVAL(_MSG_MAX_SIZE));
 	ClassDB::bind_method(D_METHOD("update_stream", "data", "from", "to"), &MessagePack::update_stream, DEFVAL(0), DEFVAL(INT_MAX));
+	ClassDB::bind_method(D_METHOD("start_stream_from", "source", "msgs_max"), &MessagePack::start_stream_from, DEFVAL(_MSG_MAX_SIZE));
+	ClassDB::bind_method(D_METHOD("poll_stream"), &MessagePack::poll_stream);
 	ClassDB::bind_method(D_METHOD("get_data"), &MessagePack::get_data);
 	ClassDB::bind_method(D_METHOD("get_current_stream_length"), &MessagePack::get_current_stream_length);
 	ClassDB::bind_method(D_METHOD("get_error_message"), &MessagePack::get_error_message);
+
+	ClassDB::bind_method(D_METHOD("set_max_decode_bytes", "max_bytes"), &MessagePack::set_max_decode_bytes);
+	ClassDB::bind_method(D_METHOD("get_max_decode_bytes"), &MessagePack::get_max_decode_bytes);
+	ClassDB::bind_method(D_METHOD("set_max_decode_elements", "max_elements"), &MessagePack::set_max_decode_elements);
+	ClassDB::bind_method(D_METHOD("get_max_decode_elements"), &MessagePack::get_max_decode_elements);
+	ClassDB::bind_method(D_METHOD("set_max_container_length", "max_length"), &MessagePack::set_max_container_length);
+	ClassDB::bind_method(D_METHOD("get_max_container_length"), &MessagePack::get_max_container_length);
+
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "max_decode_bytes"), "set_max_decode_bytes", "get_max_decode_bytes");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "max_decode_elements"), "set_max_decode_elements", "get_max_decode_elements");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "max_container_length"), "set_max_container_length", "get_max_container_length");
 }
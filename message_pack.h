@@ -31,8 +31,11 @@
 #ifndef MESSAGE_PACK_H
 #define MESSAGE_PACK_H
 
+#include "core/io/file_access.h"
+#include "core/io/stream_peer.h"
 #include "core/object/ref_counted.h"
 #include "core/string/ustring.h"
+#include "core/templates/local_vector.h"
 #include "core/templates/rb_map.h"
 #include "core/templates/vector.h"
 #include "core/variant/array.h"
@@ -47,20 +50,52 @@
 #define _MSG_MAX_SIZE (1 << 23)
 // Default maximum node size
 #define _NODE_MAX_SIZE (1 << 20)
-// String length limit: 1MB
-#define _STR_MAX_SIZE (1 << 20)
-// Binary data size limit in bytes: 1MB
-#define _BIN_MAX_SIZE (1 << 20)
+// Default decode budget, bytes of strings and binary data materialized per message: 64MB
+#define _DECODE_MAX_BYTES (1 << 26)
+// Default decode budget, values created per message
+#define _DECODE_MAX_ELEMENTS (1 << 20)
+// Default decode budget, elements of a single array or map
+#define _DECODE_MAX_CONTAINER_LENGTH (1 << 20)
 
 class MessagePack : public Object {
 	GDCLASS(MessagePack, Object);
 
+public:
+	// Limits what a single decoded message may materialize, so a hostile message
+	// can't make the decoder allocate without bound.
+	struct DecodeBudget {
+		uint64_t max_bytes = _DECODE_MAX_BYTES;
+		uint64_t max_elements = _DECODE_MAX_ELEMENTS;
+		uint64_t max_container_length = _DECODE_MAX_CONTAINER_LENGTH;
+
+		uint64_t bytes = 0;
+		uint64_t elements = 0;
+
+		_FORCE_INLINE_ void reset() {
+			bytes = 0;
+			elements = 0;
+		}
+		// Returns false when the value doesn't fit in the budget.
+		_FORCE_INLINE_ bool take(uint64_t p_bytes) {
+			elements += 1;
+			bytes += p_bytes;
+			return elements <= max_elements && bytes <= max_bytes;
+		}
+		// Checked before allocating a container, its elements are taken when read.
+		_FORCE_INLINE_ bool fits_container(uint64_t p_length) const {
+			return p_length <= max_container_length && elements + p_length <= max_elements;
+		}
+	};
+
+private:
+
 #if MPACK_EXTENSIONS
 	HashMap<int8_t, Callable> ext_decoder;
 #endif
 
 	Variant data;
 	String err_msg;
+	DecodeBudget budget;
 	mpack_tree_t tree;
 	bool started = false;
 
@@ -68,13 +103,25 @@ class MessagePack : public Object {
 	int stream_head;
 	int stream_tail;
 
+	Ref<StreamPeer> source_peer;
+	Ref<FileAccess> source_file;
+	// Bytes pulled from the source and bytes of the messages parsed out of them,
+	// they differ while a message is only partially received.
+	uint64_t source_read = 0;
+	uint64_t source_parsed = 0;
+
 	static Error _got_error_or_not(mpack_error_t p_err, String &r_err_str);
 	Variant _parse_node_recursive(mpack_node_t p_node, int p_depth);
 
 	static size_t _read_stream(mpack_tree_t *p_tree, char *r_buffer, size_t p_count);
+	static size_t _read_source(mpack_tree_t *p_tree, char *r_buffer, size_t p_count);
+
+	static Variant _read_recursive(mpack_reader_t &p_reader, DecodeBudget &r_budget, int p_depth);
+	static void _write_recursive(mpack_writer_t &p_writer, Variant p_val, int p_depth, bool p_canonical = false);
+	static void _write_real(mpack_writer_t &p_writer, double p_val, bool p_canonical);
+	static void _hash_flush(mpack_writer_t *p_writer, const char *p_buffer, size_t p_count);
 
-	static Variant _read_recursive(mpack_reader_t &p_reader, int p_depth);
-	static void _write_recursive(mpack_writer_t &p_writer, Variant p_val, int p_depth);
+	static Error _json_transcode(const String &p_json, mpack_writer_t *p_writer, LocalVector<uint32_t> &r_counts, LocalVector<uint8_t> &r_kinds, String &r_err_str, int &r_err_idx);
 
 	typedef size_t (*Callback)(mpack_tree_t *p_tree, char *r_buffer, size_t p_count);
 
@@ -82,21 +129,42 @@ protected:
 	static void _bind_methods();
 
 public:
-	static Array decode(const PackedByteArray &p_msg_buf);
-	static Array encode(const Variant &p_val);
+	static Array decode(const PackedByteArray &p_msg_buf, int64_t p_max_bytes = _DECODE_MAX_BYTES, int64_t p_max_elements = _DECODE_MAX_ELEMENTS, int64_t p_max_container_length = _DECODE_MAX_CONTAINER_LENGTH);
+	static Array encode(const Variant &p_val, bool p_canonical = false);
+	static int64_t hash(const Variant &p_val);
+	static uint64_t hash_bytes(const uint8_t *p_data, uint32_t p_size);
+
+	static Array from_json(const String &p_json);
+	static Array to_json(const PackedByteArray &p_msg_buf);
 
 	void start_stream_with_reader(const Callback p_reader, void *context, int p_msgs_max = _MSG_MAX_SIZE);
 	Error try_parse_stream();
+	// try_parse_stream() in two steps, the raw message can be looked at in
+	// between and decoding skipped.
+	Error try_parse_stream_tree();
+	Error decode_stream_tree();
 
 	void start_stream(int p_msgs_max = _MSG_MAX_SIZE);
 	Error update_stream(const PackedByteArray &p_data, int p_from = 0, int p_to = INT_MAX);
 
+	Error start_stream_from(Object *p_source, int p_msgs_max = _MSG_MAX_SIZE);
+	Error poll_stream();
+
 #if MPACK_EXTENSIONS
 	void register_extension_type(int8_t p_ext_type, const Callable &p_decoder);
 #endif
 
+	void set_max_decode_bytes(int64_t p_max_bytes);
+	int64_t get_max_decode_bytes() const;
+	void set_max_decode_elements(int64_t p_max_elements);
+	int64_t get_max_decode_elements() const;
+	void set_max_container_length(int64_t p_max_length);
+	int64_t get_max_container_length() const;
+
 	inline Variant get_data() const { return data; }
 	inline int get_current_stream_length() const { return tree.data_length; }
+	// Encoded bytes of the message parsed last, valid until the next parse.
+	inline const uint8_t *get_current_stream_data() const { return (const uint8_t *)tree.data; }
 	inline String get_error_message() const { return err_msg; }
 
 	MessagePack();
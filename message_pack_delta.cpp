@@ -0,0 +1,370 @@
+/*************************************************************************/
+/*  message_pack_delta.cpp                                               */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "message_pack_delta.h"
+#include "core/templates/local_vector.h"
+
+static inline Array _make_set(const Variant &p_val) {
+	Array op;
+	op.resize(2);
+	op[0] = MessagePackDelta::PATCH_SET;
+	op[1] = p_val;
+	return op;
+}
+
+bool MessagePackDelta::_diff_recursive(const Variant &p_base, const Variant &p_val, Variant &r_patch, int p_depth) {
+	Variant::Type type = p_val.get_type();
+	if (type != p_base.get_type()) {
+		r_patch = _make_set(p_val);
+		return true;
+	}
+
+	// Too deep to walk, compare the whole value instead.
+	if (p_depth >= _RECURSION_MAX_DEPTH || (type != Variant::DICTIONARY && type != Variant::ARRAY)) {
+		if (p_base == p_val) {
+			return false;
+		}
+		r_patch = _make_set(p_val);
+		return true;
+	}
+
+	if (type == Variant::DICTIONARY) {
+		Dictionary base = p_base;
+		Dictionary val = p_val;
+		Dictionary changed;
+		Array removed;
+		const Variant *key = nullptr;
+		while ((key = val.next(key))) {
+			const Variant *base_val = base.getptr(*key);
+			Variant sub_patch;
+			if (!base_val) {
+				changed[*key] = _make_set(*val.getptr(*key));
+			} else if (_diff_recursive(*base_val, *val.getptr(*key), sub_patch, p_depth + 1)) {
+				changed[*key] = sub_patch;
+			}
+		}
+		key = nullptr;
+		while ((key = base.next(key))) {
+			if (!val.has(*key)) {
+				removed.push_back(*key);
+			}
+		}
+		if (changed.is_empty() && removed.is_empty()) {
+			return false;
+		}
+		Array op;
+		op.resize(3);
+		op[0] = PATCH_DICT;
+		op[1] = changed;
+		op[2] = removed;
+		r_patch = op;
+		return true;
+	}
+
+	Array base = p_base;
+	Array val = p_val;
+	Dictionary changed;
+	for (int i = 0; i < val.size(); i++) {
+		Variant sub_patch;
+		if (i >= base.size()) {
+			changed[i] = _make_set(val[i]);
+		} else if (_diff_recursive(base[i], val[i], sub_patch, p_depth + 1)) {
+			changed[i] = sub_patch;
+		}
+	}
+	if (changed.is_empty() && base.size() == val.size()) {
+		return false;
+	}
+	// Every element changed, the array itself is smaller than the edits.
+	if (val.size() > 0 && changed.size() == val.size()) {
+		r_patch = _make_set(p_val);
+		return true;
+	}
+	Array op;
+	op.resize(3);
+	op[0] = PATCH_ARRAY;
+	op[1] = val.size();
+	op[2] = changed;
+	r_patch = op;
+	return true;
+}
+
+Variant MessagePackDelta::_patch_recursive(const Variant &p_base, const Variant &p_patch, int p_depth, Error &r_err) {
+	// A nil patch means unchanged.
+	if (p_patch.get_type() == Variant::NIL) {
+		return p_base;
+	}
+	if (p_depth >= _RECURSION_MAX_DEPTH) {
+		r_err = ERR_OUT_OF_MEMORY;
+		ERR_FAIL_V_MSG(Variant(), "Patch recursive too deep.");
+	}
+	r_err = ERR_INVALID_DATA;
+	ERR_FAIL_COND_V_MSG(p_patch.get_type() != Variant::ARRAY, Variant(), "Invalid patch.");
+	Array op = p_patch;
+	ERR_FAIL_COND_V_MSG(op.size() < 2 || op[0].get_type() != Variant::INT, Variant(), "Invalid patch.");
+
+	// NOTE: Containers are copied shallowly, the branches not patched stay shared with the base.
+	// Neither the base nor the result is modified in place afterwards.
+	switch (int(op[0])) {
+		case PATCH_SET:
+			r_err = OK;
+			return op[1];
+		case PATCH_DICT: {
+			ERR_FAIL_COND_V_MSG(op.size() != 3 || p_base.get_type() != Variant::DICTIONARY || op[1].get_type() != Variant::DICTIONARY || op[2].get_type() != Variant::ARRAY,
+					Variant(), "Invalid dictionary patch.");
+			Dictionary result = Dictionary(p_base).duplicate();
+			Dictionary changed = op[1];
+			const Variant *key = nullptr;
+			while ((key = changed.next(key))) {
+				const Variant *base_val = result.getptr(*key);
+				Variant val = _patch_recursive(base_val ? *base_val : Variant(), *changed.getptr(*key), p_depth + 1, r_err);
+				if (r_err != OK) {
+					return Variant();
+				}
+				result[*key] = val;
+			}
+			Array removed = op[2];
+			for (int i = 0; i < removed.size(); i++) {
+				result.erase(removed[i]);
+			}
+			r_err = OK;
+			return result;
+		} break;
+		case PATCH_ARRAY: {
+			ERR_FAIL_COND_V_MSG(op.size() != 3 || p_base.get_type() != Variant::ARRAY || op[1].get_type() != Variant::INT || op[2].get_type() != Variant::DICTIONARY,
+					Variant(), "Invalid array patch.");
+			int64_t size = op[1];
+			ERR_FAIL_COND_V_MSG(size < 0 || size > _DECODE_MAX_CONTAINER_LENGTH, Variant(), "Invalid array patch size.");
+			Array base = p_base;
+			Array result = base.duplicate();
+			result.resize(size);
+			Dictionary changed = op[2];
+			const Variant *key = nullptr;
+			while ((key = changed.next(key))) {
+				ERR_FAIL_COND_V_MSG(key->get_type() != Variant::INT, Variant(), "Invalid array patch index.");
+				int64_t idx = *key;
+				ERR_FAIL_COND_V_MSG(idx < 0 || idx >= size, Variant(), "Invalid array patch index.");
+				Variant val = _patch_recursive(idx < base.size() ? base[idx] : Variant(), *changed.getptr(*key), p_depth + 1, r_err);
+				if (r_err != OK) {
+					return Variant();
+				}
+				result[idx] = val;
+			}
+			r_err = OK;
+			return result;
+		} break;
+		default:
+			break;
+	}
+	ERR_FAIL_V_MSG(Variant(), "Unknown patch operation: " + String::num_int64(op[0]));
+}
+
+Variant MessagePackDelta::diff(const Variant &p_base, const Variant &p_val) {
+	Variant patch_val;
+	_diff_recursive(p_base, p_val, patch_val, 0);
+	return patch_val;
+}
+
+Array MessagePackDelta::patch(const Variant &p_base, const Variant &p_patch) {
+	Error err = OK;
+	Variant val = _patch_recursive(p_base, p_patch, 0, err);
+	Array result;
+	result.resize(2);
+	result[0] = err;
+	result[1] = val;
+	return result;
+}
+
+Array MessagePackDelta::encode_snapshot(const Variant &p_state) {
+	version += 1;
+	// A keyframe is needed until the peer acknowledges one, and when the acknowledged
+	// snapshot is older than what the decoder keeps.
+	bool keyframe = keyframe_forced || acked_version < 0 || frames_since_keyframe >= keyframe_interval ||
+			version - acked_version > _DELTA_HISTORY_MAX_SIZE;
+
+	// Frame: [version, base version or nil for a keyframe, patch or value]
+	Array frame;
+	frame.resize(3);
+	frame[0] = version;
+	if (keyframe) {
+		frame[1] = Variant();
+		frame[2] = p_state;
+	} else {
+		Variant patch_val;
+		_diff_recursive(acked_state, p_state, patch_val, 0);
+		frame[1] = acked_version;
+		frame[2] = patch_val;
+	}
+
+	Array result = MessagePack::encode(frame);
+	if (int(result[0]) == OK) {
+		if (keyframe) {
+			frames_since_keyframe = 0;
+			keyframe_forced = false;
+		} else {
+			frames_since_keyframe += 1;
+		}
+		// Keep our own copy, the caller may keep modifying the state.
+		sent[version] = p_state.duplicate(true);
+		sent.erase(version - _DELTA_HISTORY_MAX_SIZE);
+	}
+	return result;
+}
+
+Error MessagePackDelta::acknowledge(int64_t p_version) {
+	if (p_version <= acked_version) {
+		// Late acknowledgement, a newer one is already in use.
+		return OK;
+	}
+	ERR_FAIL_COND_V_MSG(!sent.has(p_version), ERR_DOES_NOT_EXIST, "Snapshot " + String::num_int64(p_version) + " is unknown or too old.");
+	acked_state = sent[p_version];
+	acked_version = p_version;
+
+	// Older snapshots will never be used as a base again.
+	LocalVector<int64_t> stale;
+	for (const KeyValue<int64_t, Variant> &E : sent) {
+		if (E.key <= p_version) {
+			stale.push_back(E.key);
+		}
+	}
+	for (uint32_t i = 0; i < stale.size(); i++) {
+		sent.erase(stale[i]);
+	}
+	return OK;
+}
+
+void MessagePackDelta::force_keyframe() {
+	keyframe_forced = true;
+}
+
+Array MessagePackDelta::decode_frame(const PackedByteArray &p_frame) {
+	Array result;
+	result.resize(2);
+
+	Array decoded = MessagePack::decode(p_frame);
+	if (int(decoded[0]) != OK) {
+		result[0] = decoded[0];
+		result[1] = decoded[1];
+		return result;
+	}
+
+	Variant frame_val = decoded[1];
+	if (frame_val.get_type() != Variant::ARRAY || Array(frame_val).size() != 3 || Array(frame_val)[0].get_type() != Variant::INT) {
+		result[0] = ERR_INVALID_DATA;
+		result[1] = "Not a valid delta frame.";
+		return result;
+	}
+	Array frame = frame_val;
+	int64_t frame_version = frame[0];
+
+	Variant state;
+	if (frame[1].get_type() == Variant::NIL) {
+		state = frame[2];
+	} else {
+		int64_t base_version = frame[1];
+		if (!received.has(base_version)) {
+			result[0] = ERR_DOES_NOT_EXIST;
+			result[1] = "Base snapshot " + String::num_int64(base_version) + " is not available, waiting for a keyframe.";
+			return result;
+		}
+		Error err = OK;
+		state = _patch_recursive(received[base_version], frame[2], 0, err);
+		if (err != OK) {
+			result[0] = err;
+			result[1] = "Invalid patch in delta frame.";
+			return result;
+		}
+	}
+
+	received[frame_version] = state;
+	decoded_version = frame_version;
+	if (received.size() > _DELTA_HISTORY_MAX_SIZE) {
+		LocalVector<int64_t> stale;
+		for (const KeyValue<int64_t, Variant> &E : received) {
+			if (E.key <= frame_version - _DELTA_HISTORY_MAX_SIZE) {
+				stale.push_back(E.key);
+			}
+		}
+		for (uint32_t i = 0; i < stale.size(); i++) {
+			received.erase(stale[i]);
+		}
+	}
+
+	// The rebuilt states share branches with each other, hand out a copy.
+	result[0] = OK;
+	result[1] = state.duplicate(true);
+	return result;
+}
+
+void MessagePackDelta::reset() {
+	sent.clear();
+	acked_state = Variant();
+	acked_version = -1;
+	version = 0;
+	frames_since_keyframe = 0;
+	keyframe_forced = false;
+	received.clear();
+	decoded_version = -1;
+}
+
+void MessagePackDelta::set_keyframe_interval(int p_interval) {
+	ERR_FAIL_COND(p_interval < 1);
+	keyframe_interval = p_interval;
+}
+
+int MessagePackDelta::get_keyframe_interval() const {
+	return keyframe_interval;
+}
+
+MessagePackDelta::MessagePackDelta() {
+}
+
+void MessagePackDelta::_bind_methods() {
+	ClassDB::bind_static_method("MessagePackDelta", D_METHOD("diff", "base", "value"), &MessagePackDelta::diff);
+	ClassDB::bind_static_method("MessagePackDelta", D_METHOD("patch", "base", "patch"), &MessagePackDelta::patch);
+
+	ClassDB::bind_method(D_METHOD("encode_snapshot", "state"), &MessagePackDelta::encode_snapshot);
+	ClassDB::bind_method(D_METHOD("acknowledge", "version"), &MessagePackDelta::acknowledge);
+	ClassDB::bind_method(D_METHOD("force_keyframe"), &MessagePackDelta::force_keyframe);
+	ClassDB::bind_method(D_METHOD("decode_frame", "frame"), &MessagePackDelta::decode_frame);
+	ClassDB::bind_method(D_METHOD("reset"), &MessagePackDelta::reset);
+
+	ClassDB::bind_method(D_METHOD("set_keyframe_interval", "interval"), &MessagePackDelta::set_keyframe_interval);
+	ClassDB::bind_method(D_METHOD("get_keyframe_interval"), &MessagePackDelta::get_keyframe_interval);
+	ClassDB::bind_method(D_METHOD("get_version"), &MessagePackDelta::get_version);
+	ClassDB::bind_method(D_METHOD("get_acknowledged_version"), &MessagePackDelta::get_acknowledged_version);
+	ClassDB::bind_method(D_METHOD("get_decoded_version"), &MessagePackDelta::get_decoded_version);
+
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "keyframe_interval", PROPERTY_HINT_RANGE, "1,3600,1"), "set_keyframe_interval", "get_keyframe_interval");
+
+	BIND_ENUM_CONSTANT(PATCH_SET);
+	BIND_ENUM_CONSTANT(PATCH_DICT);
+	BIND_ENUM_CONSTANT(PATCH_ARRAY);
+}
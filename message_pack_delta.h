@@ -0,0 +1,96 @@
+/*************************************************************************/
+/*  message_pack_delta.h                                                 */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef MESSAGE_PACK_DELTA_H
+#define MESSAGE_PACK_DELTA_H
+
+#include "core/object/ref_counted.h"
+#include "core/templates/hash_map.h"
+#include "core/variant/array.h"
+#include "core/variant/dictionary.h"
+
+#include "message_pack.h"
+
+// Default frames between two keyframes
+#define _DELTA_KEYFRAME_INTERVAL 60
+// Snapshots kept while waiting for acknowledgement, or to apply patches against
+#define _DELTA_HISTORY_MAX_SIZE 64
+
+class MessagePackDelta : public RefCounted {
+	GDCLASS(MessagePackDelta, RefCounted);
+
+	// Encoder, snapshots sent but not acknowledged yet, by version.
+	HashMap<int64_t, Variant> sent;
+	Variant acked_state;
+	int64_t acked_version = -1;
+	int64_t version = 0;
+	int frames_since_keyframe = 0;
+	int keyframe_interval = _DELTA_KEYFRAME_INTERVAL;
+	bool keyframe_forced = false;
+
+	// Decoder, states rebuilt recently, by version.
+	HashMap<int64_t, Variant> received;
+	int64_t decoded_version = -1;
+
+	static bool _diff_recursive(const Variant &p_base, const Variant &p_val, Variant &r_patch, int p_depth);
+	static Variant _patch_recursive(const Variant &p_base, const Variant &p_patch, int p_depth, Error &r_err);
+
+protected:
+	static void _bind_methods();
+
+public:
+	// Patch operations: [SET, value], [DICT, {key: patch}, [removed keys]], [ARRAY, size, {index: patch}]
+	enum PatchOp {
+		PATCH_SET = 0,
+		PATCH_DICT,
+		PATCH_ARRAY,
+	};
+
+	static Variant diff(const Variant &p_base, const Variant &p_val);
+	static Array patch(const Variant &p_base, const Variant &p_patch);
+
+	Array encode_snapshot(const Variant &p_state);
+	Error acknowledge(int64_t p_version);
+	void force_keyframe();
+	Array decode_frame(const PackedByteArray &p_frame);
+	void reset();
+
+	void set_keyframe_interval(int p_interval);
+	int get_keyframe_interval() const;
+	inline int64_t get_version() const { return version; }
+	inline int64_t get_acknowledged_version() const { return acked_version; }
+	inline int64_t get_decoded_version() const { return decoded_version; }
+
+	MessagePackDelta();
+};
+
+VARIANT_ENUM_CAST(MessagePackDelta::PatchOp);
+
+#endif // MESSAGE_PACK_DELTA_H
@@ -30,6 +30,10 @@
 
 #include "message_pack_rpc.h"
 #include "core/os/memory.h"
+#include "core/templates/hash_set.h"
+#include "main/performance.h"
+
+#include "message_pack_rpc_server.h"
 
 PackedByteArray MessagePackRPC::make_message_byte_array(const Array &p_message) {
 	// MessagePack message elements never less than 3 and never more than 4.
@@ -93,50 +97,69 @@ void MessagePackRPC::_error_handle(Error p_err, const String p_err_msg) {
 	call_deferred(SNAME("_got_error"), p_err, p_err_msg);
 }
 
+// Only built once a message turned out bad, most are fine.
+static String _invalid_message(const Variant &p_message) {
+	return "Invalid message received: " + p_message.to_json_string();
+}
+
 Error MessagePackRPC::_message_handle(const Variant &p_message) {
 	if (p_message.get_type() == Variant::ARRAY) {
-		String _err_msg = "Invalid message received: " + p_message.to_json_string();
 		Array msg_arr = p_message;
-		if (msg_arr[0].get_type() != Variant::INT) {
-			ERR_FAIL_V_MSG(ERR_INVALID_PARAMETER, _err_msg);
+		if (msg_arr.size() < 3 || msg_arr[0].get_type() != Variant::INT) {
+			ERR_FAIL_V_MSG(ERR_INVALID_PARAMETER, _invalid_message(p_message));
 		}
 
 		switch (int(msg_arr[0])) {
 			case REQUEST: // Request [msgid, method, params]
-				ERR_FAIL_COND_V_MSG(msg_arr.size() != 4, ERR_INVALID_PARAMETER, _err_msg);
-				if (request_map.has(msg_arr[2])) {
-					MessageQueue::get_singleton()->push_callable(request_map[msg_arr[2]], msg_arr[1], msg_arr[2], msg_arr[3]);
-					// registered request, not emit signal
+				ERR_FAIL_COND_V_MSG(msg_arr.size() != 4, ERR_INVALID_PARAMETER, _invalid_message(p_message));
+				if (!_resolve_method(msg_arr, 2)) {
+					response_error(msg_arr[1], "Unknown method id.");
+					ERR_FAIL_V_MSG(ERR_INVALID_PARAMETER, _invalid_message(p_message));
+				}
+				metrics.record_request(msg_arr[2], false);
+				if (StringName(msg_arr[2]) == SNAME(_RPC_METHOD_IDS_METHOD)) {
+					_respond_method_ids(msg_arr[1]);
+					return OK;
+				}
+				{
+					// The response goes back on the lane the method was set to.
+					Priority priority = _get_send_priority(msg_arr[2]);
+					if (priority != PRIORITY_NORMAL) {
+						MutexLock lock(priorities_mutex);
+						response_priorities[msg_arr[1]] = priority;
+					}
+				}
+				if (_dispatch_threaded(msg_arr)) {
 					return OK;
 				}
-				call_deferred(SNAME("_request_received"), msg_arr[1], msg_arr[2], msg_arr[3]);
 				break;
 			case RESPONSE: // Response [msgid, error, result]
-				ERR_FAIL_COND_V_MSG(msg_arr.size() != 4, ERR_INVALID_PARAMETER, _err_msg);
-				if (sync_started && sync_msgid == int(msg_arr[1])) {
-					// Sync request responded.
-					sync_result[0] = msg_arr[2];
-					sync_result[1] = msg_arr[3];
-					sync_responded = true;
+				ERR_FAIL_COND_V_MSG(msg_arr.size() != 4, ERR_INVALID_PARAMETER, _invalid_message(p_message));
+				if (msg_arr[1].get_type() == Variant::INT && _sync_respond(msg_arr[1], msg_arr[2], msg_arr[3])) {
 					// sync response not emit signal, return directly.
 					return OK;
 				}
-				call_deferred(SNAME("_response_received"), msg_arr[1], msg_arr[2], msg_arr[3]);
+				if (msg_arr[1].get_type() == Variant::INT && _remote_method_ids_received(msg_arr[1], msg_arr[3])) {
+					return OK;
+				}
 				break;
 			case NOTIFICATION: // Notification [method, params]
-				ERR_FAIL_COND_V_MSG(msg_arr.size() != 3, ERR_INVALID_PARAMETER, _err_msg);
-				if (notify_map.has(msg_arr[1])) {
-					MessageQueue::get_singleton()->push_callable(notify_map[msg_arr[1]], msg_arr[1], msg_arr[2]);
-					// registered notification, not emit signal
+				ERR_FAIL_COND_V_MSG(msg_arr.size() != 3, ERR_INVALID_PARAMETER, _invalid_message(p_message));
+				if (msg_arr[1].get_type() == Variant::STRING && String(msg_arr[1]) == _RPC_FRAGMENT_METHOD) {
+					return _fragment_received(msg_arr[2]);
+				}
+				ERR_FAIL_COND_V_MSG(!_resolve_method(msg_arr, 1), ERR_INVALID_PARAMETER, _invalid_message(p_message));
+				metrics.record_request(msg_arr[1], true);
+				if (_dispatch_threaded(msg_arr)) {
 					return OK;
 				}
-				call_deferred(SNAME("_notification_received"), msg_arr[1], msg_arr[2]);
 				break;
 			default:
-				ERR_FAIL_V_MSG(ERR_INVALID_PARAMETER, _err_msg);
+				ERR_FAIL_V_MSG(ERR_INVALID_PARAMETER, _invalid_message(p_message));
 				break;
 		}
-		call_deferred(SNAME("_message_received"), p_message);
+		// Dispatched on the main thread by _messages_received.
+		in_batch.push_back(msg_arr);
 	} else {
 		// Invalid message
 		// MessagePack rpc packet received, but not an array.
@@ -145,77 +168,649 @@ Error MessagePackRPC::_message_handle(const Variant &p_message) {
 	return OK;
 }
 
-Error MessagePackRPC::_try_connect(const IPAddress &p_ip, int p_port) {
-	const int tries = 6;
-	const int waits[tries] = { 1, 10, 100, 1000, 1000, 1000 };
+void MessagePackRPC::_intern_method(const StringName &p_method) {
+	// Call with handlers_mutex locked.
+	if (!method_ids.has(p_method)) {
+		method_ids[p_method] = method_names.size();
+		method_names.push_back(p_method);
+	}
+}
+
+bool MessagePackRPC::_resolve_method(Array &p_msg, int p_idx) {
+	// Interned once here, the handler lookups then hash a pointer.
+	const Variant &method = p_msg[p_idx];
+	switch (method.get_type()) {
+		case Variant::STRING_NAME:
+			return true;
+		case Variant::STRING:
+			p_msg[p_idx] = StringName(String(method));
+			return true;
+		case Variant::INT: {
+			// Negotiated method id
+			int64_t id = method;
+			StringName name;
+			if (server) {
+				name = server->_get_method_name(id);
+			} else {
+				MutexLock lock(handlers_mutex);
+				if (id >= 0 && id < int64_t(method_names.size())) {
+					name = method_names[id];
+				}
+			}
+			if (name == StringName()) {
+				return false;
+			}
+			p_msg[p_idx] = name;
+			return true;
+		}
+		default:
+			return false;
+	}
+}
 
-	tcp_stream->connect_to_host(p_ip, p_port);
+MessagePackRPCCache *MessagePackRPC::_get_response_cache() {
+	return server ? &server->response_cache : &response_cache;
+}
 
-	for (int i = 0; i < tries; i++) {
-		tcp_stream->poll();
-		if (tcp_stream->get_status() == StreamPeerTCP::STATUS_CONNECTED) {
-			print_verbose("MessagePackRPC tcp peer Connected!");
-			break;
-		} else {
-			const int ms = waits[i];
-			OS::get_singleton()->delay_usec(ms * 1000);
-			print_verbose("MessagePackRPC tcp peer: Connection failed with status: '" +
-					String::num(tcp_stream->get_status()) + "', retrying in " + String::num(ms) + " msec.");
+bool MessagePackRPC::_try_cached_response() {
+	// Looks at the request [0, msgid, method, params] before it's decoded,
+	// a hit is answered with the cached result bytes.
+	MessagePackRPCCache *cache = _get_response_cache();
+	if (cache->is_empty()) {
+		return false;
+	}
+	const uint8_t *data = msg_pack.get_current_stream_data();
+	uint32_t size = msg_pack.get_current_stream_length();
+	if (size < 3 || data[0] != 0x94 || data[1] != REQUEST) {
+		return false;
+	}
+	int64_t id = 0;
+	uint32_t msgid_size = MessagePackRPCCache::get_scalar_size(data + 2, size - 2);
+	if (msgid_size == 0 || !MessagePackRPCCache::read_int(data + 2, size - 2, id)) {
+		return false;
+	}
+	const uint8_t *request = data + 2 + msgid_size;
+	uint32_t request_size = size - 2 - msgid_size;
+	uint32_t method_size = MessagePackRPCCache::get_scalar_size(request, request_size);
+	if (method_size == 0 || method_size == request_size) {
+		return false;
+	}
+
+	PackedByteArray result;
+	StringName method;
+	MessagePackRPCCache::Result found = cache->lookup(request, request_size, method_size, result, method);
+	if (found == MessagePackRPCCache::UNKNOWN_METHOD) {
+		// First time this name or id is seen, decoded once to find its policy.
+		PackedByteArray method_buf;
+		method_buf.resize(method_size);
+		memcpy(method_buf.ptrw(), request, method_size);
+		Array decoded = MessagePack::decode(method_buf);
+		if (int(decoded[0]) != OK) {
+			return false;
+		}
+		Array msg;
+		msg.push_back(decoded[1]);
+		if (!_resolve_method(msg, 0)) {
+			return false; // Rejected as usual once decoded.
+		}
+		cache->learn_method(request, method_size, msg[0]);
+		found = cache->lookup(request, request_size, method_size, result, method);
+	}
+
+	if (found == MessagePackRPCCache::HIT) {
+		// Response [1, msgid, nil, result], the msgid bytes are reused as is.
+		PackedByteArray msg_buf;
+		msg_buf.resize(3 + msgid_size + result.size());
+		uint8_t *w = msg_buf.ptrw();
+		w[0] = 0x94;
+		w[1] = RESPONSE;
+		memcpy(w + 2, data + 2, msgid_size);
+		w[2 + msgid_size] = 0xc0;
+		memcpy(w + 3 + msgid_size, result.ptr(), result.size());
+		// On the method's lane like a handler's response. Never waits, on the read
+		// thread. If the lane is full, the handler answers instead.
+		if (_put_encoded(msg_buf, _get_send_priority(method), true) != OK) {
+			return false;
+		}
+		metrics.record_request(method, false);
+		metrics.add(metrics.cache_hits);
+		return true;
+	}
+	if (found == MessagePackRPCCache::MISS) {
+		CachePending pending;
+		pending.request.resize(request_size);
+		memcpy(pending.request.ptrw(), request, request_size);
+		pending.method_size = method_size;
+		MutexLock lock(cache_mutex);
+		if (cache_pending.size() >= _RPC_CACHE_MAX_PENDING) {
+			// Handlers that never responded.
+			cache_pending.clear();
+		}
+		cache_pending[uint64_t(id)] = pending;
+	}
+	return false;
+}
+
+void MessagePackRPC::_cache_response(uint64_t p_msgid, const PackedByteArray &p_msg_buf) {
+	CachePending pending;
+	{
+		MutexLock lock(cache_mutex);
+		CachePending *found = cache_pending.getptr(p_msgid);
+		if (!found) {
+			return;
+		}
+		pending = *found;
+		cache_pending.erase(p_msgid);
+	}
+	// Response [1, msgid, nil, result], only the result bytes are kept.
+	uint32_t size = p_msg_buf.size();
+	const uint8_t *data = p_msg_buf.ptr();
+	uint32_t msgid_size = size > 2 ? MessagePackRPCCache::get_scalar_size(data + 2, size - 2) : 0;
+	if (msgid_size == 0 || data[0] != 0x94 || 3 + msgid_size >= size || data[2 + msgid_size] != 0xc0) {
+		return;
+	}
+	_get_response_cache()->store(pending.request, pending.method_size, p_msg_buf.slice(3 + msgid_size));
+}
+
+Error MessagePackRPC::_fragment_received(const Variant &p_params) {
+	// Fragment [fragment_id, is_last, bin], reassembled into the original message.
+	ERR_FAIL_COND_V_MSG(p_params.get_type() != Variant::ARRAY, ERR_INVALID_PARAMETER, "Invalid fragment received.");
+	Array params = p_params;
+	ERR_FAIL_COND_V_MSG(params.size() != 3 || params[0].get_type() != Variant::INT || params[2].get_type() != Variant::PACKED_BYTE_ARRAY, ERR_INVALID_PARAMETER, "Invalid fragment received.");
+	uint64_t id = params[0];
+	PackedByteArray chunk = params[2];
+
+	PackedByteArray *msg_buf = in_fragments.getptr(id);
+	if (!msg_buf) {
+		if (in_fragments.size() >= _RPC_FRAGMENT_MAX_PENDING) {
+			return _fragment_failed(ERR_OUT_OF_MEMORY, "Too many fragmented messages in progress.");
 		}
+		msg_buf = &in_fragments.insert(id, PackedByteArray())->value;
+	}
+	if (in_fragments_bytes + chunk.size() > max_buffer_size) {
+		return _fragment_failed(ERR_OUT_OF_MEMORY, "Fragmented messages are bigger than max_buffer_size.");
+	}
+	msg_buf->append_array(chunk);
+	in_fragments_bytes += chunk.size();
+	if (!bool(params[1])) {
+		return OK;
 	}
 
-	if (tcp_stream->get_status() != StreamPeerTCP::STATUS_CONNECTED) {
-		ERR_PRINT("MessagePackRPC: Unable to connect. Status: " + String::num(tcp_stream->get_status()) + ".");
-		return FAILED;
+	Array result = MessagePack::decode(*msg_buf, msg_pack.get_max_decode_bytes(), msg_pack.get_max_decode_elements(), msg_pack.get_max_container_length());
+	in_fragments_bytes -= msg_buf->size();
+	in_fragments.erase(id);
+	if (int(result[0]) != OK) {
+		return _fragment_failed(ERR_PARSE_ERROR, "Fragmented message can't be decoded.");
+	}
+	const Variant &message = result[1];
+	if (message.get_type() != Variant::ARRAY) {
+		return _message_handle(message);
+	}
+	// A message starts with its type, an array in front is a batch sent as a whole.
+	Array msg_arr = message;
+	bool batch = !msg_arr.is_empty() && msg_arr[0].get_type() == Variant::ARRAY;
+	Array msgs = batch ? msg_arr : Array();
+	if (!batch) {
+		msgs.push_back(msg_arr);
+	}
+	// Fragments of fragments would let the reassembled size escape max_buffer_size.
+	for (int i = 0; i < msgs.size(); i++) {
+		if (_is_fragment(msgs[i])) {
+			return _fragment_failed(ERR_INVALID_DATA, "Fragmented message is itself a fragment.");
+		}
+	}
+	for (int i = 0; i < msgs.size(); i++) {
+		Error err = _message_handle(msgs[i]);
+		if (err != OK) {
+			return err;
+		}
 	}
 	return OK;
 }
 
+bool MessagePackRPC::_is_fragment(const Variant &p_message) {
+	if (p_message.get_type() != Variant::ARRAY) {
+		return false;
+	}
+	Array msg_arr = p_message;
+	return msg_arr.size() == 3 && msg_arr[1].get_type() == Variant::STRING && String(msg_arr[1]) == _RPC_FRAGMENT_METHOD;
+}
+
+Error MessagePackRPC::_fragment_failed(Error p_err, const String &p_err_msg) {
+	// A peer breaking the fragment rules can't be trusted with the rest of the stream.
+	in_fragments.clear();
+	in_fragments_bytes = 0;
+	metrics.add(metrics.parse_errors);
+	_error_handle(p_err, p_err_msg);
+	connected = false;
+	ERR_FAIL_V_MSG(p_err, "MessagePackRPC: " + p_err_msg);
+}
+
+MessagePackRPC::Priority MessagePackRPC::_get_send_priority(const String &p_method) {
+	MutexLock lock(priorities_mutex);
+	const Priority *priority = method_priorities.getptr(p_method);
+	return priority ? *priority : PRIORITY_NORMAL;
+}
+
+MessagePackRPC::Priority MessagePackRPC::_take_response_priority(uint64_t p_msgid) {
+	MutexLock lock(priorities_mutex);
+	Priority *priority = response_priorities.getptr(p_msgid);
+	if (!priority) {
+		return PRIORITY_NORMAL;
+	}
+	Priority ret = *priority;
+	response_priorities.erase(p_msgid);
+	return ret;
+}
+
+void MessagePackRPC::_respond_method_ids(uint64_t p_msgid) {
+	Array names;
+	if (server) {
+		names = server->_get_method_names();
+	} else {
+		MutexLock lock(handlers_mutex);
+		for (const StringName &name : method_names) {
+			names.push_back(String(name));
+		}
+	}
+	{
+		MutexLock lock(priorities_mutex);
+		response_priorities[p_msgid] = PRIORITY_CONTROL;
+	}
+	response(p_msgid, names);
+}
+
+bool MessagePackRPC::_remote_method_ids_received(uint64_t p_msgid, const Variant &p_result) {
+	MutexLock lock(remote_methods_mutex);
+	if (!remote_method_ids_requested || p_msgid != remote_method_ids_msgid) {
+		return false;
+	}
+	remote_method_ids_requested = false;
+	remote_method_ids.clear();
+	if (p_result.get_type() == Variant::ARRAY) {
+		Array names = p_result;
+		for (int i = 0; i < names.size(); i++) {
+			remote_method_ids[names[i]] = i;
+		}
+	}
+	return true;
+}
+
+Variant MessagePackRPC::_wire_method(const String &p_method) {
+	MutexLock lock(remote_methods_mutex);
+	const int *id = remote_method_ids.getptr(p_method);
+	if (id) {
+		return *id;
+	}
+	return p_method;
+}
+
+bool MessagePackRPC::_dispatch_threaded(const Array &p_msg) {
+	bool request = int(p_msg[0]) == REQUEST;
+	StringName method = request ? p_msg[2] : p_msg[1];
+	Callable callable;
+	bool with_peer = false;
+	{
+		MutexLock lock(handlers_mutex);
+		const Handler *handler = request ? request_map.getptr(method) : notify_map.getptr(method);
+		if (handler) {
+			if (!handler->threaded) {
+				return false; // Main thread handler
+			}
+			callable = handler->callable;
+		}
+	}
+	if (callable.is_null()) {
+		if (!server || !server->_get_threaded_handler(request, method, callable)) {
+			return false;
+		}
+		with_peer = true;
+	}
+
+	HandlerTask *task = memnew(HandlerTask);
+	task->rpc = this;
+	task->callable = callable;
+	task->request = request;
+	task->method = method;
+	if (with_peer) {
+		task->args.push_back(this);
+	}
+	task->args.append_array(p_msg.slice(1));
+	if (request) {
+		task->msgid = p_msg[1];
+	}
+	WorkerThreadPool::TaskID id = WorkerThreadPool::get_singleton()->add_native_task(_handler_task, task, false, "MessagePackRPC handler " + String(method));
+	MutexLock lock(tasks_mutex);
+	handler_tasks.push_back(id);
+	return true;
+}
+
+void MessagePackRPC::_handler_task(void *p_user_data) {
+	HandlerTask *task = (HandlerTask *)p_user_data;
+	MessagePackRPC *rpc = task->rpc;
+
+	const int argc = task->args.size();
+	const Variant **argptrs = (const Variant **)alloca(sizeof(Variant *) * argc);
+	for (int i = 0; i < argc; i++) {
+		argptrs[i] = &task->args[i];
+	}
+	Variant ret;
+	Callable::CallError ce;
+	uint64_t start_usec = OS::get_singleton()->get_ticks_usec();
+	task->callable.callp(argptrs, argc, ret, ce);
+	rpc->metrics.record_handler(task->method, OS::get_singleton()->get_ticks_usec() - start_usec);
+
+	if (ce.error != Callable::CallError::CALL_OK) {
+		String err = Variant::get_callable_error_text(task->callable, argptrs, argc, ce);
+		if (task->request && rpc->running) {
+			rpc->response_error(task->msgid, err);
+		}
+		ERR_PRINT("MessagePackRPC: Error calling handler: " + err);
+	} else if (task->request && rpc->running) {
+		// The return value is the response.
+		rpc->response(task->msgid, ret);
+	}
+	memdelete(task);
+}
+
+void MessagePackRPC::_reap_handler_tasks(bool p_wait_all) {
+	// Every task must be waited for, finished ones don't block.
+	MutexLock lock(tasks_mutex);
+	for (uint32_t i = 0; i < handler_tasks.size();) {
+		if (p_wait_all || WorkerThreadPool::get_singleton()->is_task_completed(handler_tasks[i])) {
+			WorkerThreadPool::get_singleton()->wait_for_task_completion(handler_tasks[i]);
+			handler_tasks.remove_at_unordered(i);
+			continue;
+		}
+		i++;
+	}
+}
+
+bool MessagePackRPC::_sync_respond(uint64_t p_msgid, const Variant &p_error, const Variant &p_result) {
+	std::lock_guard<std::mutex> lock(sync_mutex);
+	SyncCall **call = sync_calls.getptr(p_msgid);
+	if (!call) {
+		return false;
+	}
+	(*call)->error = p_error;
+	(*call)->result = p_result;
+	(*call)->responded = true;
+	(*call)->cond.notify_one();
+	return true;
+}
+
+void MessagePackRPC::_cancel_sync_calls() {
+	// Wake every blocked caller, no response will come on this connection.
+	std::lock_guard<std::mutex> lock(sync_mutex);
+	for (KeyValue<uint64_t, SyncCall *> &E : sync_calls) {
+		E.value->cancelled = true;
+		E.value->cond.notify_one();
+	}
+}
+
+uint64_t MessagePackRPC::_get_call_wheel_tick() const {
+	return (OS::get_singleton()->get_ticks_msec() - call_wheel_start_msec) / _CALL_WHEEL_TICK_MSEC;
+}
+
+void MessagePackRPC::_schedule_call_timeout(uint64_t p_msgid, uint64_t p_timeout_msec, uint32_t p_count) {
+	// Call with async_mutex locked.
+	uint64_t target = _get_call_wheel_tick() + MAX(uint64_t(1), (p_timeout_msec + _CALL_WHEEL_TICK_MSEC - 1) / _CALL_WHEEL_TICK_MSEC);
+	// The slot is first visited at the tick after call_wheel_tick, which may lag behind the clock.
+	uint64_t ticks = target - call_wheel_tick;
+	CallTimer timer;
+	timer.msgid = p_msgid;
+	timer.count = p_count;
+	timer.rounds = (ticks - 1) / _CALL_WHEEL_SIZE;
+	call_wheel[target % _CALL_WHEEL_SIZE].push_back(timer);
+	// Server peers are woken by queuing the request, their loop then waits anew.
+	if (!server && call_wheel_start_msec + target * _CALL_WHEEL_TICK_MSEC < io_wake_msec) {
+		transport->interrupt();
+	}
+}
+
+void MessagePackRPC::_tick_call_wheel() {
+	Array expired;
+	{
+		MutexLock lock(async_mutex);
+		uint64_t now = _get_call_wheel_tick();
+		if (async_calls.is_empty()) {
+			// Nothing can expire, skip the idle stretch instead of walking it.
+			call_wheel_tick = now;
+		}
+		while (call_wheel_tick < now) {
+			call_wheel_tick++;
+			LocalVector<CallTimer> &slot = call_wheel[call_wheel_tick % _CALL_WHEEL_SIZE];
+			uint32_t kept = 0;
+			for (uint32_t i = 0; i < slot.size(); i++) {
+				CallTimer &timer = slot[i];
+				Ref<MessagePackRPCCall> call;
+				for (uint32_t j = 0; j < timer.count && call.is_null(); j++) {
+					Ref<MessagePackRPCCall> *E = async_calls.getptr(timer.msgid + j);
+					if (E) {
+						call = *E;
+					}
+				}
+				if (call.is_null()) {
+					continue; // Responded already
+				}
+				if (timer.rounds > 0) {
+					timer.rounds--;
+					slot[kept++] = timer;
+					continue;
+				}
+				expired.push_back(call);
+				for (uint32_t j = 0; j < timer.count; j++) {
+					async_calls.erase(timer.msgid + j);
+				}
+			}
+			slot.resize(kept);
+		}
+	}
+	if (!expired.is_empty()) {
+		metrics.add(metrics.timeouts, expired.size());
+		call_deferred(SNAME("_calls_failed"), expired, MessagePackRPCCall::STATUS_TIMEOUT);
+	}
+}
+
+int MessagePackRPC::_get_call_wheel_wait_msec(int p_max_msec) {
+	// How long the I/O can sleep before the next occupied slot is due, capped at
+	// _IO_WAIT_TIMEOUT_MSEC, or at p_max_msec while calls are pending.
+	MutexLock lock(async_mutex);
+	uint64_t now_msec = OS::get_singleton()->get_ticks_msec();
+	int wait_msec = _IO_WAIT_TIMEOUT_MSEC;
+	if (!async_calls.is_empty()) {
+		wait_msec = MIN(wait_msec, p_max_msec);
+		const uint64_t max_ticks = _IO_WAIT_TIMEOUT_MSEC / _CALL_WHEEL_TICK_MSEC + 1;
+		for (uint64_t tick = call_wheel_tick + 1; tick <= call_wheel_tick + max_ticks; tick++) {
+			if (call_wheel[tick % _CALL_WHEEL_SIZE].is_empty()) {
+				continue;
+			}
+			uint64_t due_msec = call_wheel_start_msec + tick * _CALL_WHEEL_TICK_MSEC;
+			wait_msec = due_msec > now_msec ? MIN(int(due_msec - now_msec), wait_msec) : 0;
+			break;
+		}
+	}
+	io_wake_msec = now_msec + wait_msec;
+	return wait_msec;
+}
+
+Ref<MessagePackRPCCall> MessagePackRPC::_take_async_call(uint64_t p_msgid) {
+	MutexLock lock(async_mutex);
+	Ref<MessagePackRPCCall> call;
+	Ref<MessagePackRPCCall> *E = async_calls.getptr(p_msgid);
+	if (E) {
+		call = *E;
+		async_calls.erase(p_msgid);
+	}
+	return call;
+}
+
+Array MessagePackRPC::_take_async_calls() {
+	MutexLock lock(async_mutex);
+	Array calls;
+	HashSet<MessagePackRPCCall *> batches;
+	for (const KeyValue<uint64_t, Ref<MessagePackRPCCall>> &E : async_calls) {
+		if (E.value->is_batch()) {
+			// Listed under each of its msgids.
+			if (batches.has(E.value.ptr())) {
+				continue;
+			}
+			batches.insert(E.value.ptr());
+		}
+		calls.push_back(E.value);
+	}
+	async_calls.clear();
+	for (int i = 0; i < _CALL_WHEEL_SIZE; i++) {
+		call_wheel[i].clear();
+	}
+	return calls;
+}
+
 void MessagePackRPC::_thread_func(void *p_user_data) {
-	const uint64_t poll_interval = 6900;
 	MessagePackRPC *rpc = (MessagePackRPC *)p_user_data;
 	while (rpc->running) {
-		uint64_t ticks_usec = OS::get_singleton()->get_ticks_usec();
 		rpc->poll();
-		ticks_usec = OS::get_singleton()->get_ticks_msec() - ticks_usec;
-		if (ticks_usec < poll_interval) {
-			OS::get_singleton()->delay_usec(poll_interval - ticks_usec);
+		if (!rpc->connected) {
+			rpc->_connection_lost();
+			break;
+		}
+		// Sleep until data arrives or the next call timeout is due. A call due
+		// earlier, made meanwhile, interrupts the wait. Transports that can't be
+		// interrupted wake every tick while calls are pending instead.
+		int wait_msec = rpc->_get_call_wheel_wait_msec(rpc->transport->can_interrupt() ? _IO_WAIT_TIMEOUT_MSEC : _CALL_WHEEL_TICK_MSEC);
+		if (rpc->transport->wait(NetSocket::POLL_TYPE_IN, wait_msec) != OK && wait_msec == _IO_WAIT_TIMEOUT_MSEC) {
+			rpc->in_buf.shrink_if_idle();
+			// The write thread only wakes for messages, let it give an idle out_buf back too.
+			rpc->write_sem.post();
 		}
+		rpc->_tick_call_wheel();
+		rpc->_reap_handler_tasks();
 	}
 }
 
-Error MessagePackRPC::connect_to_host(const IPAddress &p_ip, int p_port, bool p_big_endian) {
-	// try to connect to the specified address.
-	if (_try_connect(p_ip, p_port) != OK) {
-		return ERR_CANT_CONNECT;
+void MessagePackRPC::_write_thread_func(void *p_user_data) {
+	MessagePackRPC *rpc = (MessagePackRPC *)p_user_data;
+	while (rpc->running) {
+		// Sleep until a message is queued, or the read thread nudges us while idle.
+		rpc->write_sem.wait();
+		if (rpc->connected) {
+			if (rpc->coalescing_window_usec > 0 && rpc->running) {
+				// Let more messages queue up, so they go out in the same send.
+				OS::get_singleton()->delay_usec(rpc->coalescing_window_usec);
+			}
+			rpc->_write_out();
+		}
+	}
+}
+
+void MessagePackRPC::_connection_lost() {
+	_cancel_sync_calls();
+	Array calls = _take_async_calls();
+	if (!calls.is_empty()) {
+		call_deferred(SNAME("_calls_failed"), calls, MessagePackRPCCall::STATUS_CANCELLED);
+	}
+}
+
+bool MessagePackRPC::_io_step() {
+	// One non-blocking pass, for connections driven by a server's I/O loop.
+	int moved = _poll();
+	if (!connected) {
+		return false;
+	}
+	if (moved == 0) {
+		in_buf.shrink_if_idle();
 	}
-	tcp_stream->set_big_endian(p_big_endian);
+	moved += _write_out();
+	_tick_call_wheel();
+	_reap_handler_tasks();
+	return moved > 0;
+}
 
+void MessagePackRPC::_start_io() {
+	transport->set_no_delay(no_delay);
+	direct_io = transport->is_direct();
 	_start_stream();
+	transport_closed = false;
 	connected = true;
 	running = true;
-	thread.start(_thread_func, this);
-	emit_signal(SNAME("rpc_connected"), tcp_stream->get_connected_host(), tcp_stream->get_connected_port());
+	{
+		// Ids learnt from the previous peer don't apply to this one.
+		MutexLock lock(remote_methods_mutex);
+		remote_method_ids.clear();
+		remote_method_ids_requested = false;
+	}
+	{
+		// Nor do half sent or half received fragments.
+		MutexLock lock(priorities_mutex);
+		response_priorities.clear();
+	}
+	{
+		MutexLock lock(cache_mutex);
+		cache_pending.clear();
+	}
+	in_fragments.clear();
+	in_fragments_bytes = 0;
+	if (!server) {
+		thread.start(_thread_func, this);
+		write_thread.start(_write_thread_func, this);
+	} // Otherwise the server's I/O loop takes it from here.
+	if (negotiate_method_ids) {
+		request_method_ids();
+	}
+}
 
-	return OK;
+Error MessagePackRPC::connect_to_host(const IPAddress &p_ip, int p_port, bool p_big_endian) {
+	// try to connect to the specified address.
+	Ref<MessagePackRPCTransportTCP> tcp;
+	tcp.instantiate();
+	if (tcp->connect_to_host(p_ip, p_port) != OK) {
+		return ERR_CANT_CONNECT;
+	}
+	if (tcp->get_stream().is_valid()) {
+		// Only when going through a StreamPeerTCP, see MessagePackRPCTransportTCP.
+		tcp->get_stream()->set_big_endian(p_big_endian);
+	}
+
+	return takeover_transport(tcp);
+}
+
+Error MessagePackRPC::connect_to_path(const String &p_path) {
+	Ref<MessagePackRPCTransportUnix> local;
+	local.instantiate();
+	Error err = local->connect_to_path(p_path);
+	if (err != OK) {
+		return err == ERR_UNAVAILABLE ? err : ERR_CANT_CONNECT;
+	}
+
+	return takeover_transport(local);
 }
 
 Error MessagePackRPC::takeover_connection(Ref<StreamPeerTCP> p_peer) {
 	ERR_FAIL_COND_V_MSG(!p_peer.is_valid(), ERR_INVALID_PARAMETER, "Stream invalid.");
 	p_peer->poll();
 	ERR_FAIL_COND_V_MSG(p_peer->get_status() != StreamPeerTCP::STATUS_CONNECTED, ERR_CONNECTION_ERROR, "Not connected.");
+
+	Ref<MessagePackRPCTransportTCP> tcp = memnew(MessagePackRPCTransportTCP(p_peer));
+	return takeover_transport(tcp);
+}
+
+Error MessagePackRPC::takeover_transport(const Ref<MessagePackRPCTransport> &p_transport) {
+	ERR_FAIL_COND_V_MSG(!p_transport.is_valid(), ERR_INVALID_PARAMETER, "Transport invalid.");
+	p_transport->poll();
+	ERR_FAIL_COND_V_MSG(!p_transport->is_open(), ERR_CONNECTION_ERROR, "Not connected.");
 	close();
-	tcp_stream = p_peer;
+	transport = p_transport;
 
-	_start_stream();
-	connected = true;
-	running = true;
-	thread.start(_thread_func, this);
-	emit_signal(SNAME("rpc_connected"), tcp_stream->get_connected_host(), tcp_stream->get_connected_port());
+	_start_io();
+	emit_signal(SNAME("rpc_connected"), transport->get_peer_host(), transport->get_peer_port());
 
 	return OK;
 }
 
+Ref<MessagePackRPCTransport> MessagePackRPC::get_transport() const {
+	return transport;
+}
+
 #if MPACK_EXTENSIONS
 void MessagePackRPC::register_extension_type(int8_t p_ext_type, const Callable &p_decoder) {
 	msg_pack.register_extension_type(p_ext_type, p_decoder);
@@ -224,14 +819,13 @@ void MessagePackRPC::register_extension_type(int8_t p_ext_type, const Callable &
 
 size_t MessagePackRPC::_stream_reader(mpack_tree_t *p_tree, char *r_buffer, size_t p_count) {
 	MessagePackRPC *rpc = (MessagePackRPC *)mpack_tree_context(p_tree);
-	size_t bytes_left = rpc->in_tail - rpc->in_head;
-	size_t read_size = MIN(p_count, bytes_left);
-	const uint8_t *stream_ptr = rpc->in_buf.ptr();
-	if (read_size > 0) {
-		memcpy(r_buffer, stream_ptr + rpc->in_head, read_size);
-		rpc->in_head += read_size;
+	if (rpc->direct_io) {
+		int read = 0;
+		rpc->transport->get_partial_data((uint8_t *)r_buffer, MIN(p_count, size_t(INT32_MAX)), read);
+		rpc->metrics.add(rpc->metrics.bytes_in, read);
+		return read;
 	}
-	return read_size;
+	return rpc->in_buf.read((uint8_t *)r_buffer, MIN(p_count, size_t(UINT32_MAX)));
 }
 
 void MessagePackRPC::_start_stream(int p_msgs_max) {
@@ -239,104 +833,360 @@ void MessagePackRPC::_start_stream(int p_msgs_max) {
 }
 
 Error MessagePackRPC::_try_parse_stream() {
-	Error err = msg_pack.try_parse_stream();
-	if (err == OK) {
-		// if okay, got data.
-		_message_handle(msg_pack.get_data());
+	// Parse every complete message, then hand them all to the main thread at once.
+	Error err = msg_pack.try_parse_stream_tree();
+	while (err == OK) {
+		metrics.add(metrics.messages_in);
+		if (capture.is_active()) {
+			capture.record(MessagePackRPCCapture::DIRECTION_IN, msg_pack.get_current_stream_data(), msg_pack.get_current_stream_length());
+		}
+		if (!_try_cached_response()) {
+			err = msg_pack.decode_stream_tree();
+			if (err != OK) {
+				break;
+			}
+			_message_handle(msg_pack.get_data());
+		}
+		err = msg_pack.try_parse_stream_tree();
+	}
+	if (!in_batch.is_empty()) {
+		call_deferred(SNAME("_messages_received"), in_batch);
+		in_batch = Array();
+	}
+	if (err != ERR_SKIP) {
+		// The stream can't recover from a parse error.
+		metrics.add(metrics.parse_errors);
+		_error_handle(err, msg_pack.get_error_message());
+		connected = false;
+		return err;
 	}
 
-	return err;
+	return OK;
 }
 
-void MessagePackRPC::_write_out() {
-	while (tcp_stream->get_status() == StreamPeerTCP::STATUS_CONNECTED && tcp_stream->wait(NetSocket::POLL_TYPE_OUT) == OK) {
-		uint8_t *buf = out_buf.ptrw();
-		if (out_head >= out_tail) {
-			if (msg_queue.size() == 0) {
-				break; // Nothing left to send
-			}
-			mutex.lock();
-			Array msg = msg_queue[0];
-			msg_queue.pop_front();
-			mutex.unlock();
+bool MessagePackRPC::_is_above_high_watermark() const {
+	return queued_bytes.load() >= send_queue_max_bytes || queued_messages.load() >= send_queue_max_messages;
+}
+
+bool MessagePackRPC::_is_below_low_watermark() const {
+	return queued_bytes.load() <= send_queue_max_bytes * send_queue_low_watermark &&
+			queued_messages.load() <= send_queue_max_messages * send_queue_low_watermark;
+}
 
-			PackedByteArray msg_buf = make_message_byte_array(msg);
-			ERR_CONTINUE(msg_buf.size() <= 0 || msg_buf.size() > _MSG_BUF_MAX_SIZE);
+void MessagePackRPC::_block_send() {
+	bool expected = false;
+	if (send_blocked.compare_exchange_strong(expected, true)) {
+		call_deferred(SNAME("_send_state_changed"), true);
+		// The writer may have drained the queue before the flag was set.
+		_try_unblock_send();
+	}
+}
 
-			memcpy(out_buf.ptrw(), msg_buf.ptr(), msg_buf.size());
-			out_head = 0;
-			out_tail = msg_buf.size();
+void MessagePackRPC::_try_unblock_send() {
+	if (!_is_below_low_watermark()) {
+		return;
+	}
+	bool expected = true;
+	if (send_blocked.compare_exchange_strong(expected, false)) {
+		{
+			// Waiters check the flag with send_mutex locked, so they can't miss this.
+			std::lock_guard<std::mutex> lock(send_mutex);
+		}
+		send_cond.notify_all();
+		call_deferred(SNAME("_send_state_changed"), false);
+	}
+}
+
+void MessagePackRPC::_drop_queued() {
+	// With the I/O stopped. Nothing queued for this connection may go out on the
+	// next one, the caller would see its requests run twice.
+	for (int i = 0; i < PRIORITY_MAX; i++) {
+		msg_queues[i]->clear();
+		out_pending[i].msg = PackedByteArray();
+	}
+	out_partial = nullptr;
+	out_buf.release();
+	in_buf.release();
+	queued_bytes = 0;
+	queued_messages = 0;
+	if (send_blocked.exchange(false)) {
+		{
+			std::lock_guard<std::mutex> lock(send_mutex);
+		}
+		send_cond.notify_all();
+		call_deferred(SNAME("_send_state_changed"), false);
+	}
+}
+
+void MessagePackRPC::_dequeued(uint32_t p_size) {
+	queued_bytes -= p_size;
+	queued_messages--;
+	if (send_blocked.load()) {
+		_try_unblock_send();
+	}
+}
+
+bool MessagePackRPC::_fill_fragment(OutPending &p_pending) {
+	// The next piece of a large message, as a fragment notification the peer reassembles.
+	uint32_t size = p_pending.msg.size();
+	uint32_t len = MIN(uint32_t(fragment_size), size - p_pending.offset);
+	if (out_buf.space_left() < len + _RPC_FRAGMENT_HEADER_MAX_SIZE) {
+		if (!out_buf.is_empty() || !out_buf.reserve(len + _RPC_FRAGMENT_HEADER_MAX_SIZE)) {
+			return false; // Goes with the next send.
+		}
+	}
+	if (p_pending.offset == 0) {
+		p_pending.fragment_id = next_fragment_id++;
+	}
+	bool last = p_pending.offset + len == size;
+	Array params;
+	params.push_back(p_pending.fragment_id);
+	params.push_back(last);
+	params.push_back(p_pending.msg.slice(p_pending.offset, p_pending.offset + len));
+	PackedByteArray frame = make_notification(_RPC_FRAGMENT_METHOD, params);
+	out_buf.write(frame.ptr(), frame.size());
+	p_pending.offset += len;
+	if (last) {
+		p_pending.msg = PackedByteArray();
+	}
+	return true;
+}
+
+MessagePackRPC::OutPending *MessagePackRPC::_next_out_pending() {
+	// Highest lane first. Lanes can only switch between messages, or between the
+	// fragments of a large one.
+	for (int lane = 0; lane < PRIORITY_MAX; lane++) {
+		if (!out_pending[lane].msg.is_empty()) {
+			return &out_pending[lane]; // Continues a fragmented message
+		}
+		if (msg_queues[lane]->pop(out_pending[lane].msg)) {
+			out_pending[lane].offset = 0;
+			_dequeued(out_pending[lane].msg.size());
+			return &out_pending[lane];
 		}
-		int sent = 0;
-		tcp_stream->put_partial_data(buf + out_head, out_tail - out_head, sent);
-		out_head += sent;
 	}
+	return nullptr;
 }
 
-void MessagePackRPC::_read_in() {
-	while (tcp_stream->get_status() == StreamPeerTCP::STATUS_CONNECTED && tcp_stream->wait(NetSocket::POLL_TYPE_IN) == OK) {
-		uint8_t *buf = in_buf.ptrw();
-		if (in_head >= in_tail) {
-			if (tcp_stream->get_available_bytes() < 1) {
+void MessagePackRPC::_fill_out_buf() {
+	// Pack as many queued messages as fit into one send.
+	while (true) {
+		OutPending *next = _next_out_pending();
+		if (!next) {
+			break; // Nothing left to send
+		}
+		OutPending &pending = *next;
+		uint32_t size = pending.msg.size();
+		if (fragment_size > 0 && size > uint32_t(fragment_size)) {
+			if (!_fill_fragment(pending)) {
 				break;
 			}
-			int read = 0;
-			Error err = tcp_stream->get_partial_data(buf, _MSG_BUF_MAX_SIZE, read);
-			ERR_CONTINUE(err != OK || read <= 0);
-			in_head = 0;
-			in_tail = read;
+			continue;
+		}
+		if (out_buf.space_left() < size) {
+			// Only grow for a message that doesn't fit on its own, otherwise send what we have first.
+			if (!out_buf.is_empty()) {
+				break; // Goes with the next send.
+			}
+			if (!out_buf.reserve(size)) {
+				ERR_PRINT("MessagePackRPC: Message of " + itos(size) + " bytes is bigger than max_buffer_size, dropped.");
+				pending.msg = PackedByteArray();
+				continue;
+			}
+		}
+		out_buf.write(pending.msg.ptr(), size);
+		pending.msg = PackedByteArray();
+	}
+}
+
+int MessagePackRPC::_write_direct() {
+	// Messages are copied from the queues straight into the transport. One written
+	// in part is finished before any other starts, fragment_size doesn't apply.
+	int total = 0;
+	while (transport->is_open()) {
+		OutPending *pending = out_partial;
+		if (!pending) {
+			pending = _next_out_pending();
+			if (!pending) {
+				break; // Nothing left to send
+			}
+		}
+		uint32_t size = pending->msg.size();
+		int sent = 0;
+		if (transport->put_partial_data(pending->msg.ptr() + pending->offset, size - pending->offset, sent) != OK) {
+			break;
+		}
+		pending->offset += sent;
+		total += sent;
+		if (pending->offset == size) {
+			pending->msg = PackedByteArray();
+			out_partial = nullptr;
+			continue;
+		}
+		out_partial = pending;
+		if (!running || server) {
+			break; // The server's loop retries on its next pass.
+		}
+		// The peer's buffer is full, sleep until it drains.
+		transport->wait(NetSocket::POLL_TYPE_OUT, _IO_WAIT_TIMEOUT_MSEC);
+	}
+	metrics.add(metrics.bytes_out, total);
+	return total;
+}
+
+int MessagePackRPC::_write_out() {
+	if (direct_io) {
+		return _write_direct();
+	}
+	int total = 0;
+	while (transport->is_open()) {
+		if (out_buf.is_empty()) {
+			_fill_out_buf();
+			if (out_buf.is_empty()) {
+				break; // Nothing left to send
+			}
+		}
+		const uint8_t *ptr = nullptr;
+		uint32_t size = out_buf.get_read_span(ptr);
+		int sent = 0;
+		if (transport->put_partial_data(ptr, size, sent) != OK) {
+			break;
+		}
+		out_buf.advance_read(sent);
+		total += sent;
+		if (uint32_t(sent) < size) {
+			if (!running || server) {
+				break; // The server's loop retries on its next pass.
+			}
+			// Socket buffer is full, sleep until it drains.
+			transport->wait(NetSocket::POLL_TYPE_OUT, _IO_WAIT_TIMEOUT_MSEC);
+		}
+	}
+	// Keep the block across bursts, like the read side it goes back to the pool once idle.
+	out_buf.shrink_if_idle();
+	metrics.add(metrics.bytes_out, total);
+	return total;
+}
+
+int MessagePackRPC::_read_in() {
+	int total = 0;
+	while (transport->is_open()) {
+		int available = transport->get_available_bytes();
+		if (available <= 0) {
+			break;
+		}
+		// Grow towards what's available, the parser drains the buffer after each read.
+		if (!in_buf.reserve(available) && in_buf.space_left() == 0) {
+			break;
 		}
-		int available = tcp_stream->get_available_bytes();
+		uint8_t *ptr = nullptr;
+		uint32_t size = MIN(in_buf.get_write_span(ptr), uint32_t(available));
 		int read = 0;
-		if (in_tail + available < _MSG_BUF_MAX_SIZE) {
-			tcp_stream->get_partial_data(buf + in_tail, available, read);
-		} else {
-			tcp_stream->get_partial_data(buf + in_tail, _MSG_BUF_MAX_SIZE - in_tail, read);
+		Error err = transport->get_partial_data(ptr, size, read);
+		if (err != OK || read <= 0) {
+			break;
 		}
-		in_tail += read;
+		in_buf.commit_write(read);
+		total += read;
 	}
+	metrics.add(metrics.bytes_in, total);
+	return total;
 }
 
-void MessagePackRPC::poll() {
+int MessagePackRPC::_poll() {
+	int total = 0;
 	if (connected) {
-		_write_out();
-		_read_in();
-		if (in_tail > in_head) {
-			_try_parse_stream();
+		transport->poll();
+		if (direct_io) {
+			// The parser pulls straight from the transport, in_buf stays unused.
+			total = transport->get_available_bytes();
+			if (_try_parse_stream() != OK) {
+				return total;
+			}
+		} else {
+			// The parser copies what it needs out of in_buf, so read and parse until the socket is drained.
+			do {
+				total += _read_in();
+				if (_try_parse_stream() != OK) {
+					return total;
+				}
+			} while (in_buf.is_empty() && transport->get_available_bytes() > 0);
 		}
-		connected = tcp_stream->get_status() == StreamPeerTCP::STATUS_CONNECTED;
+		connected = transport->is_open();
 	}
+	return total;
+}
+
+void MessagePackRPC::poll() {
+	_poll();
 }
 
 void MessagePackRPC::close() {
-	running = false;
+	{
+		// Release threads blocked in a put.
+		std::lock_guard<std::mutex> lock(send_mutex);
+		running = false;
+	}
+	send_cond.notify_all();
+	if (server && server->_detach_peer(this)) {
+		// Out of the I/O loop, the server frees the peer once it reports the disconnection.
+		server->call_deferred(SNAME("_peer_closed"), uint64_t(get_instance_id()));
+	}
+	write_sem.post();
 	thread.wait_to_finish();
+	write_thread.wait_to_finish();
+	_reap_handler_tasks(true);
 	connected = false;
-	if (tcp_stream.is_valid()) {
-		tcp_stream->disconnect_from_host();
-		emit_signal(SNAME("rpc_disconnected"), tcp_stream->get_connected_host(), tcp_stream->get_connected_port());
+	_drop_queued();
+	_cancel_sync_calls();
+	_calls_failed(_take_async_calls(), MessagePackRPCCall::STATUS_CANCELLED);
+	// Only once per connection, the server closes a peer again after disconnect_peer().
+	if (transport.is_valid() && !transport_closed.exchange(true)) {
+		String host = transport->get_peer_host();
+		int port = transport->get_peer_port();
+		transport->close();
+		emit_signal(SNAME("rpc_disconnected"), host, port);
 	}
 }
 
-Error MessagePackRPC::register_request(const String &p_method, const Callable &p_callable, bool p_rewrite) {
+Error MessagePackRPC::register_request(const String &p_method, const Callable &p_callable, bool p_rewrite, bool p_threaded, int p_cache_ttl_msec, int p_cache_max_entries) {
+	ERR_FAIL_COND_V_MSG(p_cache_ttl_msec < 0 || p_cache_max_entries <= 0, ERR_INVALID_PARAMETER, "Invalid cache policy.");
+	MutexLock lock(handlers_mutex);
 	ERR_FAIL_COND_V_MSG((!p_rewrite && request_map.has(p_method)), ERR_ALREADY_EXISTS, "Request '" + p_method + "' already exist.");
-	request_map[p_method] = p_callable;
+	Handler handler;
+	handler.callable = p_callable;
+	handler.threaded = p_threaded;
+	request_map[p_method] = handler;
+	_intern_method(p_method);
+	if (p_cache_ttl_msec > 0) {
+		response_cache.set_policy(p_method, p_cache_ttl_msec, p_cache_max_entries);
+	} else {
+		response_cache.remove_policy(p_method);
+	}
 	return OK;
 }
 
 Error MessagePackRPC::unregister_request(const String &p_method) {
+	MutexLock lock(handlers_mutex);
 	ERR_FAIL_COND_V_MSG(!request_map.has(p_method), ERR_DOES_NOT_EXIST, "Reqeust '" + p_method + "'does not registered.");
 	request_map.erase(p_method);
+	response_cache.remove_policy(p_method);
 	return OK;
 }
 
-Error MessagePackRPC::register_notification(const String &p_method, const Callable &p_callable, bool p_rewrite) {
+Error MessagePackRPC::register_notification(const String &p_method, const Callable &p_callable, bool p_rewrite, bool p_threaded) {
+	MutexLock lock(handlers_mutex);
 	ERR_FAIL_COND_V_MSG((!p_rewrite && notify_map.has(p_method)), ERR_ALREADY_EXISTS, "Notify '" + p_method + "' already exist.");
-	notify_map[p_method] = p_callable;
+	Handler handler;
+	handler.callable = p_callable;
+	handler.threaded = p_threaded;
+	notify_map[p_method] = handler;
+	_intern_method(p_method);
 	return OK;
 }
 
 Error MessagePackRPC::unregister_notification(const String &p_method) {
+	MutexLock lock(handlers_mutex);
 	ERR_FAIL_COND_V_MSG(!notify_map.has(p_method), ERR_DOES_NOT_EXIST, "Notify '" + p_method + "'does not registered.");
 	notify_map.erase(p_method);
 	return OK;
@@ -346,36 +1196,376 @@ void MessagePackRPC::_got_error(Error p_err, const String &p_err_msg) {
 	emit_signal(SNAME("got_error"), p_err, p_err_msg);
 }
 
-void MessagePackRPC::_message_received(const Variant &p_message) {
-	emit_signal(SNAME("message_received"), p_message);
+void MessagePackRPC::_call_handler(const Callable &p_callable, const StringName &p_method, const Array &p_args) {
+	uint64_t start_usec = OS::get_singleton()->get_ticks_usec();
+	p_callable.callv(p_args);
+	metrics.record_handler(p_method, OS::get_singleton()->get_ticks_usec() - start_usec);
 }
 
-void MessagePackRPC::_request_received(int p_msgid, const String &p_method, const Array &p_params) {
-	emit_signal(SNAME("request_received"), p_msgid, p_method, p_params);
+void MessagePackRPC::_messages_received(const Array &p_messages) {
+	for (int i = 0; i < p_messages.size(); i++) {
+		Array msg_arr = p_messages[i];
+		// Server handlers are timed from here, their lookup included.
+		uint64_t start_usec = OS::get_singleton()->get_ticks_usec();
+		switch (int(msg_arr[0])) {
+			case REQUEST: // Request [msgid, method, params]
+				if (Handler *handler = request_map.getptr(msg_arr[2])) {
+					_call_handler(handler->callable, msg_arr[2], msg_arr.slice(1));
+					// registered request, not emit signal
+					continue;
+				}
+				if (server && server->_dispatch_request(this, msg_arr)) {
+					metrics.record_handler(msg_arr[2], OS::get_singleton()->get_ticks_usec() - start_usec);
+					// registered on the server, not emit signal
+					continue;
+				}
+				emit_signal(SNAME("request_received"), msg_arr[1], msg_arr[2], msg_arr[3]);
+				break;
+			case RESPONSE: // Response [msgid, error, result]
+				if (msg_arr[1].get_type() == Variant::INT) {
+					Ref<MessagePackRPCCall> call = _take_async_call(msg_arr[1]);
+					if (call.is_valid()) {
+						if (call->is_batch()) {
+							call->complete_item(msg_arr[1], msg_arr[3], msg_arr[2]);
+						} else {
+							metrics.record_latency(call->get_method(), start_usec - call->get_start_usec());
+							call->complete(MessagePackRPCCall::STATUS_COMPLETED, msg_arr[3], msg_arr[2]);
+						}
+						// awaited call, not emit signal
+						continue;
+					}
+				}
+				emit_signal(SNAME("response_received"), msg_arr[1], msg_arr[2], msg_arr[3]);
+				break;
+			case NOTIFICATION: // Notification [method, params]
+				if (Handler *handler = notify_map.getptr(msg_arr[1])) {
+					_call_handler(handler->callable, msg_arr[1], msg_arr.slice(1));
+					// registered notification, not emit signal
+					continue;
+				}
+				if (server && server->_dispatch_notification(this, msg_arr)) {
+					metrics.record_handler(msg_arr[1], OS::get_singleton()->get_ticks_usec() - start_usec);
+					// registered on the server, not emit signal
+					continue;
+				}
+				emit_signal(SNAME("notification_received"), msg_arr[1], msg_arr[2]);
+				break;
+		}
+		emit_signal(SNAME("message_received"), msg_arr);
+	}
+	emit_signal(SNAME("messages_received"), p_messages);
 }
 
-void MessagePackRPC::_response_received(int p_msgid, const Variant &p_error, const Variant &p_result) {
-	emit_signal(SNAME("response_received"), p_msgid, p_error, p_result);
+void MessagePackRPC::_send_state_changed(bool p_blocked) {
+	emit_signal(p_blocked ? SNAME("send_blocked") : SNAME("send_ready"));
 }
 
-void MessagePackRPC::_notification_received(const String &p_method, const Array &p_params) {
-	emit_signal(SNAME("notification_received"), p_method, p_params);
+void MessagePackRPC::_calls_failed(const Array &p_calls, int p_status) {
+	Error err = p_status == MessagePackRPCCall::STATUS_TIMEOUT ? ERR_TIMEOUT : ERR_CONNECTION_ERROR;
+	for (int i = 0; i < p_calls.size(); i++) {
+		Ref<MessagePackRPCCall> call = p_calls[i];
+		call->fail(MessagePackRPCCall::Status(p_status), err);
+	}
 }
 
 bool MessagePackRPC::is_rpc_connected() {
 	return connected;
 }
 
-Error MessagePackRPC::_put_message(const Array &p_msg) {
-	MutexLock lock(mutex);
-	if (msg_queue.size() >= _MSG_QUEUE_MAX_SIZE) {
-		return ERR_OUT_OF_MEMORY;
+Error MessagePackRPC::_put_message(const Array &p_msg, Priority p_priority, bool p_response) {
+	// Encoded by the calling thread, the write thread only copies bytes.
+	PackedByteArray msg_buf = make_message_byte_array(p_msg);
+	ERR_FAIL_COND_V_MSG(msg_buf.is_empty(), ERR_INVALID_PARAMETER, "Message can't be encoded.");
+	return _put_encoded(msg_buf, p_priority, p_response);
+}
+
+Error MessagePackRPC::_put_encoded(const PackedByteArray &p_msg_buf, Priority p_priority, bool p_response) {
+	ERR_FAIL_INDEX_V(p_priority, PRIORITY_MAX, ERR_INVALID_PARAMETER);
+	ERR_FAIL_COND_V_MSG(uint32_t(p_msg_buf.size()) > max_buffer_size, ERR_OUT_OF_MEMORY, "Message is too big.");
+	if (p_response || p_priority == PRIORITY_CONTROL) {
+		// Never waits, only a full lane refuses it.
+		if (!msg_queues[p_priority]->push(p_msg_buf)) {
+			return ERR_BUSY;
+		}
+	} else {
+		Error err = _wait_to_queue(p_msg_buf, p_priority);
+		if (err != OK) {
+			return err;
+		}
+	}
+	queued_bytes += p_msg_buf.size();
+	queued_messages++;
+	metrics.add(metrics.messages_out);
+	if (capture.is_active()) {
+		capture.record(MessagePackRPCCapture::DIRECTION_OUT, p_msg_buf.ptr(), p_msg_buf.size());
+	}
+	if (_is_above_high_watermark()) {
+		_block_send();
+	}
+	if (server) {
+		server->_wake_loop(server_loop);
+	} else {
+		write_sem.post();
+	}
+	return OK;
+}
+
+Error MessagePackRPC::_wait_to_queue(const PackedByteArray &p_msg_buf, Priority p_priority) {
+	// Queues the message unless over the high watermark, in which case it waits up to send_timeout_msec.
+	uint64_t start_time = OS::get_singleton()->get_ticks_msec();
+	while (true) {
+		if (!send_blocked.load()) {
+			if (msg_queues[p_priority]->push(p_msg_buf)) {
+				break;
+			}
+			_block_send(); // No free slot left
+		}
+		// Over the high watermark, wait for send_ready if allowed to.
+		int64_t remaining = int64_t(send_timeout_msec) - int64_t(OS::get_singleton()->get_ticks_msec() - start_time);
+		if (remaining <= 0) {
+			return ERR_BUSY;
+		}
+		std::unique_lock<std::mutex> lock(send_mutex);
+		send_cond.wait_for(lock, std::chrono::milliseconds(remaining), [this] { return !send_blocked.load() || !running; });
+		if (!running) {
+			return ERR_UNAVAILABLE;
+		}
+	}
+	return OK;
+}
+
+void MessagePackRPC::set_no_delay(bool p_enabled) {
+	no_delay = p_enabled;
+	if (connected) {
+		transport->set_no_delay(no_delay);
 	}
+}
+
+bool MessagePackRPC::is_no_delay() const {
+	return no_delay;
+}
+
+void MessagePackRPC::set_coalescing_window_usec(int p_usec) {
+	ERR_FAIL_COND(p_usec < 0);
+	coalescing_window_usec = p_usec;
+}
+
+int MessagePackRPC::get_coalescing_window_usec() const {
+	return coalescing_window_usec;
+}
+
+int64_t MessagePackRPC::get_queued_bytes() const {
+	return queued_bytes.load();
+}
+
+int MessagePackRPC::get_queued_messages() const {
+	return queued_messages.load();
+}
+
+bool MessagePackRPC::is_send_blocked() const {
+	return send_blocked.load();
+}
+
+// Exposed as <prefix>/<name> Performance monitors.
+static const char *_rpc_monitor_names[] = {
+	"queued_messages",
+	"queued_bytes",
+	"bytes_in",
+	"bytes_out",
+	"messages_in",
+	"messages_out",
+	"parse_errors",
+	"timeouts",
+	"latency_p50_usec",
+	"latency_p99_usec",
+};
+
+Dictionary MessagePackRPC::get_metrics() {
+	Dictionary ret = metrics.get_metrics();
+	ret["queued_messages"] = get_queued_messages();
+	ret["queued_bytes"] = get_queued_bytes();
+	return ret;
+}
+
+void MessagePackRPC::reset_metrics() {
+	metrics.reset();
+}
 
-	msg_queue.push_back(p_msg);
+Error MessagePackRPC::add_performance_monitors(const String &p_prefix) {
+	ERR_FAIL_COND_V_MSG(p_prefix.is_empty() || p_prefix.contains("/"), ERR_INVALID_PARAMETER, "The prefix is a single monitor category.");
+	Performance *performance = Performance::get_singleton();
+	ERR_FAIL_NULL_V(performance, ERR_UNAVAILABLE);
+	remove_performance_monitors();
+	for (const char *name : _rpc_monitor_names) {
+		ERR_FAIL_COND_V_MSG(performance->has_custom_monitor(p_prefix + "/" + name), ERR_ALREADY_EXISTS, "Monitors with prefix '" + p_prefix + "' already exist.");
+	}
+	for (const char *name : _rpc_monitor_names) {
+		Vector<Variant> args;
+		args.push_back(String(name));
+		performance->add_custom_monitor(p_prefix + "/" + name, Callable(this, SNAME("_get_monitor")), args);
+	}
+	monitor_prefix = p_prefix;
 	return OK;
 }
 
+void MessagePackRPC::remove_performance_monitors() {
+	Performance *performance = Performance::get_singleton();
+	if (monitor_prefix.is_empty() || !performance) {
+		return;
+	}
+	for (const char *name : _rpc_monitor_names) {
+		StringName id = monitor_prefix + "/" + name;
+		if (performance->has_custom_monitor(id)) {
+			performance->remove_custom_monitor(id);
+		}
+	}
+	monitor_prefix = String();
+}
+
+Error MessagePackRPC::start_capture(const String &p_path) {
+	return capture.start(p_path);
+}
+
+void MessagePackRPC::stop_capture() {
+	capture.stop();
+}
+
+bool MessagePackRPC::is_capturing() const {
+	return capture.is_active();
+}
+
+Variant MessagePackRPC::_get_monitor(const String &p_name) {
+	if (p_name == "queued_messages") {
+		return get_queued_messages();
+	} else if (p_name == "queued_bytes") {
+		return get_queued_bytes();
+	} else if (p_name == "bytes_in") {
+		return metrics.bytes_in.load();
+	} else if (p_name == "bytes_out") {
+		return metrics.bytes_out.load();
+	} else if (p_name == "messages_in") {
+		return metrics.messages_in.load();
+	} else if (p_name == "messages_out") {
+		return metrics.messages_out.load();
+	} else if (p_name == "parse_errors") {
+		return metrics.parse_errors.load();
+	} else if (p_name == "timeouts") {
+		return metrics.timeouts.load();
+	} else if (p_name == "latency_p50_usec") {
+		return metrics.latency_usec.get_percentile(0.5);
+	} else if (p_name == "latency_p99_usec") {
+		return metrics.latency_usec.get_percentile(0.99);
+	}
+	return 0;
+}
+
+void MessagePackRPC::set_send_queue_max_bytes(int64_t p_bytes) {
+	ERR_FAIL_COND(p_bytes < 1);
+	send_queue_max_bytes = p_bytes;
+}
+
+int64_t MessagePackRPC::get_send_queue_max_bytes() const {
+	return send_queue_max_bytes;
+}
+
+void MessagePackRPC::set_send_queue_max_messages(int p_count) {
+	ERR_FAIL_COND_MSG(p_count < 1 || p_count > _MSG_QUEUE_MAX_SIZE, "Message count out of range.");
+	send_queue_max_messages = p_count;
+}
+
+int MessagePackRPC::get_send_queue_max_messages() const {
+	return send_queue_max_messages;
+}
+
+void MessagePackRPC::set_send_queue_low_watermark(double p_ratio) {
+	ERR_FAIL_COND(p_ratio < 0.0 || p_ratio >= 1.0);
+	send_queue_low_watermark = p_ratio;
+}
+
+double MessagePackRPC::get_send_queue_low_watermark() const {
+	return send_queue_low_watermark;
+}
+
+void MessagePackRPC::set_send_timeout_msec(int p_msec) {
+	ERR_FAIL_COND(p_msec < 0);
+	send_timeout_msec = p_msec;
+}
+
+int MessagePackRPC::get_send_timeout_msec() const {
+	return send_timeout_msec;
+}
+
+void MessagePackRPC::set_method_priority(const String &p_method, Priority p_priority) {
+	ERR_FAIL_INDEX(p_priority, PRIORITY_MAX);
+	MutexLock lock(priorities_mutex);
+	if (p_priority == PRIORITY_NORMAL) {
+		method_priorities.erase(p_method);
+	} else {
+		method_priorities[p_method] = p_priority;
+	}
+}
+
+MessagePackRPC::Priority MessagePackRPC::get_method_priority(const String &p_method) {
+	return _get_send_priority(p_method);
+}
+
+void MessagePackRPC::set_fragment_size(int p_size) {
+	ERR_FAIL_COND_MSG(p_size != 0 && p_size < 64, "Fragment size must be 0 (disabled) or at least 64 bytes.");
+	fragment_size = p_size;
+}
+
+int MessagePackRPC::get_fragment_size() const {
+	return fragment_size;
+}
+
+Error MessagePackRPC::request_method_ids() {
+	ERR_FAIL_COND_V_MSG(!running, ERR_UNAVAILABLE, "Connect to a peer first.");
+	uint64_t id = msgid.fetch_add(1);
+	{
+		MutexLock lock(remote_methods_mutex);
+		remote_method_ids_msgid = id;
+		remote_method_ids_requested = true;
+	}
+	Array msg_req;
+	msg_req.resize(4);
+	msg_req[0] = REQUEST;
+	msg_req[1] = id;
+	msg_req[2] = _RPC_METHOD_IDS_METHOD;
+	msg_req[3] = Array();
+	Error err = _put_message(msg_req, PRIORITY_CONTROL);
+	// ERR_BUSY is backpressure, wait for send_ready.
+	ERR_FAIL_COND_V_MSG(err != OK && err != ERR_BUSY, err, "Message can't be queued.");
+	return err;
+}
+
+Dictionary MessagePackRPC::get_remote_method_ids() {
+	MutexLock lock(remote_methods_mutex);
+	Dictionary ids;
+	for (const KeyValue<String, int> &E : remote_method_ids) {
+		ids[E.key] = E.value;
+	}
+	return ids;
+}
+
+void MessagePackRPC::set_negotiate_method_ids(bool p_enabled) {
+	negotiate_method_ids = p_enabled;
+}
+
+bool MessagePackRPC::is_negotiate_method_ids() const {
+	return negotiate_method_ids;
+}
+
+void MessagePackRPC::set_max_buffer_size(int p_size) {
+	ERR_FAIL_COND_MSG(p_size < _RPC_BUFFER_MIN_SIZE || p_size > (1 << _RPC_BUFFER_MAX_SHIFT), "Buffer size out of range.");
+	in_buf.set_max_size(p_size);
+	out_buf.set_max_size(p_size);
+	max_buffer_size = out_buf.get_max_size();
+}
+
+int MessagePackRPC::get_max_buffer_size() const {
+	return max_buffer_size;
+}
+
 Array MessagePackRPC::_sync_call(const Variant **p_args, int p_argcount, Callable::CallError &r_error) {
 	if (p_argcount < 2) {
 		r_error.error = Callable::CallError::CALL_ERROR_TOO_FEW_ARGUMENTS;
@@ -410,35 +1600,43 @@ Array MessagePackRPC::_sync_call(const Variant **p_args, int p_argcount, Callabl
 
 Array MessagePackRPC::sync_callv(const String &p_method, uint64_t p_timeout_msec, const Array &p_params) {
 	ERR_FAIL_COND_V_MSG(!running, Array(), "Connect to a peer first.");
+	uint64_t id = msgid.fetch_add(1);
 	Array msg_req;
 	msg_req.resize(4);
 	msg_req[0] = REQUEST;
-	msg_req[1] = msgid;
-	msg_req[2] = p_method;
+	msg_req[1] = id;
+	msg_req[2] = _wire_method(p_method);
 	msg_req[3] = p_params;
 
-	sync_responded = false;
-	sync_msgid = msgid;
-	sync_started = true;
-	if (_put_message(msg_req) != OK) {
-		sync_started = false;
+	// Registered before sending, the response may arrive before _put_message returns.
+	SyncCall call;
+	{
+		std::lock_guard<std::mutex> lock(sync_mutex);
+		sync_calls.insert(id, &call);
+	}
+	uint64_t start_usec = OS::get_singleton()->get_ticks_usec();
+	if (_put_message(msg_req, _get_send_priority(p_method)) != OK) {
+		std::lock_guard<std::mutex> lock(sync_mutex);
+		sync_calls.erase(id);
 		ERR_FAIL_V_MSG(Array(), "Message queue is full.");
 	}
-	msgid += 1;
 
-	// Wait until sync response is received or timeout.
-	uint64_t start_time = OS::get_singleton()->get_ticks_msec();
-	while (!sync_responded) {
-		if (OS::get_singleton()->get_ticks_msec() - start_time > p_timeout_msec) {
-			// Timeout
-			sync_started = false;
-			ERR_FAIL_V_MSG(Array(), "Sync call timeout!");
-		}
-		OS::get_singleton()->delay_usec(1000);
+	// Wait until sync response is received, the connection closes, or timeout.
+	std::unique_lock<std::mutex> lock(sync_mutex);
+	call.cond.wait_for(lock, std::chrono::milliseconds(p_timeout_msec), [&call] { return call.responded || call.cancelled; });
+	sync_calls.erase(id);
+	if (!call.responded) {
+		ERR_FAIL_COND_V_MSG(call.cancelled, Array(), "Connection closed before the sync call was responded.");
+		metrics.add(metrics.timeouts);
+		ERR_FAIL_V_MSG(Array(), "Sync call timeout!");
 	}
-	sync_started = false;
+	metrics.record_latency(p_method, OS::get_singleton()->get_ticks_usec() - start_usec);
 
-	return sync_result;
+	Array result;
+	result.resize(2);
+	result[0] = call.error;
+	result[1] = call.result;
+	return result;
 }
 
 Error MessagePackRPC::_async_call(const Variant **p_args, int p_argcount, Callable::CallError &r_error) {
@@ -497,13 +1695,161 @@ Error MessagePackRPC::async_callv(const String &p_method, const Array &p_params)
 	Array msg_req;
 	msg_req.resize(4);
 	msg_req[0] = REQUEST;
-	msg_req[1] = msgid;
-	msg_req[2] = p_method;
+	msg_req[1] = msgid.fetch_add(1);
+	msg_req[2] = _wire_method(p_method);
 	msg_req[3] = p_params;
-	ERR_FAIL_COND_V_MSG(_put_message(msg_req) != OK, ERR_OUT_OF_MEMORY, "Message queue is full.");
-	msgid += 1;
+	Error err = _put_message(msg_req, _get_send_priority(p_method));
+	// ERR_BUSY is backpressure, wait for send_ready.
+	ERR_FAIL_COND_V_MSG(err != OK && err != ERR_BUSY, err, "Message can't be queued.");
 
-	return OK;
+	return err;
+}
+
+Ref<MessagePackRPCCall> MessagePackRPC::async_callv_future(const String &p_method, const Array &p_params, uint64_t p_timeout_msec) {
+	ERR_FAIL_COND_V_MSG(!running, Ref<MessagePackRPCCall>(), "Connect to a peer first.");
+	uint64_t id = msgid.fetch_add(1);
+	Ref<MessagePackRPCCall> call;
+	call.instantiate();
+	call->setup(id, p_method);
+
+	// Registered before sending, the response may arrive before _put_message returns.
+	{
+		MutexLock lock(async_mutex);
+		async_calls.insert(id, call);
+		if (p_timeout_msec > 0) {
+			_schedule_call_timeout(id, p_timeout_msec);
+		}
+	}
+
+	Array msg_req;
+	msg_req.resize(4);
+	msg_req[0] = REQUEST;
+	msg_req[1] = id;
+	msg_req[2] = _wire_method(p_method);
+	msg_req[3] = p_params;
+	if (_put_message(msg_req, _get_send_priority(p_method)) != OK) {
+		_take_async_call(id);
+		ERR_FAIL_V_MSG(Ref<MessagePackRPCCall>(), "Message queue is full.");
+	}
+
+	return call;
+}
+
+bool MessagePackRPC::_get_batch_item(const Variant &p_item, String &r_method, Array &r_params) {
+	// [method] or [method, params]
+	if (p_item.get_type() != Variant::ARRAY) {
+		return false;
+	}
+	Array item = p_item;
+	if (item.size() < 1 || item.size() > 2) {
+		return false;
+	}
+	if (item[0].get_type() != Variant::STRING && item[0].get_type() != Variant::STRING_NAME) {
+		return false;
+	}
+	r_method = item[0];
+	if (item.size() == 2) {
+		if (item[1].get_type() != Variant::ARRAY) {
+			return false;
+		}
+		r_params = item[1];
+	}
+	return true;
+}
+
+Error MessagePackRPC::_put_batch(const Array &p_msgs, Priority p_priority) {
+	// One encoder pass over all messages. The array header in front is dropped, so
+	// the buffer holds the messages back to back, as they go on the wire.
+	Array result = MessagePack::encode(p_msgs);
+	ERR_FAIL_COND_V_MSG(int(result[0]) != OK, ERR_INVALID_PARAMETER, "Some error occurred while packing batch: " + String(result[1]));
+	PackedByteArray msg_buf = result[1];
+	int count = p_msgs.size();
+	int header_size = count < 16 ? 1 : (count <= UINT16_MAX ? 3 : 5);
+
+	if (!direct_io && fragment_size > 0 && msg_buf.size() - header_size > fragment_size) {
+		// Fragments reassemble into a single message, so the batch keeps its array
+		// header and is queued and fragmented as a whole. The peer unpacks it.
+		return _put_encoded(msg_buf, p_priority);
+	}
+	return _put_encoded(msg_buf.slice(header_size), p_priority);
+}
+
+Ref<MessagePackRPCCall> MessagePackRPC::call_batch(const Array &p_calls, uint64_t p_timeout_msec) {
+	ERR_FAIL_COND_V_MSG(!running, Ref<MessagePackRPCCall>(), "Connect to a peer first.");
+	ERR_FAIL_COND_V_MSG(p_calls.is_empty(), Ref<MessagePackRPCCall>(), "Empty batch.");
+	uint32_t count = p_calls.size();
+	Array msgs;
+	msgs.resize(count);
+	// The batch goes on the highest lane any of its methods asks for.
+	Priority priority = PRIORITY_BULK;
+	for (uint32_t i = 0; i < count; i++) {
+		String method;
+		Array params;
+		ERR_FAIL_COND_V_MSG(!_get_batch_item(p_calls[i], method, params), Ref<MessagePackRPCCall>(), "Batch item " + itos(i) + " must be [method, params].");
+		Array msg_req;
+		msg_req.resize(4);
+		msg_req[0] = REQUEST;
+		msg_req[2] = _wire_method(method);
+		msg_req[3] = params;
+		msgs[i] = msg_req;
+		priority = MIN(priority, _get_send_priority(method));
+	}
+
+	// Consecutive msgids, a response finds its slot by its distance from the first.
+	uint64_t first = msgid.fetch_add(count);
+	for (uint32_t i = 0; i < count; i++) {
+		Array msg_req = msgs[i];
+		msg_req[1] = first + i;
+	}
+	Ref<MessagePackRPCCall> call;
+	call.instantiate();
+	call->setup_batch(first, count);
+
+	// Registered before sending, the responses may arrive before _put_batch returns.
+	{
+		MutexLock lock(async_mutex);
+		for (uint32_t i = 0; i < count; i++) {
+			async_calls.insert(first + i, call);
+		}
+		if (p_timeout_msec > 0) {
+			_schedule_call_timeout(first, p_timeout_msec, count);
+		}
+	}
+
+	if (_put_batch(msgs, priority) != OK) {
+		MutexLock lock(async_mutex);
+		for (uint32_t i = 0; i < count; i++) {
+			async_calls.erase(first + i);
+		}
+		ERR_FAIL_V_MSG(Ref<MessagePackRPCCall>(), "Message queue is full.");
+	}
+
+	return call;
+}
+
+Error MessagePackRPC::notify_batch(const Array &p_notifications) {
+	ERR_FAIL_COND_V_MSG(!running, ERR_UNAVAILABLE, "Connect to a peer first.");
+	ERR_FAIL_COND_V_MSG(p_notifications.is_empty(), ERR_INVALID_PARAMETER, "Empty batch.");
+	Array msgs;
+	msgs.resize(p_notifications.size());
+	Priority priority = PRIORITY_BULK;
+	for (int i = 0; i < p_notifications.size(); i++) {
+		String method;
+		Array params;
+		ERR_FAIL_COND_V_MSG(!_get_batch_item(p_notifications[i], method, params), ERR_INVALID_PARAMETER, "Batch item " + itos(i) + " must be [method, params].");
+		Array msg_req;
+		msg_req.resize(3);
+		msg_req[0] = NOTIFICATION;
+		msg_req[1] = _wire_method(method);
+		msg_req[2] = params;
+		msgs[i] = msg_req;
+		priority = MIN(priority, _get_send_priority(method));
+	}
+	Error err = _put_batch(msgs, priority);
+	// ERR_BUSY is backpressure, wait for send_ready.
+	ERR_FAIL_COND_V_MSG(err != OK && err != ERR_BUSY, err, "Message can't be queued.");
+
+	return err;
 }
 
 Error MessagePackRPC::response(uint64_t p_msgid, const Variant &p_result) {
@@ -515,9 +1861,14 @@ Error MessagePackRPC::response(uint64_t p_msgid, const Variant &p_result) {
 	msg_req[1] = p_msgid;
 	msg_req[2] = Variant();
 	msg_req[3] = p_result;
-	ERR_FAIL_COND_V_MSG(_put_message(msg_req) != OK, ERR_OUT_OF_MEMORY, "Message queue is full.");
+	PackedByteArray msg_buf = make_message_byte_array(msg_req);
+	ERR_FAIL_COND_V_MSG(msg_buf.is_empty(), ERR_INVALID_PARAMETER, "Message can't be encoded.");
+	_cache_response(p_msgid, msg_buf);
+	Error err = _put_encoded(msg_buf, _take_response_priority(p_msgid), true);
+	// ERR_BUSY is backpressure, wait for send_ready.
+	ERR_FAIL_COND_V_MSG(err != OK && err != ERR_BUSY, err, "Message can't be queued.");
 
-	return OK;
+	return err;
 }
 
 Error MessagePackRPC::response_error(uint64_t p_msgid, const Variant &p_error) {
@@ -529,9 +1880,16 @@ Error MessagePackRPC::response_error(uint64_t p_msgid, const Variant &p_error) {
 	msg_req[1] = p_msgid;
 	msg_req[2] = p_error;
 	msg_req[3] = Variant();
-	ERR_FAIL_COND_V_MSG(_put_message(msg_req) != OK, ERR_OUT_OF_MEMORY, "Message queue is full.");
+	{
+		// Errors aren't cached.
+		MutexLock lock(cache_mutex);
+		cache_pending.erase(p_msgid);
+	}
+	Error err = _put_message(msg_req, _take_response_priority(p_msgid), true);
+	// ERR_BUSY is backpressure, wait for send_ready.
+	ERR_FAIL_COND_V_MSG(err != OK && err != ERR_BUSY, err, "Message can't be queued.");
 
-	return OK;
+	return err;
 }
 
 Error MessagePackRPC::notifyv(const String &p_method, const Array &p_params) {
@@ -540,29 +1898,37 @@ Error MessagePackRPC::notifyv(const String &p_method, const Array &p_params) {
 	Array msg_req;
 	msg_req.resize(3);
 	msg_req[0] = NOTIFICATION;
-	msg_req[1] = p_method;
+	msg_req[1] = _wire_method(p_method);
 	msg_req[2] = p_params;
-	ERR_FAIL_COND_V_MSG(_put_message(msg_req) != OK, ERR_OUT_OF_MEMORY, "Message queue is full.");
+	Error err = _put_message(msg_req, _get_send_priority(p_method));
+	// ERR_BUSY is backpressure, wait for send_ready.
+	ERR_FAIL_COND_V_MSG(err != OK && err != ERR_BUSY, err, "Message can't be queued.");
 
-	return OK;
+	return err;
 }
 
-MessagePackRPC::MessagePackRPC(Ref<StreamPeerTCP> p_stream) {
-	// MessagePackRPC will takes 16 MiB just because it exists...
-	in_buf.resize(_MSG_BUF_MAX_SIZE);
-	out_buf.resize(_MSG_BUF_MAX_SIZE);
-	sync_result.resize(2);
-	tcp_stream = p_stream;
-	if (!tcp_stream.is_valid()) {
-		tcp_stream.instantiate();
+MessagePackRPC::MessagePackRPC(const Ref<MessagePackRPCTransport> &p_transport) :
+		out_buf(_MSG_BUF_MAX_SIZE),
+		in_buf(_MSG_BUF_MAX_SIZE) {
+	for (int i = 0; i < PRIORITY_MAX; i++) {
+		msg_queues[i] = memnew(MessagePackRPCQueue<PackedByteArray>(_MSG_QUEUE_MAX_SIZE));
 	}
+	call_wheel_start_msec = OS::get_singleton()->get_ticks_msec();
+	// Buffers take their storage from the pool on first use.
+	transport = p_transport;
 }
 
 MessagePackRPC::~MessagePackRPC() {
+	remove_performance_monitors();
 	close();
-	out_buf.clear();
-	in_buf.clear();
-	sync_result.clear();
+	if (server) {
+		server->_forget_peer(this);
+	}
+	out_buf.release();
+	in_buf.release();
+	for (int i = 0; i < PRIORITY_MAX; i++) {
+		memdelete(msg_queues[i]);
+	}
 }
 
 void MessagePackRPC::_bind_methods() {
@@ -572,22 +1938,25 @@ void MessagePackRPC::_bind_methods() {
 	ClassDB::bind_static_method("MessagePackRPC", D_METHOD("make_notification", "method", "params"), &MessagePackRPC::make_notification, DEFVAL(Array()));
 
 	ClassDB::bind_method(D_METHOD("connect_to_host", "ip", "port", "big_endian"), &MessagePackRPC::connect_to_host, DEFVAL(false));
+	ClassDB::bind_method(D_METHOD("connect_to_path", "path"), &MessagePackRPC::connect_to_path);
 	ClassDB::bind_method(D_METHOD("takeover_connection", "tcp_connection"), &MessagePackRPC::takeover_connection);
+	ClassDB::bind_method(D_METHOD("takeover_transport", "transport"), &MessagePackRPC::takeover_transport);
+	ClassDB::bind_method(D_METHOD("get_transport"), &MessagePackRPC::get_transport);
 	ClassDB::bind_method(D_METHOD("close"), &MessagePackRPC::close);
 
 #if MPACK_EXTENSIONS
 	ClassDB::bind_method(D_METHOD("register_extension_type", "type_id", "decoder"), &MessagePackRPC::register_extension_type);
 #endif
 
-	ClassDB::bind_method(D_METHOD("register_request", "method", "callable", "rewrite"), &MessagePackRPC::register_request, DEFVAL(false));
+	ClassDB::bind_method(D_METHOD("register_request", "method", "callable", "rewrite", "threaded", "cache_ttl_msec", "cache_max_entries"), &MessagePackRPC::register_request, DEFVAL(false), DEFVAL(false), DEFVAL(0), DEFVAL(_RPC_CACHE_MAX_ENTRIES));
 	ClassDB::bind_method(D_METHOD("unregister_request", "method"), &MessagePackRPC::unregister_request);
-	ClassDB::bind_method(D_METHOD("register_notification", "method", "callable", "rewrite"), &MessagePackRPC::register_notification, DEFVAL(false));
+	ClassDB::bind_method(D_METHOD("register_notification", "method", "callable", "rewrite", "threaded"), &MessagePackRPC::register_notification, DEFVAL(false), DEFVAL(false));
 	ClassDB::bind_method(D_METHOD("unregister_notification", "method"), &MessagePackRPC::unregister_notification);
 
-	ClassDB::bind_method(D_METHOD("_message_received", "message"), &MessagePackRPC::_message_received);
-	ClassDB::bind_method(D_METHOD("_request_received", "msgid", "method", "params"), &MessagePackRPC::_request_received);
-	ClassDB::bind_method(D_METHOD("_response_received", "msgid", "error", "result"), &MessagePackRPC::_response_received);
-	ClassDB::bind_method(D_METHOD("_notification_received", "method", "params"), &MessagePackRPC::_notification_received);
+	ClassDB::bind_method(D_METHOD("_got_error", "err", "err_msg"), &MessagePackRPC::_got_error);
+	ClassDB::bind_method(D_METHOD("_messages_received", "messages"), &MessagePackRPC::_messages_received);
+	ClassDB::bind_method(D_METHOD("_send_state_changed", "blocked"), &MessagePackRPC::_send_state_changed);
+	ClassDB::bind_method(D_METHOD("_calls_failed", "calls", "status"), &MessagePackRPC::_calls_failed);
 
 	{
 		MethodInfo mi;
@@ -616,14 +1985,65 @@ void MessagePackRPC::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("is_rpc_connected"), &MessagePackRPC::is_rpc_connected);
 	ClassDB::bind_method(D_METHOD("sync_callv", "method", "timeout_msec", "params"), &MessagePackRPC::sync_callv, DEFVAL(100), DEFVAL(Array()));
 	ClassDB::bind_method(D_METHOD("async_callv", "method", "params"), &MessagePackRPC::async_callv, DEFVAL(Array()));
+	ClassDB::bind_method(D_METHOD("async_callv_future", "method", "params", "timeout_msec"), &MessagePackRPC::async_callv_future, DEFVAL(Array()), DEFVAL(0));
+	ClassDB::bind_method(D_METHOD("call_batch", "calls", "timeout_msec"), &MessagePackRPC::call_batch, DEFVAL(0));
+	ClassDB::bind_method(D_METHOD("notify_batch", "notifications"), &MessagePackRPC::notify_batch);
 	ClassDB::bind_method(D_METHOD("response", "msgid", "result"), &MessagePackRPC::response);
 	ClassDB::bind_method(D_METHOD("response_error", "msgid", "error"), &MessagePackRPC::response_error);
 	ClassDB::bind_method(D_METHOD("notifyv", "method", "params"), &MessagePackRPC::notifyv, DEFVAL(Array()));
 
+	ClassDB::bind_method(D_METHOD("set_no_delay", "enabled"), &MessagePackRPC::set_no_delay);
+	ClassDB::bind_method(D_METHOD("is_no_delay"), &MessagePackRPC::is_no_delay);
+	ClassDB::bind_method(D_METHOD("set_coalescing_window_usec", "usec"), &MessagePackRPC::set_coalescing_window_usec);
+	ClassDB::bind_method(D_METHOD("get_coalescing_window_usec"), &MessagePackRPC::get_coalescing_window_usec);
+	ClassDB::bind_method(D_METHOD("get_queued_bytes"), &MessagePackRPC::get_queued_bytes);
+	ClassDB::bind_method(D_METHOD("get_queued_messages"), &MessagePackRPC::get_queued_messages);
+	ClassDB::bind_method(D_METHOD("is_send_blocked"), &MessagePackRPC::is_send_blocked);
+	ClassDB::bind_method(D_METHOD("get_metrics"), &MessagePackRPC::get_metrics);
+	ClassDB::bind_method(D_METHOD("reset_metrics"), &MessagePackRPC::reset_metrics);
+	ClassDB::bind_method(D_METHOD("add_performance_monitors", "prefix"), &MessagePackRPC::add_performance_monitors, DEFVAL("MessagePackRPC"));
+	ClassDB::bind_method(D_METHOD("remove_performance_monitors"), &MessagePackRPC::remove_performance_monitors);
+	ClassDB::bind_method(D_METHOD("_get_monitor", "name"), &MessagePackRPC::_get_monitor);
+	ClassDB::bind_method(D_METHOD("start_capture", "path"), &MessagePackRPC::start_capture);
+	ClassDB::bind_method(D_METHOD("stop_capture"), &MessagePackRPC::stop_capture);
+	ClassDB::bind_method(D_METHOD("is_capturing"), &MessagePackRPC::is_capturing);
+	ClassDB::bind_method(D_METHOD("set_send_queue_max_bytes", "bytes"), &MessagePackRPC::set_send_queue_max_bytes);
+	ClassDB::bind_method(D_METHOD("get_send_queue_max_bytes"), &MessagePackRPC::get_send_queue_max_bytes);
+	ClassDB::bind_method(D_METHOD("set_send_queue_max_messages", "count"), &MessagePackRPC::set_send_queue_max_messages);
+	ClassDB::bind_method(D_METHOD("get_send_queue_max_messages"), &MessagePackRPC::get_send_queue_max_messages);
+	ClassDB::bind_method(D_METHOD("set_send_queue_low_watermark", "ratio"), &MessagePackRPC::set_send_queue_low_watermark);
+	ClassDB::bind_method(D_METHOD("get_send_queue_low_watermark"), &MessagePackRPC::get_send_queue_low_watermark);
+	ClassDB::bind_method(D_METHOD("set_send_timeout_msec", "msec"), &MessagePackRPC::set_send_timeout_msec);
+	ClassDB::bind_method(D_METHOD("get_send_timeout_msec"), &MessagePackRPC::get_send_timeout_msec);
+	ClassDB::bind_method(D_METHOD("set_method_priority", "method", "priority"), &MessagePackRPC::set_method_priority);
+	ClassDB::bind_method(D_METHOD("get_method_priority", "method"), &MessagePackRPC::get_method_priority);
+	ClassDB::bind_method(D_METHOD("set_fragment_size", "size"), &MessagePackRPC::set_fragment_size);
+	ClassDB::bind_method(D_METHOD("get_fragment_size"), &MessagePackRPC::get_fragment_size);
+
+	ClassDB::bind_method(D_METHOD("request_method_ids"), &MessagePackRPC::request_method_ids);
+	ClassDB::bind_method(D_METHOD("get_remote_method_ids"), &MessagePackRPC::get_remote_method_ids);
+	ClassDB::bind_method(D_METHOD("set_negotiate_method_ids", "enabled"), &MessagePackRPC::set_negotiate_method_ids);
+	ClassDB::bind_method(D_METHOD("is_negotiate_method_ids"), &MessagePackRPC::is_negotiate_method_ids);
+	ClassDB::bind_method(D_METHOD("set_max_buffer_size", "size"), &MessagePackRPC::set_max_buffer_size);
+	ClassDB::bind_method(D_METHOD("get_max_buffer_size"), &MessagePackRPC::get_max_buffer_size);
+
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "no_delay"), "set_no_delay", "is_no_delay");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "coalescing_window_usec", PROPERTY_HINT_RANGE, "0,100000,1,suffix:us"), "set_coalescing_window_usec", "get_coalescing_window_usec");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "send_queue_max_bytes", PROPERTY_HINT_RANGE, "1,1073741824,1,or_greater,suffix:B"), "set_send_queue_max_bytes", "get_send_queue_max_bytes");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "send_queue_max_messages", PROPERTY_HINT_RANGE, "1,2048,1"), "set_send_queue_max_messages", "get_send_queue_max_messages");
+	ADD_PROPERTY(PropertyInfo(Variant::FLOAT, "send_queue_low_watermark", PROPERTY_HINT_RANGE, "0,0.99,0.01"), "set_send_queue_low_watermark", "get_send_queue_low_watermark");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "send_timeout_msec", PROPERTY_HINT_RANGE, "0,60000,1,suffix:ms"), "set_send_timeout_msec", "get_send_timeout_msec");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "negotiate_method_ids"), "set_negotiate_method_ids", "is_negotiate_method_ids");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "max_buffer_size", PROPERTY_HINT_RANGE, "4096,1073741824,1,suffix:B"), "set_max_buffer_size", "get_max_buffer_size");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "fragment_size", PROPERTY_HINT_RANGE, "0,1073741824,1,suffix:B"), "set_fragment_size", "get_fragment_size");
+
 	ADD_SIGNAL(MethodInfo("rpc_connected", PropertyInfo(Variant::STRING, "ip"), PropertyInfo(Variant::INT, "port")));
 	ADD_SIGNAL(MethodInfo("rpc_disconnected", PropertyInfo(Variant::STRING, "ip"), PropertyInfo(Variant::INT, "port")));
 	ADD_SIGNAL(MethodInfo("got_error", PropertyInfo(Variant::INT, "err"), PropertyInfo(Variant::STRING, "err_msg")));
 	ADD_SIGNAL(MethodInfo("message_received", PropertyInfo(Variant::ARRAY, "message")));
+	ADD_SIGNAL(MethodInfo("messages_received", PropertyInfo(Variant::ARRAY, "messages")));
+	ADD_SIGNAL(MethodInfo("send_blocked"));
+	ADD_SIGNAL(MethodInfo("send_ready"));
 	ADD_SIGNAL(MethodInfo("request_received", PropertyInfo(Variant::INT, "msgid"), PropertyInfo(Variant::STRING, "method"), PropertyInfo(Variant::ARRAY, "params")));
 	ADD_SIGNAL(MethodInfo("response_received", PropertyInfo(Variant::INT, "msgid"), PropertyInfo(Variant::OBJECT, "error"), PropertyInfo(Variant::ARRAY, "result")));
 	ADD_SIGNAL(MethodInfo("notification_received", PropertyInfo(Variant::STRING, "method"), PropertyInfo(Variant::ARRAY, "params")));
@@ -631,4 +2051,9 @@ void MessagePackRPC::_bind_methods() {
 	BIND_ENUM_CONSTANT(REQUEST);
 	BIND_ENUM_CONSTANT(RESPONSE);
 	BIND_ENUM_CONSTANT(NOTIFICATION);
+
+	BIND_ENUM_CONSTANT(PRIORITY_CONTROL);
+	BIND_ENUM_CONSTANT(PRIORITY_NORMAL);
+	BIND_ENUM_CONSTANT(PRIORITY_BULK);
+	BIND_ENUM_CONSTANT(PRIORITY_MAX);
 }
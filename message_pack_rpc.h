@@ -33,7 +33,9 @@
 
 #include "core/io/stream_peer_tcp.h"
 #include "core/object/ref_counted.h"
+#include "core/object/worker_thread_pool.h"
 #include "core/os/mutex.h"
+#include "core/os/semaphore.h"
 #include "core/os/thread.h"
 #include "core/string/ustring.h"
 #include "core/templates/vector.h"
@@ -42,48 +44,252 @@
 #include "core/variant/typed_array.h"
 
 #include "message_pack.h"
+#include "message_pack_rpc_buffer.h"
+#include "message_pack_rpc_cache.h"
+#include "message_pack_rpc_call.h"
+#include "message_pack_rpc_capture.h"
+#include "message_pack_rpc_metrics.h"
+#include "message_pack_rpc_queue.h"
+#include "message_pack_rpc_transport.h"
 
-// Max message buf size: 8MiB, should be way more than enough.
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+// Default limit of the I/O buffers and of a single outgoing message: 8MiB.
 #define _MSG_BUF_MAX_SIZE (1 << 23)
 // Max message queue size
 #define _MSG_QUEUE_MAX_SIZE 2048
+// Default bytes queued before sending blocks: 8MiB.
+#define _MSG_QUEUE_MAX_BYTES (1 << 23)
+// Sending resumes once the queue drained to this fraction of its limits.
+#define _MSG_QUEUE_LOW_WATERMARK 0.5
+// Bytes of a fragment header, the rest of the fragment is message data.
+#define _RPC_FRAGMENT_HEADER_MAX_SIZE 32
+// Reserved notification carrying a piece of a message sent in fragments
+#define _RPC_FRAGMENT_METHOD "rpc.fragment"
+// Max messages a peer may have partly sent in fragments, one per lane is needed.
+#define _RPC_FRAGMENT_MAX_PENDING 16
+// Longest the I/O threads sleep before checking whether the connection is closing.
+#define _IO_WAIT_TIMEOUT_MSEC 100
+// Reserved request answered with the id -> name table of the registered methods
+#define _RPC_METHOD_IDS_METHOD "rpc.method_ids"
+// Async call timeouts: wheel resolution, and slots in one turn of the wheel.
+#define _CALL_WHEEL_TICK_MSEC 10
+#define _CALL_WHEEL_SIZE 256
+
+class MessagePackRPCServer;
 
 class MessagePackRPC : public Object {
 	GDCLASS(MessagePackRPC, Object);
 
+	friend class MessagePackRPCServer;
+
+public:
+	struct Handler {
+		Callable callable;
+		// Thread-safe, runs on the WorkerThreadPool straight from the read thread.
+		bool threaded = false;
+	};
+
+	// Outgoing lanes, the writer always serves the highest non-empty one first.
+	enum Priority {
+		PRIORITY_CONTROL = 0,
+		PRIORITY_NORMAL,
+		PRIORITY_BULK,
+		PRIORITY_MAX,
+	};
+
+private:
 	MessagePack msg_pack;
 
-	Mutex mutex;
 	Thread thread;
-	bool running = false;
-	bool connected = false;
-	Ref<StreamPeerTCP> tcp_stream;
+	Thread write_thread;
+	// Posted when a message is queued, wakes the write thread.
+	Semaphore write_sem;
+	// Read and written by the I/O threads, handler tasks and the calling threads.
+	std::atomic<bool> running{ false };
+	std::atomic<bool> connected{ false };
+	Ref<MessagePackRPCTransport> transport;
+	// Cleared by _start_io(), set by the close() that shuts the transport and reports it.
+	std::atomic<bool> transport_closed{ true };
+
+	// Set when the connection is driven by a server's I/O loop instead of its own threads.
+	MessagePackRPCServer *server = nullptr;
+	int server_loop = 0;
+
+	// Encoded messages by lane, written by any thread, read by the write thread only.
+	MessagePackRPCQueue<PackedByteArray> *msg_queues[PRIORITY_MAX];
+	// Taken from its lane, but not entirely copied to out_buf yet.
+	struct OutPending {
+		PackedByteArray msg;
+		uint32_t offset = 0;
+		uint64_t fragment_id = 0;
+	};
+	OutPending out_pending[PRIORITY_MAX];
+	// Written in part to a direct transport, finished before anything else.
+	OutPending *out_partial = nullptr;
+	// The transport is plain memory, messages skip out_buf and in_buf.
+	bool direct_io = false;
+	uint64_t next_fragment_id = 0;
+	int fragment_size = 0;
+
+	// Lanes of outgoing methods, and of the responses owed to incoming requests for them.
+	Mutex priorities_mutex;
+	HashMap<String, Priority> method_priorities;
+	HashMap<uint64_t, Priority> response_priorities;
+
+	// Read thread only, messages being reassembled from fragments, by fragment id.
+	// All of them together are held to max_buffer_size.
+	HashMap<uint64_t, PackedByteArray> in_fragments;
+	uint64_t in_fragments_bytes = 0;
+	// Owned by the write thread.
+	MessagePackRPCBuffer out_buf;
+	// Owned by the read thread, drained by the stream parser.
+	MessagePackRPCBuffer in_buf;
+	uint32_t max_buffer_size = _MSG_BUF_MAX_SIZE;
+
+	// Backpressure, counts messages queued but not copied to out_buf yet.
+	std::atomic<int64_t> queued_bytes{ 0 };
+	std::atomic<int> queued_messages{ 0 };
+	std::atomic<bool> send_blocked{ false };
+	int64_t send_queue_max_bytes = _MSG_QUEUE_MAX_BYTES;
+	int send_queue_max_messages = _MSG_QUEUE_MAX_SIZE;
+	double send_queue_low_watermark = _MSG_QUEUE_LOW_WATERMARK;
+	int send_timeout_msec = 0;
+	// Blocking puts wait here for send_ready.
+	std::mutex send_mutex;
+	std::condition_variable send_cond;
 
-	List<Array> msg_queue;
-	PackedByteArray out_buf;
-	int out_tail = 0;
-	int out_head = 0;
-	PackedByteArray in_buf;
-	int in_tail = 0;
-	int in_head = 0;
+	// Written on the main thread, looked up by the read thread under handlers_mutex.
+	Mutex handlers_mutex;
+	HashMap<StringName, Handler> request_map;
+	HashMap<StringName, Handler> notify_map;
+	// Method ids peers may send instead of names, append only.
+	LocalVector<StringName> method_names;
+	HashMap<StringName, int> method_ids;
 
-	HashMap<String, Callable> request_map;
-	HashMap<String, Callable> notify_map;
+	// Responses of the methods registered with a cache_ttl_msec, peers of a
+	// server use the server's.
+	MessagePackRPCCache response_cache;
+	// Requests that missed the cache, stored with their response once it's sent.
+	struct CachePending {
+		PackedByteArray request;
+		uint32_t method_size = 0;
+	};
+	Mutex cache_mutex;
+	HashMap<uint64_t, CachePending> cache_pending;
+
+	// Ids the remote peer accepts instead of method names, learnt by request_method_ids.
+	Mutex remote_methods_mutex;
+	HashMap<String, int> remote_method_ids;
+	uint64_t remote_method_ids_msgid = 0;
+	bool remote_method_ids_requested = false;
+	bool negotiate_method_ids = false;
+
+	// Threaded handlers still running, or finished but not waited for yet.
+	struct HandlerTask {
+		MessagePackRPC *rpc = nullptr;
+		Callable callable;
+		Array args;
+		bool request = false;
+		uint64_t msgid = 0;
+		StringName method;
+	};
+	Mutex tasks_mutex;
+	LocalVector<WorkerThreadPool::TaskID> handler_tasks;
+
+	std::atomic<uint64_t> msgid{ 0 };
+
+	bool no_delay = true;
+	int coalescing_window_usec = 0;
+
+	MessagePackRPCMetrics metrics;
+	MessagePackRPCCapture capture;
+	// Category of the Performance monitors added, empty if none.
+	String monitor_prefix;
 
-	uint64_t msgid = 0;
+	// Messages parsed in one poll, handed to the main thread together.
+	Array in_batch;
 
-	bool sync_started = false;
-	bool sync_responded;
-	int sync_msgid;
-	Array sync_result;
+	// A blocking call, lives on the stack of the thread waiting for it.
+	struct SyncCall {
+		std::condition_variable cond;
+		bool responded = false;
+		bool cancelled = false;
+		Variant error;
+		Variant result;
+	};
+	// Blocking calls waiting for their response, keyed by msgid.
+	std::mutex sync_mutex;
+	HashMap<uint64_t, SyncCall *> sync_calls;
+
+	// Async calls waiting for their response, keyed by msgid.
+	Mutex async_mutex;
+	HashMap<uint64_t, Ref<MessagePackRPCCall>> async_calls;
+	// Expiry of async calls, a hashed timer wheel ticked by the read thread.
+	// Completed calls are left in their slot and skipped when it comes around.
+	struct CallTimer {
+		uint64_t msgid;
+		// More than one for a batch, which expires as a whole.
+		uint32_t count;
+		uint32_t rounds;
+	};
+	LocalVector<CallTimer> call_wheel[_CALL_WHEEL_SIZE];
+	uint64_t call_wheel_tick = 0;
+	uint64_t call_wheel_start_msec = 0;
+	// When the read thread's current wait ends, an earlier timeout interrupts it.
+	uint64_t io_wake_msec = 0;
 
 	void _error_handle(Error p_err, const String p_err_msg);
 	Error _message_handle(const Variant &p_message);
-	void _write_out();
-	void _read_in();
-	Error _try_connect(const IPAddress &p_ip, int p_port);
+	bool _sync_respond(uint64_t p_msgid, const Variant &p_error, const Variant &p_result);
+	void _cancel_sync_calls();
+	uint64_t _get_call_wheel_tick() const;
+	void _schedule_call_timeout(uint64_t p_msgid, uint64_t p_timeout_msec, uint32_t p_count = 1);
+	bool _get_batch_item(const Variant &p_item, String &r_method, Array &r_params);
+	Error _put_batch(const Array &p_msgs, Priority p_priority);
+	void _tick_call_wheel();
+	int _get_call_wheel_wait_msec(int p_max_msec = _IO_WAIT_TIMEOUT_MSEC);
+	Ref<MessagePackRPCCall> _take_async_call(uint64_t p_msgid);
+	Array _take_async_calls();
+	OutPending *_next_out_pending();
+	void _fill_out_buf();
+	int _write_direct();
+	bool _fill_fragment(OutPending &p_pending);
+	Error _fragment_received(const Variant &p_params);
+	Error _fragment_failed(Error p_err, const String &p_err_msg);
+	static bool _is_fragment(const Variant &p_message);
+	Priority _get_send_priority(const String &p_method);
+	Priority _take_response_priority(uint64_t p_msgid);
+	bool _is_above_high_watermark() const;
+	bool _is_below_low_watermark() const;
+	void _block_send();
+	void _try_unblock_send();
+	void _dequeued(uint32_t p_size);
+	void _drop_queued();
+	int _write_out();
+	int _read_in();
+	int _poll();
+	void _connection_lost();
+	bool _dispatch_threaded(const Array &p_msg);
+	void _intern_method(const StringName &p_method);
+	bool _resolve_method(Array &p_msg, int p_idx);
+	MessagePackRPCCache *_get_response_cache();
+	bool _try_cached_response();
+	void _cache_response(uint64_t p_msgid, const PackedByteArray &p_msg_buf);
+	void _respond_method_ids(uint64_t p_msgid);
+	bool _remote_method_ids_received(uint64_t p_msgid, const Variant &p_result);
+	Variant _wire_method(const String &p_method);
+	void _reap_handler_tasks(bool p_wait_all = false);
+	static void _handler_task(void *p_user_data);
+	bool _io_step();
+	// Data the transport couldn't take yet, the I/O loop then polls for writability.
+	bool _has_pending_output() const { return !out_buf.is_empty() || out_partial != nullptr; }
+	void _start_io();
 	void _start_stream(int p_msgs_max = _MSG_MAX_SIZE);
 	Error _try_parse_stream();
+	void _call_handler(const Callable &p_callable, const StringName &p_method, const Array &p_args);
 
 	Array _sync_call(const Variant **p_args, int p_argcount, Callable::CallError &r_error);
 	Error _async_call(const Variant **p_args, int p_argcount, Callable::CallError &r_error);
@@ -107,42 +313,90 @@ public:
 	static PackedByteArray make_notification(const String &p_method, const Array &p_params = Array());
 
 	static void _thread_func(void *p_user_data);
+	static void _write_thread_func(void *p_user_data);
 	Error connect_to_host(const IPAddress &p_ip, int p_port, bool p_big_endian = false);
+	Error connect_to_path(const String &p_path);
 	Error takeover_connection(Ref<StreamPeerTCP> p_peer);
+	Error takeover_transport(const Ref<MessagePackRPCTransport> &p_transport);
+	Ref<MessagePackRPCTransport> get_transport() const;
 
 #if MPACK_EXTENSIONS
 	void register_extension_type(int8_t p_ext_type, const Callable &p_decoder);
 #endif
 
-	Error register_request(const String &p_method, const Callable &p_callable, bool p_rewrite = false);
+	Error register_request(const String &p_method, const Callable &p_callable, bool p_rewrite = false, bool p_threaded = false, int p_cache_ttl_msec = 0, int p_cache_max_entries = _RPC_CACHE_MAX_ENTRIES);
 	Error unregister_request(const String &p_method);
-	Error register_notification(const String &p_method, const Callable &p_callable, bool p_rewrite = false);
+	Error register_notification(const String &p_method, const Callable &p_callable, bool p_rewrite = false, bool p_threaded = false);
 	Error unregister_notification(const String &p_method);
 
 	void poll();
 	void close();
 
 	void _got_error(Error p_err, const String &p_err_msg);
-	void _message_received(const Variant &p_message);
-	void _request_received(int p_msgid, const String &p_method, const Array &p_params);
-	void _response_received(int p_msgid, const Variant &p_error, const Variant &p_result);
-	void _notification_received(const String &p_method, const Array &p_params);
+	void _messages_received(const Array &p_messages);
+	void _calls_failed(const Array &p_calls, int p_status);
+	void _send_state_changed(bool p_blocked);
+	Variant _get_monitor(const String &p_name);
 
-	inline uint64_t get_next_msgid() const { return msgid; }
-	inline void set_next_msgid(int p_msgid) { msgid = p_msgid; }
+	inline uint64_t get_next_msgid() const { return msgid.load(); }
+	inline void set_next_msgid(int p_msgid) { msgid.store(p_msgid); }
 	bool is_rpc_connected();
-	Error _put_message(const Array &p_msg);
+	// Responses and PRIORITY_CONTROL messages are queued past the high watermark,
+	// so the peer isn't left waiting on us. They still count towards it.
+	Error _put_message(const Array &p_msg, Priority p_priority = PRIORITY_NORMAL, bool p_response = false);
+	Error _put_encoded(const PackedByteArray &p_msg_buf, Priority p_priority = PRIORITY_NORMAL, bool p_response = false);
+	Error _wait_to_queue(const PackedByteArray &p_msg_buf, Priority p_priority);
+
+	void set_method_priority(const String &p_method, Priority p_priority);
+	Priority get_method_priority(const String &p_method);
+	void set_fragment_size(int p_size);
+	int get_fragment_size() const;
+
+	void set_no_delay(bool p_enabled);
+	bool is_no_delay() const;
+	void set_coalescing_window_usec(int p_usec);
+	int get_coalescing_window_usec() const;
+	int64_t get_queued_bytes() const;
+	int get_queued_messages() const;
+	bool is_send_blocked() const;
+	void set_send_queue_max_bytes(int64_t p_bytes);
+	int64_t get_send_queue_max_bytes() const;
+	void set_send_queue_max_messages(int p_count);
+	int get_send_queue_max_messages() const;
+	void set_send_queue_low_watermark(double p_ratio);
+	double get_send_queue_low_watermark() const;
+	void set_send_timeout_msec(int p_msec);
+	int get_send_timeout_msec() const;
+
+	Dictionary get_metrics();
+	void reset_metrics();
+	Error add_performance_monitors(const String &p_prefix);
+	void remove_performance_monitors();
+	Error start_capture(const String &p_path);
+	void stop_capture();
+	bool is_capturing() const;
+
+	Error request_method_ids();
+	Dictionary get_remote_method_ids();
+	void set_negotiate_method_ids(bool p_enabled);
+	bool is_negotiate_method_ids() const;
+	void set_max_buffer_size(int p_size);
+	int get_max_buffer_size() const;
 
 	Array sync_callv(const String &p_method, uint64_t p_timeout_msec = 100, const Array &p_params = Array());
 	Error async_callv(const String &p_method, const Array &p_params = Array());
+	Ref<MessagePackRPCCall> async_callv_future(const String &p_method, const Array &p_params = Array(), uint64_t p_timeout_msec = 0);
+	Ref<MessagePackRPCCall> call_batch(const Array &p_calls, uint64_t p_timeout_msec = 0);
+	Error notify_batch(const Array &p_notifications);
 	Error response(uint64_t p_msgid, const Variant &p_result);
 	Error response_error(uint64_t p_msgid, const Variant &p_error);
 	Error notifyv(const String &p_method, const Array &p_params = Array());
 
-	MessagePackRPC(Ref<StreamPeerTCP> p_stream = Ref<StreamPeerTCP>());
+	MessagePackRPC(const Ref<MessagePackRPCTransport> &p_transport = Ref<MessagePackRPCTransport>());
 	~MessagePackRPC();
 };
 
 VARIANT_ENUM_CAST(MessagePackRPC::MessageType);
+VARIANT_ENUM_CAST(MessagePackRPC::Priority);
 
 #endif // MESSAGE_PACK_RPC_H
@@ -0,0 +1,410 @@
+/*************************************************************************/
+/*  message_pack_rpc_benchmark.cpp                                       */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "message_pack_rpc_benchmark.h"
+#include "core/math/random_pcg.h"
+#include "core/object/message_queue.h"
+#include "core/os/os.h"
+
+#include "message_pack_rpc_server.h"
+#include "message_pack_rpc_transport.h"
+
+#include <ctime>
+
+void MessagePackRPCBenchmark::_client_func(void *p_user_data) {
+	Client *client = (Client *)p_user_data;
+	MessagePackRPCBenchmark *bench = client->bench;
+	MessagePackRPC *rpc = client->rpc;
+	RandomPCG rng(client->index + 1);
+	double total_weight = bench->sync_weight + bench->async_weight + bench->notify_weight;
+
+	while (OS::get_singleton()->get_ticks_usec() < bench->deadline_usec) {
+		double pick = rng.randf() * total_weight;
+		const PackedByteArray &payload = bench->payloads[rng.rand() % bench->payloads.size()];
+		Array params;
+		params.push_back(payload);
+
+		if (pick < bench->sync_weight) {
+			uint64_t start_usec = OS::get_singleton()->get_ticks_usec();
+			Array result = rpc->sync_callv(_BENCH_REQUEST_METHOD, bench->call_timeout_msec, params);
+			if (result.is_empty()) {
+				bench->errors++;
+				continue;
+			}
+			uint64_t elapsed = OS::get_singleton()->get_ticks_usec() - start_usec;
+			bench->sync_latency.record(elapsed);
+			bench->latency.record(elapsed);
+			bench->sync_calls++;
+		} else if (pick < bench->sync_weight + bench->async_weight) {
+			if (client->in_flight.load() >= bench->max_in_flight) {
+				// Wait for responses instead of growing the queue without bound.
+				OS::get_singleton()->delay_usec(50);
+				continue;
+			}
+			// The only sender on this connection, so this is the msgid async_callv uses.
+			uint64_t msgid = rpc->get_next_msgid();
+			{
+				MutexLock lock(client->mutex);
+				client->sent_usec[msgid] = OS::get_singleton()->get_ticks_usec();
+			}
+			client->in_flight++;
+			if (rpc->async_callv(_BENCH_REQUEST_METHOD, params) != OK) {
+				MutexLock lock(client->mutex);
+				client->sent_usec.erase(msgid);
+				client->in_flight--;
+				bench->errors++;
+				continue;
+			}
+		} else {
+			if (rpc->notifyv(_BENCH_NOTIFY_METHOD, params) != OK) {
+				bench->errors++;
+				continue;
+			}
+			bench->notifications++;
+		}
+		bench->payload_bytes += payload.size();
+	}
+	bench->workers_left--;
+}
+
+void MessagePackRPCBenchmark::_async_response(const Variant &p_msgid, const Variant &p_error, const Variant &p_result, int p_client) {
+	ERR_FAIL_INDEX(p_client, int(clients.size()));
+	Client *client = clients[p_client];
+	uint64_t msgid = p_msgid;
+	uint64_t start_usec = 0;
+	{
+		MutexLock lock(client->mutex);
+		uint64_t *sent = client->sent_usec.getptr(msgid);
+		if (!sent) {
+			return;
+		}
+		start_usec = *sent;
+		client->sent_usec.erase(msgid);
+	}
+	client->in_flight--;
+	if (p_error.get_type() != Variant::NIL) {
+		errors++;
+		return;
+	}
+	uint64_t elapsed = OS::get_singleton()->get_ticks_usec() - start_usec;
+	async_latency.record(elapsed);
+	latency.record(elapsed);
+	async_calls++;
+}
+
+Variant MessagePackRPCBenchmark::_echo(Object *p_peer, int64_t p_msgid, const String &p_method, const Array &p_params) {
+	return p_params.is_empty() ? Variant() : p_params[0];
+}
+
+void MessagePackRPCBenchmark::_notified(Object *p_peer, const String &p_method, const Array &p_params) {
+	notifications_received++;
+}
+
+void MessagePackRPCBenchmark::_reset_counters() {
+	sync_calls = 0;
+	async_calls = 0;
+	notifications = 0;
+	notifications_received = 0;
+	errors = 0;
+	payload_bytes = 0;
+	sync_latency.reset();
+	async_latency.reset();
+	latency.reset();
+}
+
+void MessagePackRPCBenchmark::_flush_until(uint64_t p_deadline_usec, bool p_drain) {
+	// Responses and connection signals are deferred calls, nothing else runs them
+	// while the main thread is in here.
+	while (OS::get_singleton()->get_ticks_usec() < p_deadline_usec) {
+		MessageQueue::get_singleton()->flush();
+		if (p_drain) {
+			bool drained = workers_left.load() == 0;
+			for (Client *client : clients) {
+				drained = drained && client->in_flight.load() == 0;
+			}
+			if (drained) {
+				return;
+			}
+		}
+		OS::get_singleton()->delay_usec(200);
+	}
+}
+
+Dictionary MessagePackRPCBenchmark::_get_config() const {
+	Dictionary config;
+	config["clients"] = client_count;
+	config["duration_msec"] = duration_msec;
+	config["transport"] = port > 0 ? "tcp" : "loopback";
+	Dictionary mix;
+	mix["sync"] = sync_weight;
+	mix["async"] = async_weight;
+	mix["notify"] = notify_weight;
+	config["mix"] = mix;
+	Array sizes;
+	for (int i = 0; i < payload_sizes.size(); i++) {
+		sizes.push_back(payload_sizes[i]);
+	}
+	config["payload_sizes"] = sizes;
+	config["max_in_flight"] = max_in_flight;
+	return config;
+}
+
+Dictionary MessagePackRPCBenchmark::run() {
+	ERR_FAIL_COND_V_MSG(!clients.is_empty(), Dictionary(), "A benchmark is running.");
+	ERR_FAIL_COND_V_MSG(sync_weight + async_weight + notify_weight <= 0, Dictionary(), "The call mix is empty.");
+	ERR_FAIL_COND_V_MSG(payload_sizes.is_empty(), Dictionary(), "No payload size.");
+	_reset_counters();
+	payloads.clear();
+	for (int i = 0; i < payload_sizes.size(); i++) {
+		PackedByteArray payload;
+		payload.resize(payload_sizes[i]);
+		uint8_t *w = payload.ptrw();
+		for (int j = 0; j < payload.size(); j++) {
+			w[j] = j & 0xff;
+		}
+		payloads.push_back(payload);
+	}
+
+	uint64_t memory_before = OS::get_singleton()->get_static_memory_usage();
+	MessagePackRPCServer *server = memnew(MessagePackRPCServer);
+	server->register_request(_BENCH_REQUEST_METHOD, Callable(this, SNAME("_echo")), false, true);
+	server->register_notification(_BENCH_NOTIFY_METHOD, Callable(this, SNAME("_notified")), false, true);
+	if (port > 0 && server->listen(port, IPAddress("127.0.0.1")) != OK) {
+		memdelete(server);
+		ERR_FAIL_V_MSG(Dictionary(), "Can't listen on port " + itos(port) + ".");
+	}
+
+	bool connected = true;
+	for (int i = 0; i < client_count && connected; i++) {
+		Client *client = memnew(Client);
+		client->bench = this;
+		client->index = i;
+		client->rpc = memnew(MessagePackRPC);
+		client->rpc->connect(SNAME("response_received"), Callable(this, SNAME("_async_response")).bind(i));
+		clients.push_back(client);
+		if (port > 0) {
+			connected = client->rpc->connect_to_host(IPAddress("127.0.0.1"), port) == OK;
+		} else {
+			Array pair = MessagePackRPCTransportLoopback::create_pair();
+			connected = server->takeover_transport(pair[0]) == OK && client->rpc->takeover_transport(pair[1]) == OK;
+		}
+	}
+	// Every peer accepted by the server before the clock starts.
+	uint64_t settle_usec = OS::get_singleton()->get_ticks_usec() + 2000000;
+	while (connected && server->get_peer_count() < client_count && OS::get_singleton()->get_ticks_usec() < settle_usec) {
+		_flush_until(OS::get_singleton()->get_ticks_usec() + 1000, false);
+	}
+	uint64_t memory_connected = OS::get_singleton()->get_static_memory_usage();
+
+	Dictionary report;
+	if (connected) {
+		std::clock_t cpu_start = std::clock();
+		uint64_t start_usec = OS::get_singleton()->get_ticks_usec();
+		deadline_usec = start_usec + uint64_t(duration_msec) * 1000;
+		workers_left = clients.size();
+		for (Client *client : clients) {
+			client->thread.start(_client_func, client);
+		}
+		_flush_until(deadline_usec, false);
+		for (Client *client : clients) {
+			client->thread.wait_to_finish();
+		}
+		uint64_t memory_loaded = OS::get_singleton()->get_static_memory_usage();
+		_flush_until(OS::get_singleton()->get_ticks_usec() + _BENCH_DRAIN_TIMEOUT_MSEC * 1000, true);
+		uint64_t duration_usec = MAX(uint64_t(1), OS::get_singleton()->get_ticks_usec() - start_usec);
+		double cpu_usec = double(std::clock() - cpu_start) * 1000000.0 / CLOCKS_PER_SEC;
+
+		uint64_t unanswered = 0;
+		for (Client *client : clients) {
+			unanswered += client->in_flight.load();
+		}
+		uint64_t requests = sync_calls + async_calls;
+		// A request and its response, or a notification.
+		uint64_t messages = requests * 2 + notifications;
+		double seconds = duration_usec / 1000000.0;
+
+		report["config"] = _get_config();
+		report["duration_usec"] = duration_usec;
+		report["sync_calls"] = sync_calls.load();
+		report["async_calls"] = async_calls.load();
+		report["notifications"] = notifications.load();
+		report["notifications_received"] = notifications_received.load();
+		report["errors"] = errors.load() + unanswered;
+		report["requests_per_sec"] = requests / seconds;
+		report["messages_per_sec"] = messages / seconds;
+		report["payload_bytes_per_sec"] = payload_bytes / seconds;
+		report["latency_usec"] = latency.to_dictionary();
+		report["sync_latency_usec"] = sync_latency.to_dictionary();
+		report["async_latency_usec"] = async_latency.to_dictionary();
+		report["cpu_usec_per_message"] = messages > 0 ? cpu_usec / messages : 0.0;
+		// Both ends of a connection, before and while traffic flows.
+		report["memory_per_connection_idle"] = (int64_t(memory_connected) - int64_t(memory_before)) / client_count;
+		report["memory_per_connection_loaded"] = (int64_t(memory_loaded) - int64_t(memory_before)) / client_count;
+	} else {
+		ERR_PRINT("Not every client could connect.");
+	}
+
+	for (Client *client : clients) {
+		client->rpc->close();
+		memdelete(client->rpc);
+		memdelete(client);
+	}
+	clients.clear();
+	server->stop();
+	memdelete(server);
+	return report;
+}
+
+void MessagePackRPCBenchmark::set_client_count(int p_count) {
+	ERR_FAIL_COND(p_count < 1 || p_count > _BENCH_MAX_CLIENTS);
+	client_count = p_count;
+}
+
+int MessagePackRPCBenchmark::get_client_count() const {
+	return client_count;
+}
+
+void MessagePackRPCBenchmark::set_duration_msec(int p_msec) {
+	ERR_FAIL_COND(p_msec < 1);
+	duration_msec = p_msec;
+}
+
+int MessagePackRPCBenchmark::get_duration_msec() const {
+	return duration_msec;
+}
+
+void MessagePackRPCBenchmark::set_port(int p_port) {
+	ERR_FAIL_COND(p_port < 0 || p_port > 65535);
+	port = p_port;
+}
+
+int MessagePackRPCBenchmark::get_port() const {
+	return port;
+}
+
+void MessagePackRPCBenchmark::set_sync_weight(double p_weight) {
+	ERR_FAIL_COND(p_weight < 0);
+	sync_weight = p_weight;
+}
+
+double MessagePackRPCBenchmark::get_sync_weight() const {
+	return sync_weight;
+}
+
+void MessagePackRPCBenchmark::set_async_weight(double p_weight) {
+	ERR_FAIL_COND(p_weight < 0);
+	async_weight = p_weight;
+}
+
+double MessagePackRPCBenchmark::get_async_weight() const {
+	return async_weight;
+}
+
+void MessagePackRPCBenchmark::set_notify_weight(double p_weight) {
+	ERR_FAIL_COND(p_weight < 0);
+	notify_weight = p_weight;
+}
+
+double MessagePackRPCBenchmark::get_notify_weight() const {
+	return notify_weight;
+}
+
+void MessagePackRPCBenchmark::set_payload_sizes(const PackedInt32Array &p_sizes) {
+	for (int i = 0; i < p_sizes.size(); i++) {
+		ERR_FAIL_COND_MSG(p_sizes[i] < 0 || p_sizes[i] > _MSG_BUF_MAX_SIZE / 2, "Payload size out of range.");
+	}
+	payload_sizes = p_sizes;
+}
+
+PackedInt32Array MessagePackRPCBenchmark::get_payload_sizes() const {
+	return payload_sizes;
+}
+
+void MessagePackRPCBenchmark::set_max_in_flight(int p_count) {
+	ERR_FAIL_COND(p_count < 1);
+	max_in_flight = p_count;
+}
+
+int MessagePackRPCBenchmark::get_max_in_flight() const {
+	return max_in_flight;
+}
+
+void MessagePackRPCBenchmark::set_call_timeout_msec(int p_msec) {
+	ERR_FAIL_COND(p_msec < 1);
+	call_timeout_msec = p_msec;
+}
+
+int MessagePackRPCBenchmark::get_call_timeout_msec() const {
+	return call_timeout_msec;
+}
+
+void MessagePackRPCBenchmark::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("run"), &MessagePackRPCBenchmark::run);
+
+	ClassDB::bind_method(D_METHOD("set_client_count", "count"), &MessagePackRPCBenchmark::set_client_count);
+	ClassDB::bind_method(D_METHOD("get_client_count"), &MessagePackRPCBenchmark::get_client_count);
+	ClassDB::bind_method(D_METHOD("set_duration_msec", "msec"), &MessagePackRPCBenchmark::set_duration_msec);
+	ClassDB::bind_method(D_METHOD("get_duration_msec"), &MessagePackRPCBenchmark::get_duration_msec);
+	ClassDB::bind_method(D_METHOD("set_port", "port"), &MessagePackRPCBenchmark::set_port);
+	ClassDB::bind_method(D_METHOD("get_port"), &MessagePackRPCBenchmark::get_port);
+	ClassDB::bind_method(D_METHOD("set_sync_weight", "weight"), &MessagePackRPCBenchmark::set_sync_weight);
+	ClassDB::bind_method(D_METHOD("get_sync_weight"), &MessagePackRPCBenchmark::get_sync_weight);
+	ClassDB::bind_method(D_METHOD("set_async_weight", "weight"), &MessagePackRPCBenchmark::set_async_weight);
+	ClassDB::bind_method(D_METHOD("get_async_weight"), &MessagePackRPCBenchmark::get_async_weight);
+	ClassDB::bind_method(D_METHOD("set_notify_weight", "weight"), &MessagePackRPCBenchmark::set_notify_weight);
+	ClassDB::bind_method(D_METHOD("get_notify_weight"), &MessagePackRPCBenchmark::get_notify_weight);
+	ClassDB::bind_method(D_METHOD("set_payload_sizes", "sizes"), &MessagePackRPCBenchmark::set_payload_sizes);
+	ClassDB::bind_method(D_METHOD("get_payload_sizes"), &MessagePackRPCBenchmark::get_payload_sizes);
+	ClassDB::bind_method(D_METHOD("set_max_in_flight", "count"), &MessagePackRPCBenchmark::set_max_in_flight);
+	ClassDB::bind_method(D_METHOD("get_max_in_flight"), &MessagePackRPCBenchmark::get_max_in_flight);
+	ClassDB::bind_method(D_METHOD("set_call_timeout_msec", "msec"), &MessagePackRPCBenchmark::set_call_timeout_msec);
+	ClassDB::bind_method(D_METHOD("get_call_timeout_msec"), &MessagePackRPCBenchmark::get_call_timeout_msec);
+
+	ClassDB::bind_method(D_METHOD("_echo", "peer", "msgid", "method", "params"), &MessagePackRPCBenchmark::_echo);
+	ClassDB::bind_method(D_METHOD("_notified", "peer", "method", "params"), &MessagePackRPCBenchmark::_notified);
+	ClassDB::bind_method(D_METHOD("_async_response", "msgid", "error", "result", "client"), &MessagePackRPCBenchmark::_async_response);
+
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "client_count", PROPERTY_HINT_RANGE, "1,256,1"), "set_client_count", "get_client_count");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "duration_msec", PROPERTY_HINT_RANGE, "1,600000,1,or_greater,suffix:ms"), "set_duration_msec", "get_duration_msec");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "port", PROPERTY_HINT_RANGE, "0,65535,1"), "set_port", "get_port");
+	ADD_PROPERTY(PropertyInfo(Variant::FLOAT, "sync_weight", PROPERTY_HINT_RANGE, "0,10,0.01,or_greater"), "set_sync_weight", "get_sync_weight");
+	ADD_PROPERTY(PropertyInfo(Variant::FLOAT, "async_weight", PROPERTY_HINT_RANGE, "0,10,0.01,or_greater"), "set_async_weight", "get_async_weight");
+	ADD_PROPERTY(PropertyInfo(Variant::FLOAT, "notify_weight", PROPERTY_HINT_RANGE, "0,10,0.01,or_greater"), "set_notify_weight", "get_notify_weight");
+	ADD_PROPERTY(PropertyInfo(Variant::PACKED_INT32_ARRAY, "payload_sizes"), "set_payload_sizes", "get_payload_sizes");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "max_in_flight", PROPERTY_HINT_RANGE, "1,4096,1,or_greater"), "set_max_in_flight", "get_max_in_flight");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "call_timeout_msec", PROPERTY_HINT_RANGE, "1,60000,1,or_greater,suffix:ms"), "set_call_timeout_msec", "get_call_timeout_msec");
+}
+
+MessagePackRPCBenchmark::MessagePackRPCBenchmark() {
+	payload_sizes.push_back(16);
+	payload_sizes.push_back(256);
+	payload_sizes.push_back(4096);
+	payload_sizes.push_back(65536);
+}
@@ -0,0 +1,131 @@
+/*************************************************************************/
+/*  message_pack_rpc_benchmark.h                                         */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef MESSAGE_PACK_RPC_BENCHMARK_H
+#define MESSAGE_PACK_RPC_BENCHMARK_H
+
+#include "core/object/ref_counted.h"
+#include "core/os/mutex.h"
+#include "core/os/thread.h"
+#include "core/templates/hash_map.h"
+#include "core/templates/local_vector.h"
+#include "core/variant/dictionary.h"
+
+#include "message_pack_rpc.h"
+#include "message_pack_rpc_metrics.h"
+
+#include <atomic>
+
+#define _BENCH_REQUEST_METHOD "bench.echo"
+#define _BENCH_NOTIFY_METHOD "bench.notify"
+#define _BENCH_MAX_CLIENTS 256
+// Async requests still answered once the run is over, before they count as errors.
+#define _BENCH_DRAIN_TIMEOUT_MSEC 2000
+
+// Load generator: a server and client_count clients on loopback, driving a
+// mix of sync calls, async calls and notifications with various payloads.
+class MessagePackRPCBenchmark : public RefCounted {
+	GDCLASS(MessagePackRPCBenchmark, RefCounted);
+
+	// One client connection and the thread loading it.
+	struct Client {
+		MessagePackRPCBenchmark *bench = nullptr;
+		MessagePackRPC *rpc = nullptr;
+		Thread thread;
+		uint32_t index = 0;
+		std::atomic<int> in_flight{ 0 };
+		// Async msgid -> when it was sent, answered on the main thread.
+		Mutex mutex;
+		HashMap<uint64_t, uint64_t> sent_usec;
+	};
+
+	int client_count = 4;
+	int duration_msec = 5000;
+	int port = 0;
+	double sync_weight = 1.0;
+	double async_weight = 1.0;
+	double notify_weight = 0.5;
+	PackedInt32Array payload_sizes;
+	int max_in_flight = 64;
+	int call_timeout_msec = 1000;
+
+	LocalVector<Client *> clients;
+	LocalVector<PackedByteArray> payloads;
+	uint64_t deadline_usec = 0;
+	std::atomic<int> workers_left{ 0 };
+
+	std::atomic<uint64_t> sync_calls{ 0 };
+	std::atomic<uint64_t> async_calls{ 0 };
+	std::atomic<uint64_t> notifications{ 0 };
+	std::atomic<uint64_t> notifications_received{ 0 };
+	std::atomic<uint64_t> errors{ 0 };
+	std::atomic<uint64_t> payload_bytes{ 0 };
+	MessagePackRPCHistogram sync_latency;
+	MessagePackRPCHistogram async_latency;
+	MessagePackRPCHistogram latency;
+
+	static void _client_func(void *p_user_data);
+	void _reset_counters();
+	void _flush_until(uint64_t p_deadline_usec, bool p_drain);
+	Dictionary _get_config() const;
+
+protected:
+	static void _bind_methods();
+
+public:
+	Dictionary run();
+
+	void set_client_count(int p_count);
+	int get_client_count() const;
+	void set_duration_msec(int p_msec);
+	int get_duration_msec() const;
+	void set_port(int p_port);
+	int get_port() const;
+	void set_sync_weight(double p_weight);
+	double get_sync_weight() const;
+	void set_async_weight(double p_weight);
+	double get_async_weight() const;
+	void set_notify_weight(double p_weight);
+	double get_notify_weight() const;
+	void set_payload_sizes(const PackedInt32Array &p_sizes);
+	PackedInt32Array get_payload_sizes() const;
+	void set_max_in_flight(int p_count);
+	int get_max_in_flight() const;
+	void set_call_timeout_msec(int p_msec);
+	int get_call_timeout_msec() const;
+
+	Variant _echo(Object *p_peer, int64_t p_msgid, const String &p_method, const Array &p_params);
+	void _notified(Object *p_peer, const String &p_method, const Array &p_params);
+	void _async_response(const Variant &p_msgid, const Variant &p_error, const Variant &p_result, int p_client);
+
+	MessagePackRPCBenchmark();
+};
+
+#endif // MESSAGE_PACK_RPC_BENCHMARK_H
@@ -0,0 +1,213 @@
+/*************************************************************************/
+/*  message_pack_rpc_buffer.cpp                                          */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "message_pack_rpc_buffer.h"
+#include "core/os/memory.h"
+#include "core/os/os.h"
+
+BinaryMutex MessagePackRPCBufferPool::mutex;
+LocalVector<uint8_t *> MessagePackRPCBufferPool::free_blocks[_RPC_BUFFER_SIZE_CLASSES];
+uint64_t MessagePackRPCBufferPool::pooled_bytes = 0;
+
+uint32_t MessagePackRPCBufferPool::_get_size_class(uint32_t p_size) {
+	uint32_t size_class = 0;
+	while ((uint32_t(_RPC_BUFFER_MIN_SIZE) << size_class) < p_size) {
+		size_class++;
+	}
+	return size_class;
+}
+
+uint8_t *MessagePackRPCBufferPool::acquire(uint32_t p_size, uint32_t &r_size) {
+	ERR_FAIL_COND_V(p_size > (1u << _RPC_BUFFER_MAX_SHIFT), nullptr);
+	uint32_t size_class = _get_size_class(p_size);
+	r_size = _RPC_BUFFER_MIN_SIZE << size_class;
+	{
+		MutexLock lock(mutex);
+		LocalVector<uint8_t *> &blocks = free_blocks[size_class];
+		if (!blocks.is_empty()) {
+			uint8_t *block = blocks[blocks.size() - 1];
+			blocks.resize(blocks.size() - 1);
+			pooled_bytes -= r_size;
+			return block;
+		}
+	}
+	return (uint8_t *)memalloc(r_size);
+}
+
+void MessagePackRPCBufferPool::release(uint8_t *p_block, uint32_t p_size) {
+	ERR_FAIL_NULL(p_block);
+	{
+		MutexLock lock(mutex);
+		if (pooled_bytes + p_size <= _RPC_BUFFER_POOL_MAX_BYTES) {
+			free_blocks[_get_size_class(p_size)].push_back(p_block);
+			pooled_bytes += p_size;
+			return;
+		}
+	}
+	// Pool is full, the block isn't worth keeping.
+	memfree(p_block);
+}
+
+uint64_t MessagePackRPCBufferPool::get_pooled_bytes() {
+	MutexLock lock(mutex);
+	return pooled_bytes;
+}
+
+void MessagePackRPCBufferPool::clear() {
+	MutexLock lock(mutex);
+	for (int i = 0; i < _RPC_BUFFER_SIZE_CLASSES; i++) {
+		for (uint8_t *block : free_blocks[i]) {
+			memfree(block);
+		}
+		free_blocks[i].reset();
+	}
+	pooled_bytes = 0;
+}
+
+void MessagePackRPCBuffer::set_max_size(uint32_t p_max_size) {
+	ERR_FAIL_COND(p_max_size < _RPC_BUFFER_MIN_SIZE || p_max_size > (1u << _RPC_BUFFER_MAX_SHIFT));
+	uint32_t size = next_power_of_2(p_max_size);
+	if (size > p_max_size) {
+		size >>= 1;
+	}
+	max_size = size;
+}
+
+uint32_t MessagePackRPCBuffer::get_max_size() const {
+	return max_size;
+}
+
+bool MessagePackRPCBuffer::reserve(uint32_t p_size) {
+	if (space_left() >= p_size) {
+		return true;
+	}
+	uint64_t needed = uint64_t(data_left()) + p_size;
+	if (needed > max_size) {
+		return false;
+	}
+	uint32_t new_capacity = 0;
+	uint8_t *new_data = MessagePackRPCBufferPool::acquire(MAX(uint32_t(needed), uint32_t(_RPC_BUFFER_MIN_SIZE)), new_capacity);
+	ERR_FAIL_NULL_V(new_data, false);
+
+	// Move the data to the start of the new block, unwrapping it on the way.
+	uint32_t size = data_left();
+	if (data) {
+		read(new_data, size);
+		MessagePackRPCBufferPool::release(data, capacity);
+	}
+	data = new_data;
+	capacity = new_capacity;
+	read_pos = 0;
+	write_pos = size;
+	return true;
+}
+
+uint32_t MessagePackRPCBuffer::get_write_span(uint8_t *&r_ptr) {
+	uint32_t offset = write_pos & (capacity - 1);
+	r_ptr = data + offset;
+	return MIN(space_left(), capacity - offset);
+}
+
+void MessagePackRPCBuffer::commit_write(uint32_t p_size) {
+	ERR_FAIL_COND(p_size > space_left());
+	write_pos += p_size;
+	last_active_msec = OS::get_singleton()->get_ticks_msec();
+}
+
+uint32_t MessagePackRPCBuffer::get_read_span(const uint8_t *&r_ptr) const {
+	uint32_t offset = read_pos & (capacity - 1);
+	r_ptr = data + offset;
+	return MIN(data_left(), capacity - offset);
+}
+
+void MessagePackRPCBuffer::advance_read(uint32_t p_size) {
+	ERR_FAIL_COND(p_size > data_left());
+	read_pos += p_size;
+	if (read_pos == write_pos) {
+		// Empty, start over so the next spans are as long as possible.
+		read_pos = 0;
+		write_pos = 0;
+	}
+}
+
+uint32_t MessagePackRPCBuffer::write(const uint8_t *p_src, uint32_t p_size) {
+	uint32_t total = 0;
+	// At most two spans, before and after the wrap.
+	while (total < p_size && space_left() > 0) {
+		uint8_t *ptr = nullptr;
+		uint32_t size = MIN(get_write_span(ptr), p_size - total);
+		memcpy(ptr, p_src + total, size);
+		commit_write(size);
+		total += size;
+	}
+	return total;
+}
+
+uint32_t MessagePackRPCBuffer::read(uint8_t *r_dst, uint32_t p_size) {
+	uint32_t total = 0;
+	while (total < p_size && !is_empty()) {
+		const uint8_t *ptr = nullptr;
+		uint32_t size = MIN(get_read_span(ptr), p_size - total);
+		memcpy(r_dst + total, ptr, size);
+		advance_read(size);
+		total += size;
+	}
+	return total;
+}
+
+void MessagePackRPCBuffer::shrink(uint32_t p_keep_size) {
+	if (is_empty() && capacity > p_keep_size) {
+		release();
+	}
+}
+
+void MessagePackRPCBuffer::shrink_if_idle(uint64_t p_idle_msec) {
+	if (is_empty() && data && OS::get_singleton()->get_ticks_msec() - last_active_msec >= p_idle_msec) {
+		release();
+	}
+}
+
+void MessagePackRPCBuffer::release() {
+	if (data) {
+		MessagePackRPCBufferPool::release(data, capacity);
+	}
+	data = nullptr;
+	capacity = 0;
+	read_pos = 0;
+	write_pos = 0;
+}
+
+MessagePackRPCBuffer::MessagePackRPCBuffer(uint32_t p_max_size) {
+	set_max_size(p_max_size);
+}
+
+MessagePackRPCBuffer::~MessagePackRPCBuffer() {
+	release();
+}
@@ -0,0 +1,113 @@
+/*************************************************************************/
+/*  message_pack_rpc_buffer.h                                            */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef MESSAGE_PACK_RPC_BUFFER_H
+#define MESSAGE_PACK_RPC_BUFFER_H
+
+#include "core/os/mutex.h"
+#include "core/templates/local_vector.h"
+#include "core/typedefs.h"
+
+// Smallest block the pool hands out: 4KiB.
+#define _RPC_BUFFER_MIN_SHIFT 12
+#define _RPC_BUFFER_MIN_SIZE (1 << _RPC_BUFFER_MIN_SHIFT)
+// Largest block: 1GiB, the per connection limit is normally much lower.
+#define _RPC_BUFFER_MAX_SHIFT 30
+#define _RPC_BUFFER_SIZE_CLASSES (_RPC_BUFFER_MAX_SHIFT - _RPC_BUFFER_MIN_SHIFT + 1)
+// Free blocks the pool keeps around, all size classes together: 64MiB.
+#define _RPC_BUFFER_POOL_MAX_BYTES (1 << 26)
+// An empty buffer unused for this long gives its storage back to the pool.
+#define _RPC_BUFFER_IDLE_MSEC 5000
+
+// Free lists of power of two blocks, shared by every connection in the process.
+class MessagePackRPCBufferPool {
+	static BinaryMutex mutex;
+	static LocalVector<uint8_t *> free_blocks[_RPC_BUFFER_SIZE_CLASSES];
+	static uint64_t pooled_bytes;
+
+	static uint32_t _get_size_class(uint32_t p_size);
+
+public:
+	// Rounds p_size up to a block size, returned in r_size.
+	static uint8_t *acquire(uint32_t p_size, uint32_t &r_size);
+	static void release(uint8_t *p_block, uint32_t p_size);
+	static uint64_t get_pooled_bytes();
+	// Frees every pooled block, blocks still in use are not affected.
+	static void clear();
+};
+
+// Byte ring buffer for one direction of a connection, used by a single thread.
+// Storage is taken from the pool on first use, grows up to max_size when the
+// data doesn't fit, and goes back to the pool once the buffer is empty again.
+class MessagePackRPCBuffer {
+	uint8_t *data = nullptr;
+	uint32_t capacity = 0;
+	uint32_t max_size = _RPC_BUFFER_MIN_SIZE;
+	// Free running positions, the offset in data is pos & (capacity - 1).
+	uint32_t read_pos = 0;
+	uint32_t write_pos = 0;
+	uint64_t last_active_msec = 0;
+
+public:
+	_FORCE_INLINE_ uint32_t data_left() const { return write_pos - read_pos; }
+	_FORCE_INLINE_ uint32_t space_left() const { return capacity - data_left(); }
+	_FORCE_INLINE_ uint32_t get_capacity() const { return capacity; }
+	_FORCE_INLINE_ bool is_empty() const { return write_pos == read_pos; }
+
+	// Rounded down to a power of two.
+	void set_max_size(uint32_t p_max_size);
+	uint32_t get_max_size() const;
+
+	// Makes room for p_size more bytes, false if that would exceed max_size.
+	bool reserve(uint32_t p_size);
+
+	// Contiguous free space after the data, r_ptr points to its start.
+	uint32_t get_write_span(uint8_t *&r_ptr);
+	void commit_write(uint32_t p_size);
+	// Contiguous data from the read position, r_ptr points to its start.
+	uint32_t get_read_span(const uint8_t *&r_ptr) const;
+	void advance_read(uint32_t p_size);
+
+	// Copy in or out as much as fits, return the bytes copied.
+	uint32_t write(const uint8_t *p_src, uint32_t p_size);
+	uint32_t read(uint8_t *r_dst, uint32_t p_size);
+
+	// Gives the storage back if the buffer is empty and bigger than p_keep_size.
+	void shrink(uint32_t p_keep_size = 0);
+	// Gives the storage back if the buffer is empty and wasn't written to for p_idle_msec.
+	void shrink_if_idle(uint64_t p_idle_msec = _RPC_BUFFER_IDLE_MSEC);
+	// Drops the data and gives the storage back.
+	void release();
+
+	MessagePackRPCBuffer(uint32_t p_max_size);
+	~MessagePackRPCBuffer();
+};
+
+#endif // MESSAGE_PACK_RPC_BUFFER_H
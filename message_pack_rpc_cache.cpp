@@ -0,0 +1,224 @@
+/*************************************************************************/
+/*  message_pack_rpc_cache.cpp                                           */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "message_pack_rpc_cache.h"
+#include "core/os/os.h"
+
+#include "message_pack.h"
+
+MessagePackRPCCache::Table *MessagePackRPCCache::_get_method_table(const uint8_t *p_method, uint32_t p_method_size, bool &r_known) {
+	// Call with mutex locked.
+	Table **table = method_tables.getptr(MessagePack::hash_bytes(p_method, p_method_size));
+	r_known = table != nullptr;
+	return table ? *table : nullptr;
+}
+
+void MessagePackRPCCache::set_policy(const StringName &p_method, uint64_t p_ttl_msec, uint32_t p_max_entries) {
+	ERR_FAIL_COND(p_ttl_msec == 0 || p_max_entries == 0);
+	MutexLock lock(mutex);
+	Table **table = tables.getptr(p_method);
+	if (table) {
+		(*table)->ttl_msec = p_ttl_msec;
+		(*table)->max_entries = p_max_entries;
+		(*table)->entries.clear();
+		return;
+	}
+	Table *new_table = memnew(Table);
+	new_table->method = p_method;
+	new_table->ttl_msec = p_ttl_msec;
+	new_table->max_entries = p_max_entries;
+	tables.insert(p_method, new_table);
+	table_count = tables.size();
+	// Learnt again on next use.
+	method_tables.clear();
+}
+
+void MessagePackRPCCache::remove_policy(const StringName &p_method) {
+	MutexLock lock(mutex);
+	Table **table = tables.getptr(p_method);
+	if (!table) {
+		return;
+	}
+	memdelete(*table);
+	tables.erase(p_method);
+	table_count = tables.size();
+	method_tables.clear();
+}
+
+MessagePackRPCCache::Result MessagePackRPCCache::lookup(const uint8_t *p_request, uint32_t p_size, uint32_t p_method_size, PackedByteArray &r_result, StringName &r_method) {
+	MutexLock lock(mutex);
+	bool known = false;
+	Table *table = _get_method_table(p_request, p_method_size, known);
+	if (!known) {
+		return UNKNOWN_METHOD;
+	}
+	if (!table) {
+		return NOT_CACHED;
+	}
+	uint64_t key = MessagePack::hash_bytes(p_request, p_size);
+	Entry *entry = table->entries.getptr(key);
+	if (!entry) {
+		return MISS;
+	}
+	if (entry->expires_msec <= OS::get_singleton()->get_ticks_msec()) {
+		table->entries.erase(key);
+		return MISS;
+	}
+	if (uint32_t(entry->request.size()) != p_size || memcmp(entry->request.ptr(), p_request, p_size) != 0) {
+		return MISS;
+	}
+	r_result = entry->result;
+	r_method = table->method;
+	return HIT;
+}
+
+void MessagePackRPCCache::learn_method(const uint8_t *p_method, uint32_t p_method_size, const StringName &p_name) {
+	MutexLock lock(mutex);
+	if (method_tables.size() >= _RPC_CACHE_MAX_METHODS) {
+		method_tables.clear();
+	}
+	Table **table = tables.getptr(p_name);
+	method_tables[MessagePack::hash_bytes(p_method, p_method_size)] = table ? *table : nullptr;
+}
+
+void MessagePackRPCCache::store(const PackedByteArray &p_request, uint32_t p_method_size, const PackedByteArray &p_result) {
+	MutexLock lock(mutex);
+	bool known = false;
+	Table *table = _get_method_table(p_request.ptr(), p_method_size, known);
+	if (!table) {
+		return; // No longer cached
+	}
+	uint64_t now = OS::get_singleton()->get_ticks_msec();
+	uint64_t key = MessagePack::hash_bytes(p_request.ptr(), p_request.size());
+	table->entries.erase(key);
+	while (table->entries.size() >= table->max_entries) {
+		// Oldest first, expired or not.
+		uint64_t oldest = table->entries.begin()->key;
+		table->entries.erase(oldest);
+	}
+	Entry entry;
+	entry.request = p_request;
+	entry.result = p_result;
+	entry.expires_msec = now + table->ttl_msec;
+	table->entries.insert(key, entry);
+}
+
+void MessagePackRPCCache::clear() {
+	MutexLock lock(mutex);
+	for (KeyValue<StringName, Table *> &E : tables) {
+		E.value->entries.clear();
+	}
+}
+
+uint32_t MessagePackRPCCache::get_scalar_size(const uint8_t *p_data, uint32_t p_size) {
+	if (p_size == 0) {
+		return 0;
+	}
+	uint8_t type = p_data[0];
+	uint32_t size = 0;
+	if (type <= 0x7f || type >= 0xe0) {
+		size = 1; // fixint
+	} else if (type >= 0xa0 && type <= 0xbf) {
+		size = 1 + (type & 0x1f); // fixstr
+	} else {
+		switch (type) {
+			case 0xcc: // uint 8
+			case 0xd0: // int 8
+				size = 2;
+				break;
+			case 0xcd: // uint 16
+			case 0xd1: // int 16
+				size = 3;
+				break;
+			case 0xce: // uint 32
+			case 0xd2: // int 32
+				size = 5;
+				break;
+			case 0xcf: // uint 64
+			case 0xd3: // int 64
+				size = 9;
+				break;
+			case 0xd9: // str 8
+				if (p_size >= 2) {
+					size = 2 + p_data[1];
+				}
+				break;
+			case 0xda: // str 16
+				if (p_size >= 3) {
+					size = 3 + ((uint32_t(p_data[1]) << 8) | p_data[2]);
+				}
+				break;
+			case 0xdb: // str 32
+				if (p_size >= 5) {
+					size = 5 + ((uint32_t(p_data[1]) << 24) | (uint32_t(p_data[2]) << 16) | (uint32_t(p_data[3]) << 8) | p_data[4]);
+				}
+				break;
+		}
+	}
+	return size <= p_size ? size : 0;
+}
+
+bool MessagePackRPCCache::read_int(const uint8_t *p_data, uint32_t p_size, int64_t &r_value) {
+	uint32_t size = get_scalar_size(p_data, p_size);
+	if (size == 0) {
+		return false;
+	}
+	uint8_t type = p_data[0];
+	if (type <= 0x7f) {
+		r_value = type;
+		return true;
+	}
+	if (type >= 0xe0) {
+		r_value = int8_t(type);
+		return true;
+	}
+	if (type < 0xcc || type > 0xd3) {
+		return false; // A string
+	}
+	// Big endian, 1 to 8 bytes after the type.
+	uint64_t value = 0;
+	for (uint32_t i = 1; i < size; i++) {
+		value = (value << 8) | p_data[i];
+	}
+	if (type >= 0xd0) {
+		// Sign extend
+		int shift = 64 - int(size - 1) * 8;
+		r_value = shift > 0 ? int64_t(value << shift) >> shift : int64_t(value);
+	} else {
+		r_value = int64_t(value);
+	}
+	return true;
+}
+
+MessagePackRPCCache::~MessagePackRPCCache() {
+	for (KeyValue<StringName, Table *> &E : tables) {
+		memdelete(E.value);
+	}
+}
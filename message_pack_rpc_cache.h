@@ -0,0 +1,107 @@
+/*************************************************************************/
+/*  message_pack_rpc_cache.h                                             */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef MESSAGE_PACK_RPC_CACHE_H
+#define MESSAGE_PACK_RPC_CACHE_H
+
+#include "core/os/mutex.h"
+#include "core/string/string_name.h"
+#include "core/templates/hash_map.h"
+#include "core/variant/variant.h"
+
+#include <atomic>
+
+// Default max responses kept per cached method
+#define _RPC_CACHE_MAX_ENTRIES 1024
+// Encoded method names learnt before the table is reset, bounds what peers can make it hold.
+#define _RPC_CACHE_MAX_METHODS 1024
+// Requests waiting for a response to be cached, per connection.
+#define _RPC_CACHE_MAX_PENDING 1024
+
+// Encoded responses of idempotent requests, keyed by the encoded method and
+// params of the request. Lookups work on the raw request bytes, a hit never
+// decodes the request nor encodes the response.
+class MessagePackRPCCache {
+public:
+	enum Result {
+		NOT_CACHED,
+		// The encoded method was never seen, learn_method() it and look up again.
+		UNKNOWN_METHOD,
+		MISS,
+		HIT,
+	};
+
+private:
+	struct Entry {
+		// Compared on hit, hashes can collide.
+		PackedByteArray request;
+		PackedByteArray result;
+		uint64_t expires_msec = 0;
+	};
+	struct Table {
+		// Reported on hit, the request isn't decoded then.
+		StringName method;
+		uint64_t ttl_msec = 0;
+		uint32_t max_entries = 0;
+		// Insertion ordered, the oldest entry goes first when full.
+		HashMap<uint64_t, Entry> entries;
+	};
+
+	Mutex mutex;
+	HashMap<StringName, Table *> tables;
+	// Hash of an encoded method name or id -> its table, null when not cached.
+	HashMap<uint64_t, Table *> method_tables;
+	std::atomic<uint32_t> table_count{ 0 };
+
+	Table *_get_method_table(const uint8_t *p_method, uint32_t p_method_size, bool &r_known);
+
+public:
+	// No method is cached, the request needn't be looked at.
+	_FORCE_INLINE_ bool is_empty() const { return table_count.load() == 0; }
+
+	void set_policy(const StringName &p_method, uint64_t p_ttl_msec, uint32_t p_max_entries);
+	void remove_policy(const StringName &p_method);
+
+	// p_request holds the encoded method then the encoded params, the method
+	// taking the first p_method_size bytes. r_method is set on HIT.
+	Result lookup(const uint8_t *p_request, uint32_t p_size, uint32_t p_method_size, PackedByteArray &r_result, StringName &r_method);
+	void learn_method(const uint8_t *p_method, uint32_t p_method_size, const StringName &p_name);
+	void store(const PackedByteArray &p_request, uint32_t p_method_size, const PackedByteArray &p_result);
+	void clear();
+
+	// Size of the encoded integer or string at p_data, 0 for anything else or if truncated.
+	static uint32_t get_scalar_size(const uint8_t *p_data, uint32_t p_size);
+	// Reads the encoded integer at p_data, false if it isn't one.
+	static bool read_int(const uint8_t *p_data, uint32_t p_size, int64_t &r_value);
+
+	~MessagePackRPCCache();
+};
+
+#endif // MESSAGE_PACK_RPC_CACHE_H
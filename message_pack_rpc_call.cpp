@@ -0,0 +1,145 @@
+/*************************************************************************/
+/*  message_pack_rpc_call.cpp                                            */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "message_pack_rpc_call.h"
+#include "core/os/os.h"
+
+void MessagePackRPCCall::setup(uint64_t p_msgid, const String &p_method) {
+	msgid = p_msgid;
+	method = p_method;
+	start_usec = OS::get_singleton()->get_ticks_usec();
+}
+
+void MessagePackRPCCall::setup_batch(uint64_t p_first_msgid, uint32_t p_size) {
+	msgid = p_first_msgid;
+	start_usec = OS::get_singleton()->get_ticks_usec();
+	batch_size = p_size;
+	batch_left = p_size;
+	batch_results.resize(p_size);
+	batch_errors.resize(p_size);
+	batch_answered.resize(p_size);
+	for (uint32_t i = 0; i < p_size; i++) {
+		batch_answered[i] = false;
+	}
+}
+
+void MessagePackRPCCall::complete(Status p_status, const Variant &p_result, const Variant &p_error) {
+	ERR_FAIL_COND_MSG(status != STATUS_PENDING, "Call '" + method + "' already completed.");
+	status = p_status;
+	result = p_result;
+	error = p_error;
+	emit_signal(SNAME("completed"), result, error);
+}
+
+void MessagePackRPCCall::complete_item(uint64_t p_msgid, const Variant &p_result, const Variant &p_error) {
+	if (status != STATUS_PENDING) {
+		return; // Answered after the batch failed.
+	}
+	ERR_FAIL_COND(p_msgid < msgid || p_msgid - msgid >= batch_size);
+	uint32_t idx = p_msgid - msgid;
+	ERR_FAIL_COND(batch_answered[idx]);
+	batch_answered[idx] = true;
+	batch_results[idx] = p_result;
+	batch_errors[idx] = p_error;
+	if (--batch_left == 0) {
+		complete(STATUS_COMPLETED, batch_results, batch_errors);
+	}
+}
+
+void MessagePackRPCCall::fail(Status p_status, Error p_error) {
+	if (!is_batch()) {
+		complete(p_status, Variant(), p_error);
+		return;
+	}
+	if (status != STATUS_PENDING) {
+		return;
+	}
+	// Items answered already keep their result.
+	for (uint32_t i = 0; i < batch_size; i++) {
+		if (!batch_answered[i]) {
+			batch_errors[i] = p_error;
+		}
+	}
+	complete(p_status, batch_results, batch_errors);
+}
+
+uint64_t MessagePackRPCCall::get_msgid() const {
+	return msgid;
+}
+
+String MessagePackRPCCall::get_method() const {
+	return method;
+}
+
+MessagePackRPCCall::Status MessagePackRPCCall::get_status() const {
+	return status;
+}
+
+bool MessagePackRPCCall::is_done() const {
+	return status != STATUS_PENDING;
+}
+
+bool MessagePackRPCCall::is_batch() const {
+	return batch_size > 0;
+}
+
+uint64_t MessagePackRPCCall::get_start_usec() const {
+	return start_usec;
+}
+
+int MessagePackRPCCall::get_batch_size() const {
+	return batch_size;
+}
+
+Variant MessagePackRPCCall::get_result() const {
+	return result;
+}
+
+Variant MessagePackRPCCall::get_error() const {
+	return error;
+}
+
+void MessagePackRPCCall::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("get_msgid"), &MessagePackRPCCall::get_msgid);
+	ClassDB::bind_method(D_METHOD("get_method"), &MessagePackRPCCall::get_method);
+	ClassDB::bind_method(D_METHOD("get_status"), &MessagePackRPCCall::get_status);
+	ClassDB::bind_method(D_METHOD("is_done"), &MessagePackRPCCall::is_done);
+	ClassDB::bind_method(D_METHOD("is_batch"), &MessagePackRPCCall::is_batch);
+	ClassDB::bind_method(D_METHOD("get_batch_size"), &MessagePackRPCCall::get_batch_size);
+	ClassDB::bind_method(D_METHOD("get_result"), &MessagePackRPCCall::get_result);
+	ClassDB::bind_method(D_METHOD("get_error"), &MessagePackRPCCall::get_error);
+
+	ADD_SIGNAL(MethodInfo("completed", PropertyInfo(Variant::NIL, "result", PROPERTY_HINT_NONE, "", PROPERTY_USAGE_NIL_IS_VARIANT), PropertyInfo(Variant::NIL, "error", PROPERTY_HINT_NONE, "", PROPERTY_USAGE_NIL_IS_VARIANT)));
+
+	BIND_ENUM_CONSTANT(STATUS_PENDING);
+	BIND_ENUM_CONSTANT(STATUS_COMPLETED);
+	BIND_ENUM_CONSTANT(STATUS_TIMEOUT);
+	BIND_ENUM_CONSTANT(STATUS_CANCELLED);
+}
@@ -0,0 +1,92 @@
+/*************************************************************************/
+/*  message_pack_rpc_call.h                                              */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef MESSAGE_PACK_RPC_CALL_H
+#define MESSAGE_PACK_RPC_CALL_H
+
+#include "core/object/ref_counted.h"
+#include "core/string/ustring.h"
+#include "core/templates/local_vector.h"
+#include "core/variant/array.h"
+
+// An asynchronous call waiting for its response, emits completed once. A batch
+// covers a range of msgids and completes once every one of them is answered.
+class MessagePackRPCCall : public RefCounted {
+	GDCLASS(MessagePackRPCCall, RefCounted);
+
+public:
+	enum Status {
+		STATUS_PENDING = 0,
+		STATUS_COMPLETED,
+		STATUS_TIMEOUT,
+		STATUS_CANCELLED,
+	};
+
+private:
+	uint64_t msgid = 0;
+	String method;
+	// When the request was made, for the round-trip latency.
+	uint64_t start_usec = 0;
+	Status status = STATUS_PENDING;
+	Variant result;
+	Variant error;
+	// Batch of msgid .. msgid + batch_size - 1, results and errors by index.
+	uint32_t batch_size = 0;
+	uint32_t batch_left = 0;
+	Array batch_results;
+	Array batch_errors;
+	LocalVector<bool> batch_answered;
+
+protected:
+	static void _bind_methods();
+
+public:
+	void setup(uint64_t p_msgid, const String &p_method);
+	void setup_batch(uint64_t p_first_msgid, uint32_t p_size);
+	void complete(Status p_status, const Variant &p_result, const Variant &p_error);
+	// One response of a batch, completes it with the last one.
+	void complete_item(uint64_t p_msgid, const Variant &p_result, const Variant &p_error);
+	// Completes with p_error, for a batch only the items still unanswered.
+	void fail(Status p_status, Error p_error);
+
+	uint64_t get_msgid() const;
+	String get_method() const;
+	Status get_status() const;
+	bool is_done() const;
+	bool is_batch() const;
+	uint64_t get_start_usec() const;
+	int get_batch_size() const;
+	Variant get_result() const;
+	Variant get_error() const;
+};
+
+VARIANT_ENUM_CAST(MessagePackRPCCall::Status);
+
+#endif // MESSAGE_PACK_RPC_CALL_H
@@ -0,0 +1,333 @@
+/*************************************************************************/
+/*  message_pack_rpc_capture.cpp                                         */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "message_pack_rpc_capture.h"
+#include "core/os/os.h"
+
+#include "message_pack_rpc.h"
+#include "message_pack_rpc_cache.h"
+#include "message_pack_rpc_server.h"
+
+Error MessagePackRPCCapture::start(const String &p_path) {
+	MutexLock lock(mutex);
+	Error err = OK;
+	Ref<FileAccess> new_file = FileAccess::open(p_path, FileAccess::WRITE, &err);
+	ERR_FAIL_COND_V_MSG(new_file.is_null(), err, "Can't open capture file '" + p_path + "'.");
+	if (file.is_valid()) {
+		file->close();
+	}
+	file = new_file;
+	file->store_buffer((const uint8_t *)_RPC_CAPTURE_MAGIC, 4);
+	file->store_32(_RPC_CAPTURE_VERSION);
+	last_usec = OS::get_singleton()->get_ticks_usec();
+	active = true;
+	return OK;
+}
+
+void MessagePackRPCCapture::record(Direction p_direction, const uint8_t *p_data, uint32_t p_size) {
+	MutexLock lock(mutex);
+	if (file.is_null()) {
+		return;
+	}
+	uint64_t now = OS::get_singleton()->get_ticks_usec();
+	file->store_8(p_direction);
+	file->store_32(MIN(now - last_usec, uint64_t(UINT32_MAX)));
+	file->store_32(p_size);
+	file->store_buffer(p_data, p_size);
+	last_usec = now;
+}
+
+void MessagePackRPCCapture::stop() {
+	active = false;
+	MutexLock lock(mutex);
+	if (file.is_valid()) {
+		file->close();
+		file = Ref<FileAccess>();
+	}
+}
+
+MessagePackRPCCapture::~MessagePackRPCCapture() {
+	stop();
+}
+
+Error MessagePackRPCReplayer::load(const String &p_path) {
+	ERR_FAIL_COND_V_MSG(running, ERR_BUSY, "A replay is running.");
+	Error err = OK;
+	Ref<FileAccess> file = FileAccess::open(p_path, FileAccess::READ, &err);
+	ERR_FAIL_COND_V_MSG(file.is_null(), err, "Can't open capture file '" + p_path + "'.");
+	uint8_t magic[4];
+	ERR_FAIL_COND_V_MSG(file->get_buffer(magic, 4) != 4 || memcmp(magic, _RPC_CAPTURE_MAGIC, 4) != 0, ERR_FILE_UNRECOGNIZED, "Not a capture file.");
+	ERR_FAIL_COND_V_MSG(file->get_32() != _RPC_CAPTURE_VERSION, ERR_FILE_UNRECOGNIZED, "Unsupported capture version.");
+
+	frames.clear();
+	uint64_t time_usec = 0;
+	uint64_t length = file->get_length();
+	while (file->get_position() + 9 <= length) {
+		uint8_t direction = file->get_8();
+		time_usec += file->get_32();
+		uint32_t size = file->get_32();
+		ERR_FAIL_COND_V_MSG(file->get_position() + size > length, ERR_FILE_CORRUPT, "Capture file is truncated.");
+		if (direction != MessagePackRPCCapture::DIRECTION_IN) {
+			file->seek(file->get_position() + size);
+			continue; // Only what the captured side received is replayed.
+		}
+		Frame frame;
+		frame.time_usec = time_usec;
+		frame.data.resize(size);
+		file->get_buffer(frame.data.ptrw(), size);
+		frames.push_back(frame);
+	}
+	return OK;
+}
+
+int MessagePackRPCReplayer::get_frame_count() const {
+	return frames.size();
+}
+
+Error MessagePackRPCReplayer::start(Object *p_target, bool p_realtime) {
+	ERR_FAIL_COND_V_MSG(running, ERR_BUSY, "A replay is running.");
+	ERR_FAIL_COND_V_MSG(frames.is_empty(), ERR_UNCONFIGURED, "Load a capture first.");
+	if (thread.is_started()) {
+		thread.wait_to_finish();
+	}
+
+	Array pair = MessagePackRPCTransportLoopback::create_pair();
+	Ref<MessagePackRPCTransport> target_end = pair[0];
+	Error err = ERR_INVALID_PARAMETER;
+	if (MessagePackRPC *rpc = Object::cast_to<MessagePackRPC>(p_target)) {
+		err = rpc->takeover_transport(target_end);
+	} else if (MessagePackRPCServer *server = Object::cast_to<MessagePackRPCServer>(p_target)) {
+		err = server->takeover_transport(target_end);
+	} else {
+		ERR_FAIL_V_MSG(err, "The target must be a MessagePackRPC or a MessagePackRPCServer.");
+	}
+	if (err != OK) {
+		return err;
+	}
+
+	transport = pair[1];
+	realtime = p_realtime;
+	report = Dictionary();
+	stopping = false;
+	running = true;
+	msg_pack.start_stream_with_reader(_stream_reader, this);
+	thread.start(_thread_func, this);
+	return OK;
+}
+
+bool MessagePackRPCReplayer::is_running() const {
+	return running;
+}
+
+void MessagePackRPCReplayer::stop() {
+	stopping = true;
+	if (thread.is_started()) {
+		thread.wait_to_finish();
+	}
+}
+
+Dictionary MessagePackRPCReplayer::get_report() const {
+	ERR_FAIL_COND_V_MSG(running, Dictionary(), "The replay is still running.");
+	return report;
+}
+
+void MessagePackRPCReplayer::set_response_timeout_msec(int p_msec) {
+	ERR_FAIL_COND(p_msec < 0);
+	response_timeout_msec = p_msec;
+}
+
+int MessagePackRPCReplayer::get_response_timeout_msec() const {
+	return response_timeout_msec;
+}
+
+size_t MessagePackRPCReplayer::_stream_reader(mpack_tree_t *p_tree, char *r_buffer, size_t p_count) {
+	MessagePackRPCReplayer *replayer = (MessagePackRPCReplayer *)mpack_tree_context(p_tree);
+	int read = 0;
+	replayer->transport->get_partial_data((uint8_t *)r_buffer, MIN(p_count, size_t(INT32_MAX)), read);
+	return read;
+}
+
+bool MessagePackRPCReplayer::_send_frame(const Frame &p_frame) {
+	const uint8_t *ptr = p_frame.data.ptr();
+	int left = p_frame.data.size();
+	while (left > 0) {
+		int sent = 0;
+		if (stopping || transport->put_partial_data(ptr, left, sent) != OK) {
+			return false;
+		}
+		ptr += sent;
+		left -= sent;
+		if (left > 0 && !_receive()) {
+			// The target isn't keeping up, and may itself be stuck writing
+			// responses. Those are read first, sleeps only when none came.
+			transport->wait(NetSocket::POLL_TYPE_OUT, 1);
+		}
+	}
+	return true;
+}
+
+bool MessagePackRPCReplayer::_receive() {
+	// Reads and times the responses that arrived, true if there were any bytes.
+	int available = transport->get_available_bytes();
+	bytes_received += available;
+	while (msg_pack.try_parse_stream() == OK) {
+		// Response [1, msgid, error, result]
+		Variant msg = msg_pack.get_data();
+		if (msg.get_type() != Variant::ARRAY) {
+			continue;
+		}
+		Array msg_arr = msg;
+		if (msg_arr.size() != 4 || int(msg_arr[0]) != MessagePackRPC::RESPONSE || msg_arr[1].get_type() != Variant::INT) {
+			continue;
+		}
+		uint64_t *sent_usec = pending.getptr(uint64_t(int64_t(msg_arr[1])));
+		if (sent_usec) {
+			latency.record(OS::get_singleton()->get_ticks_usec() - *sent_usec);
+			pending.erase(uint64_t(int64_t(msg_arr[1])));
+			responses++;
+		}
+	}
+	return available > 0;
+}
+
+void MessagePackRPCReplayer::_thread_func(void *p_user_data) {
+	MessagePackRPCReplayer *replayer = (MessagePackRPCReplayer *)p_user_data;
+	Ref<MessagePackRPCTransport> transport = replayer->transport;
+	const LocalVector<Frame> &frames = replayer->frames;
+
+	HashMap<uint64_t, uint64_t> &pending = replayer->pending;
+	pending.clear();
+	replayer->latency.reset();
+	replayer->bytes_received = 0;
+	replayer->responses = 0;
+	uint64_t bytes_sent = 0;
+	uint64_t requests = 0;
+	uint32_t next = 0;
+	uint64_t start_usec = OS::get_singleton()->get_ticks_usec();
+	uint64_t last_sent_usec = start_usec;
+
+	while (!replayer->stopping && transport->is_open()) {
+		uint64_t now = OS::get_singleton()->get_ticks_usec();
+		// A handful of frames at a time, the responses are read in between.
+		for (int i = 0; i < 64 && next < frames.size(); i++) {
+			const Frame &frame = frames[next];
+			if (replayer->realtime && start_usec + frame.time_usec > now) {
+				break;
+			}
+			// Request [0, msgid, method, params]
+			const uint8_t *data = frame.data.ptr();
+			uint32_t size = frame.data.size();
+			int64_t id = 0;
+			bool request = size > 2 && data[0] == 0x94 && data[1] == MessagePackRPC::REQUEST && MessagePackRPCCache::read_int(data + 2, size - 2, id);
+			if (request) {
+				pending[uint64_t(id)] = OS::get_singleton()->get_ticks_usec();
+				requests++;
+			}
+			if (!replayer->_send_frame(frame)) {
+				break;
+			}
+			bytes_sent += size;
+			last_sent_usec = OS::get_singleton()->get_ticks_usec();
+			next++;
+		}
+
+		bool received = replayer->_receive();
+
+		if (next == frames.size()) {
+			if (pending.is_empty() || OS::get_singleton()->get_ticks_usec() - last_sent_usec > uint64_t(replayer->response_timeout_msec) * 1000) {
+				break;
+			}
+		}
+		if (!received && (next == frames.size() || replayer->realtime)) {
+			// Nothing to read, sleep until a response or the next frame is due.
+			int wait_msec = 10;
+			if (next < frames.size()) {
+				uint64_t due = start_usec + frames[next].time_usec;
+				now = OS::get_singleton()->get_ticks_usec();
+				wait_msec = due > now ? MIN(int((due - now) / 1000), 10) : 0;
+			}
+			if (wait_msec > 0) {
+				transport->wait(NetSocket::POLL_TYPE_IN, wait_msec);
+			}
+		}
+	}
+
+	uint64_t duration_usec = MAX(uint64_t(1), OS::get_singleton()->get_ticks_usec() - start_usec);
+	double seconds = duration_usec / 1000000.0;
+	Dictionary report;
+	report["frames"] = frames.size();
+	report["frames_sent"] = next;
+	report["bytes_sent"] = bytes_sent;
+	report["bytes_received"] = replayer->bytes_received;
+	report["requests"] = requests;
+	report["responses"] = replayer->responses;
+	report["unanswered"] = pending.size();
+	report["duration_usec"] = duration_usec;
+	report["messages_per_sec"] = next / seconds;
+	report["responses_per_sec"] = replayer->responses / seconds;
+	report["bytes_per_sec"] = bytes_sent / seconds;
+	report["latency_usec"] = replayer->latency.to_dictionary();
+	replayer->report = report;
+
+	transport->close();
+	replayer->running = false;
+	replayer->call_deferred(SNAME("_replay_finished"));
+}
+
+void MessagePackRPCReplayer::_replay_finished() {
+	if (running) {
+		return; // Restarted already
+	}
+	if (thread.is_started()) {
+		thread.wait_to_finish();
+	}
+	emit_signal(SNAME("finished"), report);
+}
+
+void MessagePackRPCReplayer::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("load", "path"), &MessagePackRPCReplayer::load);
+	ClassDB::bind_method(D_METHOD("get_frame_count"), &MessagePackRPCReplayer::get_frame_count);
+	ClassDB::bind_method(D_METHOD("start", "target", "realtime"), &MessagePackRPCReplayer::start, DEFVAL(false));
+	ClassDB::bind_method(D_METHOD("is_running"), &MessagePackRPCReplayer::is_running);
+	ClassDB::bind_method(D_METHOD("stop"), &MessagePackRPCReplayer::stop);
+	ClassDB::bind_method(D_METHOD("get_report"), &MessagePackRPCReplayer::get_report);
+	ClassDB::bind_method(D_METHOD("set_response_timeout_msec", "msec"), &MessagePackRPCReplayer::set_response_timeout_msec);
+	ClassDB::bind_method(D_METHOD("get_response_timeout_msec"), &MessagePackRPCReplayer::get_response_timeout_msec);
+
+	ClassDB::bind_method(D_METHOD("_replay_finished"), &MessagePackRPCReplayer::_replay_finished);
+
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "response_timeout_msec", PROPERTY_HINT_RANGE, "0,60000,1,or_greater,suffix:ms"), "set_response_timeout_msec", "get_response_timeout_msec");
+
+	ADD_SIGNAL(MethodInfo("finished", PropertyInfo(Variant::DICTIONARY, "report")));
+}
+
+MessagePackRPCReplayer::~MessagePackRPCReplayer() {
+	stop();
+}
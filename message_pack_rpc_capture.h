@@ -0,0 +1,133 @@
+/*************************************************************************/
+/*  message_pack_rpc_capture.h                                           */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef MESSAGE_PACK_RPC_CAPTURE_H
+#define MESSAGE_PACK_RPC_CAPTURE_H
+
+#include "core/io/file_access.h"
+#include "core/object/ref_counted.h"
+#include "core/os/mutex.h"
+#include "core/os/thread.h"
+#include "core/templates/hash_map.h"
+#include "core/templates/local_vector.h"
+#include "core/variant/dictionary.h"
+
+#include "message_pack.h"
+#include "message_pack_rpc_metrics.h"
+#include "message_pack_rpc_transport.h"
+
+#include <atomic>
+
+// Capture file: "MPRC", u32 version, then one record per frame:
+// u8 direction, u32 usec since the previous frame, u32 size, the encoded message.
+#define _RPC_CAPTURE_MAGIC "MPRC"
+#define _RPC_CAPTURE_VERSION 1
+// Replays give up on the responses still missing this long after the last frame.
+#define _RPC_REPLAY_RESPONSE_TIMEOUT_MSEC 5000
+
+// Writes the frames of one connection to a capture file, from any thread.
+class MessagePackRPCCapture {
+public:
+	enum Direction {
+		DIRECTION_IN = 0,
+		DIRECTION_OUT,
+	};
+
+private:
+	Mutex mutex;
+	Ref<FileAccess> file;
+	std::atomic<bool> active{ false };
+	uint64_t last_usec = 0;
+
+public:
+	_FORCE_INLINE_ bool is_active() const { return active.load(std::memory_order_relaxed); }
+
+	Error start(const String &p_path);
+	void record(Direction p_direction, const uint8_t *p_data, uint32_t p_size);
+	void stop();
+
+	~MessagePackRPCCapture();
+};
+
+// Sends the frames a capture received into a MessagePackRPC or a
+// MessagePackRPCServer over a loopback transport, and times the responses.
+class MessagePackRPCReplayer : public RefCounted {
+	GDCLASS(MessagePackRPCReplayer, RefCounted);
+
+	struct Frame {
+		// Since the first frame of the capture.
+		uint64_t time_usec = 0;
+		PackedByteArray data;
+	};
+
+	LocalVector<Frame> frames;
+	Thread thread;
+	Ref<MessagePackRPCTransport> transport;
+	MessagePack msg_pack;
+	std::atomic<bool> running{ false };
+	std::atomic<bool> stopping{ false };
+	bool realtime = false;
+	int response_timeout_msec = _RPC_REPLAY_RESPONSE_TIMEOUT_MSEC;
+
+	// Written by the replay thread, read once it's done.
+	Dictionary report;
+
+	// Replay thread only. Requests sent and not answered yet -> when they were sent.
+	HashMap<uint64_t, uint64_t> pending;
+	MessagePackRPCHistogram latency;
+	uint64_t bytes_received = 0;
+	uint64_t responses = 0;
+
+	static size_t _stream_reader(mpack_tree_t *p_tree, char *r_buffer, size_t p_count);
+	static void _thread_func(void *p_user_data);
+	bool _send_frame(const Frame &p_frame);
+	bool _receive();
+
+protected:
+	static void _bind_methods();
+
+public:
+	Error load(const String &p_path);
+	int get_frame_count() const;
+
+	Error start(Object *p_target, bool p_realtime = false);
+	bool is_running() const;
+	void stop();
+	Dictionary get_report() const;
+
+	void set_response_timeout_msec(int p_msec);
+	int get_response_timeout_msec() const;
+
+	void _replay_finished();
+
+	~MessagePackRPCReplayer();
+};
+
+#endif // MESSAGE_PACK_RPC_CAPTURE_H
@@ -0,0 +1,245 @@
+/*************************************************************************/
+/*  message_pack_rpc_metrics.cpp                                         */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "message_pack_rpc_metrics.h"
+#include "core/os/os.h"
+
+uint32_t MessagePackRPCHistogram::get_bucket(uint64_t p_usec) {
+	if (p_usec < _RPC_HISTOGRAM_SUB_BUCKETS) {
+		return p_usec;
+	}
+	if (p_usec >> (_RPC_HISTOGRAM_MAX_SHIFT + 1)) {
+		return _RPC_HISTOGRAM_BUCKETS - 1;
+	}
+	// Highest set bit, at least 3 here.
+	uint32_t shift = 0;
+	uint64_t value = p_usec;
+	for (uint32_t step = 32; step > 0; step >>= 1) {
+		if (value >> step) {
+			value >>= step;
+			shift += step;
+		}
+	}
+	// The 3 bits under the highest one pick the sub-bucket.
+	return _RPC_HISTOGRAM_SUB_BUCKETS * (shift - 2) + ((p_usec >> (shift - 3)) & (_RPC_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+uint64_t MessagePackRPCHistogram::get_bucket_upper(uint32_t p_bucket) {
+	if (p_bucket < _RPC_HISTOGRAM_SUB_BUCKETS) {
+		return p_bucket;
+	}
+	uint32_t shift = p_bucket / _RPC_HISTOGRAM_SUB_BUCKETS + 2;
+	uint64_t sub = p_bucket % _RPC_HISTOGRAM_SUB_BUCKETS;
+	uint64_t lower = (_RPC_HISTOGRAM_SUB_BUCKETS + sub) << (shift - 3);
+	return lower + (uint64_t(1) << (shift - 3)) - 1;
+}
+
+void MessagePackRPCHistogram::record(uint64_t p_usec) {
+	buckets[get_bucket(p_usec)].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(p_usec, std::memory_order_relaxed);
+	uint64_t prev = max.load(std::memory_order_relaxed);
+	while (p_usec > prev && !max.compare_exchange_weak(prev, p_usec, std::memory_order_relaxed)) {
+	}
+}
+
+uint64_t MessagePackRPCHistogram::get_percentile(double p_ratio) const {
+	uint64_t total = count.load(std::memory_order_relaxed);
+	if (total == 0) {
+		return 0;
+	}
+	uint64_t rank = MAX(uint64_t(1), uint64_t(Math::ceil(p_ratio * total)));
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < _RPC_HISTOGRAM_BUCKETS; i++) {
+		seen += buckets[i].load(std::memory_order_relaxed);
+		if (seen >= rank) {
+			// Never above the largest value recorded.
+			return MIN(get_bucket_upper(i), max.load(std::memory_order_relaxed));
+		}
+	}
+	return max.load(std::memory_order_relaxed);
+}
+
+Dictionary MessagePackRPCHistogram::to_dictionary() const {
+	Dictionary ret;
+	uint64_t total = count.load(std::memory_order_relaxed);
+	ret["count"] = total;
+	ret["mean"] = total > 0 ? double(sum.load(std::memory_order_relaxed)) / total : 0.0;
+	ret["max"] = max.load(std::memory_order_relaxed);
+	ret["p50"] = get_percentile(0.5);
+	ret["p90"] = get_percentile(0.9);
+	ret["p99"] = get_percentile(0.99);
+	return ret;
+}
+
+void MessagePackRPCHistogram::reset() {
+	for (uint32_t i = 0; i < _RPC_HISTOGRAM_BUCKETS; i++) {
+		buckets[i].store(0, std::memory_order_relaxed);
+	}
+	count.store(0, std::memory_order_relaxed);
+	sum.store(0, std::memory_order_relaxed);
+	max.store(0, std::memory_order_relaxed);
+}
+
+MessagePackRPCHistogram::MessagePackRPCHistogram() {
+	reset();
+}
+
+MessagePackRPCMetrics::MethodStats *MessagePackRPCMetrics::get_method(const StringName &p_method) {
+	uint32_t hash = p_method.hash();
+	for (uint32_t i = 0; i < _RPC_METRICS_MAX_METHODS; i++) {
+		std::atomic<MethodStats *> &slot = methods[(hash + i) & (_RPC_METRICS_MAX_METHODS - 1)];
+		MethodStats *stats = slot.load(std::memory_order_acquire);
+		if (!stats) {
+			MethodStats *new_stats = memnew(MethodStats);
+			new_stats->method = p_method;
+			if (slot.compare_exchange_strong(stats, new_stats, std::memory_order_acq_rel)) {
+				return new_stats;
+			}
+			// Another thread took the slot first, stats holds its method.
+			memdelete(new_stats);
+		}
+		if (stats->method == p_method) {
+			return stats;
+		}
+	}
+	return nullptr;
+}
+
+void MessagePackRPCMetrics::record_request(const StringName &p_method, bool p_notification) {
+	MethodStats *stats = get_method(p_method);
+	if (stats) {
+		add(p_notification ? stats->notifications : stats->requests);
+	}
+}
+
+void MessagePackRPCMetrics::record_handler(const StringName &p_method, uint64_t p_usec) {
+	MethodStats *stats = get_method(p_method);
+	if (stats) {
+		stats->handler_usec.record(p_usec);
+	}
+}
+
+void MessagePackRPCMetrics::record_latency(const StringName &p_method, uint64_t p_usec) {
+	latency_usec.record(p_usec);
+	MethodStats *stats = get_method(p_method);
+	if (stats) {
+		stats->latency_usec.record(p_usec);
+	}
+}
+
+Dictionary MessagePackRPCMetrics::get_metrics() {
+	Dictionary ret;
+	uint64_t in = bytes_in.load(std::memory_order_relaxed);
+	uint64_t out = bytes_out.load(std::memory_order_relaxed);
+	uint64_t msgs_in = messages_in.load(std::memory_order_relaxed);
+	uint64_t msgs_out = messages_out.load(std::memory_order_relaxed);
+	ret["bytes_in"] = in;
+	ret["bytes_out"] = out;
+	ret["messages_in"] = msgs_in;
+	ret["messages_out"] = msgs_out;
+	ret["parse_errors"] = parse_errors.load(std::memory_order_relaxed);
+	ret["timeouts"] = timeouts.load(std::memory_order_relaxed);
+	ret["cache_hits"] = cache_hits.load(std::memory_order_relaxed);
+	{
+		MutexLock lock(rate_mutex);
+		uint64_t now = OS::get_singleton()->get_ticks_usec();
+		double elapsed = MAX(uint64_t(1), now - rate_usec) / 1000000.0;
+		ret["bytes_in_per_sec"] = (in - rate_bytes_in) / elapsed;
+		ret["bytes_out_per_sec"] = (out - rate_bytes_out) / elapsed;
+		ret["messages_in_per_sec"] = (msgs_in - rate_messages_in) / elapsed;
+		ret["messages_out_per_sec"] = (msgs_out - rate_messages_out) / elapsed;
+		rate_usec = now;
+		rate_bytes_in = in;
+		rate_bytes_out = out;
+		rate_messages_in = msgs_in;
+		rate_messages_out = msgs_out;
+	}
+	ret["latency_usec"] = latency_usec.to_dictionary();
+
+	Dictionary by_method;
+	for (uint32_t i = 0; i < _RPC_METRICS_MAX_METHODS; i++) {
+		MethodStats *stats = methods[i].load(std::memory_order_acquire);
+		if (!stats) {
+			continue;
+		}
+		Dictionary method;
+		method["requests"] = stats->requests.load(std::memory_order_relaxed);
+		method["notifications"] = stats->notifications.load(std::memory_order_relaxed);
+		method["handler_usec"] = stats->handler_usec.to_dictionary();
+		method["latency_usec"] = stats->latency_usec.to_dictionary();
+		by_method[String(stats->method)] = method;
+	}
+	ret["methods"] = by_method;
+	return ret;
+}
+
+void MessagePackRPCMetrics::reset() {
+	bytes_in.store(0);
+	bytes_out.store(0);
+	messages_in.store(0);
+	messages_out.store(0);
+	parse_errors.store(0);
+	timeouts.store(0);
+	cache_hits.store(0);
+	latency_usec.reset();
+	// The slots stay taken, only their counts are cleared.
+	for (uint32_t i = 0; i < _RPC_METRICS_MAX_METHODS; i++) {
+		MethodStats *stats = methods[i].load(std::memory_order_acquire);
+		if (stats) {
+			stats->requests.store(0);
+			stats->notifications.store(0);
+			stats->handler_usec.reset();
+			stats->latency_usec.reset();
+		}
+	}
+	MutexLock lock(rate_mutex);
+	rate_usec = OS::get_singleton()->get_ticks_usec();
+	rate_bytes_in = 0;
+	rate_bytes_out = 0;
+	rate_messages_in = 0;
+	rate_messages_out = 0;
+}
+
+MessagePackRPCMetrics::MessagePackRPCMetrics() {
+	for (uint32_t i = 0; i < _RPC_METRICS_MAX_METHODS; i++) {
+		methods[i].store(nullptr);
+	}
+	rate_usec = OS::get_singleton()->get_ticks_usec();
+}
+
+MessagePackRPCMetrics::~MessagePackRPCMetrics() {
+	for (uint32_t i = 0; i < _RPC_METRICS_MAX_METHODS; i++) {
+		MethodStats *stats = methods[i].load();
+		if (stats) {
+			memdelete(stats);
+		}
+	}
+}
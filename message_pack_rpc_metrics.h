@@ -0,0 +1,121 @@
+/*************************************************************************/
+/*  message_pack_rpc_metrics.h                                           */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef MESSAGE_PACK_RPC_METRICS_H
+#define MESSAGE_PACK_RPC_METRICS_H
+
+#include "core/os/mutex.h"
+#include "core/string/string_name.h"
+#include "core/variant/dictionary.h"
+
+#include <atomic>
+
+// Histogram buckets: one per microsecond below 8, then 8 per power of two
+// (at most 12.5% wide) up to 2^41 usec.
+#define _RPC_HISTOGRAM_SUB_BUCKETS 8
+#define _RPC_HISTOGRAM_MAX_SHIFT 40
+#define _RPC_HISTOGRAM_BUCKETS (_RPC_HISTOGRAM_SUB_BUCKETS * (_RPC_HISTOGRAM_MAX_SHIFT - 1))
+// Methods with their own stats, a power of two. Others only count in the totals.
+#define _RPC_METRICS_MAX_METHODS 256
+
+// Fixed-bucket latency histogram, recorded from any thread without locking.
+class MessagePackRPCHistogram {
+	std::atomic<uint64_t> buckets[_RPC_HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> count{ 0 };
+	std::atomic<uint64_t> sum{ 0 };
+	std::atomic<uint64_t> max{ 0 };
+
+public:
+	static uint32_t get_bucket(uint64_t p_usec);
+	static uint64_t get_bucket_upper(uint32_t p_bucket);
+
+	void record(uint64_t p_usec);
+	// Upper bound of the bucket holding the p_ratio quantile.
+	uint64_t get_percentile(double p_ratio) const;
+	// count, mean, max, p50, p90 and p99, in microseconds.
+	Dictionary to_dictionary() const;
+	void reset();
+
+	MessagePackRPCHistogram();
+};
+
+// Counters of one connection. Recording is a relaxed atomic add, or a
+// lock-free lookup of the method's slot the first time a method is seen.
+class MessagePackRPCMetrics {
+public:
+	struct MethodStats {
+		StringName method;
+		std::atomic<uint64_t> requests{ 0 };
+		std::atomic<uint64_t> notifications{ 0 };
+		MessagePackRPCHistogram handler_usec;
+		MessagePackRPCHistogram latency_usec;
+	};
+
+	std::atomic<uint64_t> bytes_in{ 0 };
+	std::atomic<uint64_t> bytes_out{ 0 };
+	std::atomic<uint64_t> messages_in{ 0 };
+	std::atomic<uint64_t> messages_out{ 0 };
+	std::atomic<uint64_t> parse_errors{ 0 };
+	std::atomic<uint64_t> timeouts{ 0 };
+	std::atomic<uint64_t> cache_hits{ 0 };
+	// Every method together.
+	MessagePackRPCHistogram latency_usec;
+
+private:
+	// Open addressing on the StringName hash, slots are only ever filled.
+	std::atomic<MethodStats *> methods[_RPC_METRICS_MAX_METHODS];
+
+	// Rates are taken over the time since the previous get_metrics().
+	Mutex rate_mutex;
+	uint64_t rate_usec = 0;
+	uint64_t rate_bytes_in = 0;
+	uint64_t rate_bytes_out = 0;
+	uint64_t rate_messages_in = 0;
+	uint64_t rate_messages_out = 0;
+
+public:
+	_FORCE_INLINE_ static void add(std::atomic<uint64_t> &r_counter, uint64_t p_value = 1) {
+		r_counter.fetch_add(p_value, std::memory_order_relaxed);
+	}
+
+	// Null once every slot is taken by other methods.
+	MethodStats *get_method(const StringName &p_method);
+	void record_request(const StringName &p_method, bool p_notification);
+	void record_handler(const StringName &p_method, uint64_t p_usec);
+	void record_latency(const StringName &p_method, uint64_t p_usec);
+
+	Dictionary get_metrics();
+	void reset();
+
+	MessagePackRPCMetrics();
+	~MessagePackRPCMetrics();
+};
+
+#endif // MESSAGE_PACK_RPC_METRICS_H
@@ -0,0 +1,406 @@
+/*************************************************************************/
+/*  message_pack_rpc_pool.cpp                                            */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "message_pack_rpc_pool.h"
+#include "core/io/ip.h"
+#include "core/os/os.h"
+
+int MessagePackRPCPool::_pick_connection() {
+	// Call with mutex locked. The scan starts after the last pick, so ties
+	// between the least pending connections are spread too.
+	int count = connections.size();
+	int best = -1;
+	for (int i = 0; i < count; i++) {
+		int idx = (next_connection + i) % count;
+		if (!connections[idx].rpc->is_rpc_connected()) {
+			continue;
+		}
+		if (balance_mode == BALANCE_ROUND_ROBIN) {
+			best = idx;
+			break;
+		}
+		if (best < 0 || connections[idx].pending < connections[best].pending) {
+			best = idx;
+		}
+	}
+	if (best >= 0) {
+		next_connection = (best + 1) % count;
+	}
+	return best;
+}
+
+Ref<MessagePackRPCCall> MessagePackRPCPool::_queue_call(const String &p_method, const Array &p_params, uint64_t p_timeout_msec, bool p_by_signal) {
+	Ref<MessagePackRPCCall> call;
+	call.instantiate();
+	uint64_t id = 0;
+	{
+		MutexLock lock(mutex);
+		id = next_call_id++;
+		call->setup(id, p_method);
+		PoolCall pool_call;
+		pool_call.call = call;
+		pool_call.method = p_method;
+		pool_call.params = p_params;
+		pool_call.deadline_msec = p_timeout_msec > 0 ? OS::get_singleton()->get_ticks_msec() + p_timeout_msec : 0;
+		pool_call.by_signal = p_by_signal;
+		calls.insert(id, pool_call);
+	}
+	if (!_send_call(id)) {
+		MutexLock lock(mutex);
+		calls.erase(id);
+		return Ref<MessagePackRPCCall>();
+	}
+	return call;
+}
+
+bool MessagePackRPCPool::_send_call(uint64_t p_id) {
+	while (true) {
+		MessagePackRPC *rpc = nullptr;
+		int idx = -1;
+		String method;
+		Array params;
+		uint64_t timeout_msec = 0;
+		{
+			MutexLock lock(mutex);
+			PoolCall *pool_call = calls.getptr(p_id);
+			if (!pool_call || pool_call->attempts >= max_attempts) {
+				return false;
+			}
+			if (pool_call->deadline_msec > 0) {
+				uint64_t now = OS::get_singleton()->get_ticks_msec();
+				if (now >= pool_call->deadline_msec) {
+					return false;
+				}
+				timeout_msec = pool_call->deadline_msec - now;
+			}
+			idx = _pick_connection();
+			if (idx < 0) {
+				return false;
+			}
+			pool_call->attempts++;
+			pool_call->connection = idx;
+			connections[idx].pending++;
+			rpc = connections[idx].rpc;
+			method = pool_call->method;
+			params = pool_call->params;
+		}
+
+		Ref<MessagePackRPCCall> inner = rpc->async_callv_future(method, params, timeout_msec);
+		MutexLock lock(mutex);
+		PoolCall *pool_call = calls.getptr(p_id);
+		if (inner.is_valid() && pool_call) {
+			pool_call->inner = inner;
+			// Completed on the main thread, never before this returns there.
+			inner->connect(SNAME("completed"), Callable(this, SNAME("_call_completed")).bind(p_id));
+			return true;
+		}
+		connections[idx].pending--;
+		if (pool_call) {
+			pool_call->connection = -1;
+		}
+	}
+}
+
+void MessagePackRPCPool::_finish_call(uint64_t p_id, MessagePackRPCCall::Status p_status, const Variant &p_result, const Variant &p_error) {
+	PoolCall pool_call;
+	{
+		MutexLock lock(mutex);
+		PoolCall *found = calls.getptr(p_id);
+		if (!found) {
+			return;
+		}
+		pool_call = *found;
+		calls.erase(p_id);
+	}
+	if (pool_call.by_signal) {
+		emit_signal(SNAME("response_received"), p_id, p_error, p_result);
+	} else {
+		pool_call.call->complete(p_status, p_result, p_error);
+	}
+}
+
+void MessagePackRPCPool::_call_completed(const Variant &p_result, const Variant &p_error, uint64_t p_id) {
+	MessagePackRPCCall::Status status = MessagePackRPCCall::STATUS_CANCELLED;
+	{
+		MutexLock lock(mutex);
+		PoolCall *pool_call = calls.getptr(p_id);
+		if (!pool_call || pool_call->inner.is_null()) {
+			return;
+		}
+		status = pool_call->inner->get_status();
+		if (pool_call->connection >= 0 && pool_call->connection < int(connections.size())) {
+			connections[pool_call->connection].pending--;
+		}
+		pool_call->connection = -1;
+		pool_call->inner = Ref<MessagePackRPCCall>();
+	}
+	if (status == MessagePackRPCCall::STATUS_CANCELLED && !closing && _send_call(p_id)) {
+		// Its connection dropped, sent again on another one.
+		return;
+	}
+	_finish_call(p_id, status, p_result, p_error);
+}
+
+Error MessagePackRPCPool::add_endpoint(const String &p_host, int p_port, int p_connections) {
+	ERR_FAIL_COND_V(p_port <= 0 || p_port > 65535, ERR_INVALID_PARAMETER);
+	ERR_FAIL_COND_V_MSG(p_connections < 1 || connections.size() + p_connections > _POOL_MAX_CONNECTIONS, ERR_INVALID_PARAMETER, "Too many connections.");
+	IPAddress ip = p_host.is_valid_ip_address() ? IPAddress(p_host) : IP::get_singleton()->resolve_hostname(p_host);
+	ERR_FAIL_COND_V_MSG(!ip.is_valid(), ERR_CANT_RESOLVE, "Can't resolve '" + p_host + "'.");
+
+	int connected = 0;
+	for (int i = 0; i < p_connections; i++) {
+		Connection connection;
+		connection.rpc = memnew(MessagePackRPC);
+		connection.ip = ip;
+		connection.port = p_port;
+		if (connection.rpc->connect_to_host(ip, p_port) == OK) {
+			connected++;
+		} else {
+			// Retried by poll.
+			connection.next_connect_msec = OS::get_singleton()->get_ticks_msec() + reconnect_interval_msec;
+		}
+		MutexLock lock(mutex);
+		connections.push_back(connection);
+	}
+	return connected > 0 ? OK : ERR_CANT_CONNECT;
+}
+
+void MessagePackRPCPool::poll() {
+	if (reconnect_interval_msec <= 0) {
+		return;
+	}
+	// Never blocks, a connection is started on one call and checked on the next ones.
+	uint64_t now = OS::get_singleton()->get_ticks_msec();
+	for (uint32_t i = 0; i < connections.size(); i++) {
+		Connection &connection = connections[i];
+		if (connection.connecting.is_valid()) {
+			connection.connecting->poll();
+			StreamPeerTCP::Status status = connection.connecting->get_status();
+			if (status == StreamPeerTCP::STATUS_CONNECTING) {
+				continue;
+			}
+			Ref<StreamPeerTCP> stream = connection.connecting;
+			connection.connecting.unref();
+			if (status == StreamPeerTCP::STATUS_CONNECTED) {
+				connection.rpc->takeover_transport(memnew(MessagePackRPCTransportTCP(stream)));
+			} // Otherwise tried again after reconnect_interval_msec.
+			continue;
+		}
+		if (connection.rpc->is_rpc_connected() || now < connection.next_connect_msec) {
+			continue;
+		}
+		connection.next_connect_msec = now + reconnect_interval_msec;
+		connection.connecting.instantiate();
+		if (connection.connecting->connect_to_host(connection.ip, connection.port) != OK) {
+			connection.connecting.unref();
+		}
+	}
+}
+
+void MessagePackRPCPool::close() {
+	closing = true;
+	LocalVector<Connection> closed;
+	{
+		MutexLock lock(mutex);
+		closed = connections;
+		connections.clear();
+		next_connection = 0;
+	}
+	// Closing fails the calls still sent on the connection, they aren't sent again.
+	for (Connection &connection : closed) {
+		connection.rpc->close();
+		memdelete(connection.rpc);
+	}
+	LocalVector<uint64_t> left;
+	{
+		MutexLock lock(mutex);
+		for (const KeyValue<uint64_t, PoolCall> &E : calls) {
+			left.push_back(E.key);
+		}
+	}
+	// Failed by a connection before, their retry never came.
+	for (uint64_t id : left) {
+		_finish_call(id, MessagePackRPCCall::STATUS_CANCELLED, Variant(), ERR_CONNECTION_ERROR);
+	}
+	closing = false;
+}
+
+TypedArray<MessagePackRPC> MessagePackRPCPool::get_connections() {
+	MutexLock lock(mutex);
+	TypedArray<MessagePackRPC> ret;
+	for (const Connection &connection : connections) {
+		ret.push_back(connection.rpc);
+	}
+	return ret;
+}
+
+int MessagePackRPCPool::get_connection_count() {
+	MutexLock lock(mutex);
+	return connections.size();
+}
+
+int MessagePackRPCPool::get_connected_count() {
+	MutexLock lock(mutex);
+	int count = 0;
+	for (const Connection &connection : connections) {
+		if (connection.rpc->is_rpc_connected()) {
+			count++;
+		}
+	}
+	return count;
+}
+
+void MessagePackRPCPool::set_balance_mode(BalanceMode p_mode) {
+	ERR_FAIL_INDEX(p_mode, BALANCE_LEAST_PENDING + 1);
+	MutexLock lock(mutex);
+	balance_mode = p_mode;
+}
+
+MessagePackRPCPool::BalanceMode MessagePackRPCPool::get_balance_mode() const {
+	return balance_mode;
+}
+
+void MessagePackRPCPool::set_max_attempts(int p_attempts) {
+	ERR_FAIL_COND(p_attempts < 1);
+	MutexLock lock(mutex);
+	max_attempts = p_attempts;
+}
+
+int MessagePackRPCPool::get_max_attempts() const {
+	return max_attempts;
+}
+
+void MessagePackRPCPool::set_reconnect_interval_msec(int p_msec) {
+	ERR_FAIL_COND(p_msec < 0);
+	reconnect_interval_msec = p_msec;
+}
+
+int MessagePackRPCPool::get_reconnect_interval_msec() const {
+	return reconnect_interval_msec;
+}
+
+Array MessagePackRPCPool::sync_callv(const String &p_method, uint64_t p_timeout_msec, const Array &p_params) {
+	uint64_t deadline_msec = OS::get_singleton()->get_ticks_msec() + p_timeout_msec;
+	for (int attempt = 0; attempt < max_attempts; attempt++) {
+		MessagePackRPC *rpc = nullptr;
+		int idx = -1;
+		{
+			MutexLock lock(mutex);
+			idx = _pick_connection();
+			if (idx < 0) {
+				break;
+			}
+			connections[idx].pending++;
+			rpc = connections[idx].rpc;
+		}
+		uint64_t now = OS::get_singleton()->get_ticks_msec();
+		Array result = now < deadline_msec ? rpc->sync_callv(p_method, deadline_msec - now, p_params) : Array();
+		bool dropped = result.is_empty() && !rpc->is_rpc_connected();
+		{
+			MutexLock lock(mutex);
+			if (idx < int(connections.size())) {
+				connections[idx].pending--;
+			}
+		}
+		if (!dropped || now >= deadline_msec) {
+			return result;
+		}
+	}
+	ERR_FAIL_V_MSG(Array(), "No connection of the pool could take the sync call.");
+}
+
+Error MessagePackRPCPool::async_callv(const String &p_method, const Array &p_params) {
+	ERR_FAIL_COND_V_MSG(_queue_call(p_method, p_params, 0, true).is_null(), ERR_UNAVAILABLE, "No connection of the pool could take the call.");
+	return OK;
+}
+
+Ref<MessagePackRPCCall> MessagePackRPCPool::async_callv_future(const String &p_method, const Array &p_params, uint64_t p_timeout_msec) {
+	Ref<MessagePackRPCCall> call = _queue_call(p_method, p_params, p_timeout_msec, false);
+	ERR_FAIL_COND_V_MSG(call.is_null(), call, "No connection of the pool could take the call.");
+	return call;
+}
+
+Error MessagePackRPCPool::notifyv(const String &p_method, const Array &p_params) {
+	// Not answered, so only retried when it can't be queued.
+	Error err = ERR_UNAVAILABLE;
+	for (int attempt = 0; attempt < max_attempts; attempt++) {
+		MessagePackRPC *rpc = nullptr;
+		{
+			MutexLock lock(mutex);
+			int idx = _pick_connection();
+			if (idx < 0) {
+				break;
+			}
+			rpc = connections[idx].rpc;
+		}
+		err = rpc->notifyv(p_method, p_params);
+		if (err == OK || err == ERR_BUSY || rpc->is_rpc_connected()) {
+			return err;
+		}
+	}
+	ERR_FAIL_V_MSG(err, "No connection of the pool could take the notification.");
+}
+
+void MessagePackRPCPool::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("add_endpoint", "host", "port", "connections"), &MessagePackRPCPool::add_endpoint, DEFVAL(1));
+	ClassDB::bind_method(D_METHOD("poll"), &MessagePackRPCPool::poll);
+	ClassDB::bind_method(D_METHOD("close"), &MessagePackRPCPool::close);
+
+	ClassDB::bind_method(D_METHOD("get_connections"), &MessagePackRPCPool::get_connections);
+	ClassDB::bind_method(D_METHOD("get_connection_count"), &MessagePackRPCPool::get_connection_count);
+	ClassDB::bind_method(D_METHOD("get_connected_count"), &MessagePackRPCPool::get_connected_count);
+
+	ClassDB::bind_method(D_METHOD("set_balance_mode", "mode"), &MessagePackRPCPool::set_balance_mode);
+	ClassDB::bind_method(D_METHOD("get_balance_mode"), &MessagePackRPCPool::get_balance_mode);
+	ClassDB::bind_method(D_METHOD("set_max_attempts", "attempts"), &MessagePackRPCPool::set_max_attempts);
+	ClassDB::bind_method(D_METHOD("get_max_attempts"), &MessagePackRPCPool::get_max_attempts);
+	ClassDB::bind_method(D_METHOD("set_reconnect_interval_msec", "msec"), &MessagePackRPCPool::set_reconnect_interval_msec);
+	ClassDB::bind_method(D_METHOD("get_reconnect_interval_msec"), &MessagePackRPCPool::get_reconnect_interval_msec);
+
+	ClassDB::bind_method(D_METHOD("sync_callv", "method", "timeout_msec", "params"), &MessagePackRPCPool::sync_callv, DEFVAL(100), DEFVAL(Array()));
+	ClassDB::bind_method(D_METHOD("async_callv", "method", "params"), &MessagePackRPCPool::async_callv, DEFVAL(Array()));
+	ClassDB::bind_method(D_METHOD("async_callv_future", "method", "params", "timeout_msec"), &MessagePackRPCPool::async_callv_future, DEFVAL(Array()), DEFVAL(0));
+	ClassDB::bind_method(D_METHOD("notifyv", "method", "params"), &MessagePackRPCPool::notifyv, DEFVAL(Array()));
+
+	ClassDB::bind_method(D_METHOD("_call_completed", "result", "error", "id"), &MessagePackRPCPool::_call_completed);
+
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "balance_mode", PROPERTY_HINT_ENUM, "Round Robin,Least Pending"), "set_balance_mode", "get_balance_mode");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "max_attempts", PROPERTY_HINT_RANGE, "1,16,1,or_greater"), "set_max_attempts", "get_max_attempts");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "reconnect_interval_msec", PROPERTY_HINT_RANGE, "0,60000,1,or_greater,suffix:ms"), "set_reconnect_interval_msec", "get_reconnect_interval_msec");
+
+	ADD_SIGNAL(MethodInfo("response_received", PropertyInfo(Variant::INT, "msgid"), PropertyInfo(Variant::NIL, "error", PROPERTY_HINT_NONE, "", PROPERTY_USAGE_NIL_IS_VARIANT), PropertyInfo(Variant::NIL, "result", PROPERTY_HINT_NONE, "", PROPERTY_USAGE_NIL_IS_VARIANT)));
+
+	BIND_ENUM_CONSTANT(BALANCE_ROUND_ROBIN);
+	BIND_ENUM_CONSTANT(BALANCE_LEAST_PENDING);
+}
+
+MessagePackRPCPool::~MessagePackRPCPool() {
+	close();
+}
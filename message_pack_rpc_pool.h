@@ -0,0 +1,136 @@
+/*************************************************************************/
+/*  message_pack_rpc_pool.h                                              */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef MESSAGE_PACK_RPC_POOL_H
+#define MESSAGE_PACK_RPC_POOL_H
+
+#include "core/io/ip_address.h"
+#include "core/io/stream_peer_tcp.h"
+#include "core/object/object.h"
+#include "core/os/mutex.h"
+#include "core/templates/hash_map.h"
+#include "core/templates/local_vector.h"
+#include "core/variant/typed_array.h"
+
+#include "message_pack_rpc.h"
+#include "message_pack_rpc_call.h"
+
+// Most connections a pool keeps, over all its endpoints.
+#define _POOL_MAX_CONNECTIONS 256
+// Connections sent a call before it gives up, counting the first one.
+#define _POOL_MAX_ATTEMPTS 3
+#define _POOL_RECONNECT_INTERVAL_MSEC 1000
+
+// Connections to one or more endpoints used as a single client. Calls are
+// spread over the connections, and sent again on another one if theirs drops.
+class MessagePackRPCPool : public Object {
+	GDCLASS(MessagePackRPCPool, Object);
+
+public:
+	enum BalanceMode {
+		BALANCE_ROUND_ROBIN = 0,
+		BALANCE_LEAST_PENDING,
+	};
+
+private:
+	struct Connection {
+		MessagePackRPC *rpc = nullptr;
+		IPAddress ip;
+		int port = 0;
+		// Calls sent on this connection and not answered yet.
+		int pending = 0;
+		uint64_t next_connect_msec = 0;
+		// Reconnection in progress, handed to rpc once connected.
+		Ref<StreamPeerTCP> connecting;
+	};
+	// A call handed out by the pool, outlives the connections it's sent on.
+	struct PoolCall {
+		Ref<MessagePackRPCCall> call;
+		Ref<MessagePackRPCCall> inner;
+		String method;
+		Array params;
+		// 0 for no timeout.
+		uint64_t deadline_msec = 0;
+		int connection = -1;
+		int attempts = 0;
+		// Made by async_callv, answered through response_received.
+		bool by_signal = false;
+	};
+
+	// Guards connections and calls, the connections themselves are only
+	// added and removed on the main thread.
+	Mutex mutex;
+	LocalVector<Connection> connections;
+	uint32_t next_connection = 0;
+	HashMap<uint64_t, PoolCall> calls;
+	uint64_t next_call_id = 0;
+
+	BalanceMode balance_mode = BALANCE_ROUND_ROBIN;
+	int max_attempts = _POOL_MAX_ATTEMPTS;
+	int reconnect_interval_msec = _POOL_RECONNECT_INTERVAL_MSEC;
+	bool closing = false;
+
+	int _pick_connection();
+	Ref<MessagePackRPCCall> _queue_call(const String &p_method, const Array &p_params, uint64_t p_timeout_msec, bool p_by_signal);
+	bool _send_call(uint64_t p_id);
+	void _finish_call(uint64_t p_id, MessagePackRPCCall::Status p_status, const Variant &p_result, const Variant &p_error);
+
+protected:
+	static void _bind_methods();
+
+public:
+	Error add_endpoint(const String &p_host, int p_port, int p_connections = 1);
+	void poll();
+	void close();
+
+	TypedArray<MessagePackRPC> get_connections();
+	int get_connection_count();
+	int get_connected_count();
+
+	void set_balance_mode(BalanceMode p_mode);
+	BalanceMode get_balance_mode() const;
+	void set_max_attempts(int p_attempts);
+	int get_max_attempts() const;
+	void set_reconnect_interval_msec(int p_msec);
+	int get_reconnect_interval_msec() const;
+
+	Array sync_callv(const String &p_method, uint64_t p_timeout_msec = 100, const Array &p_params = Array());
+	Error async_callv(const String &p_method, const Array &p_params = Array());
+	Ref<MessagePackRPCCall> async_callv_future(const String &p_method, const Array &p_params = Array(), uint64_t p_timeout_msec = 0);
+	Error notifyv(const String &p_method, const Array &p_params = Array());
+
+	void _call_completed(const Variant &p_result, const Variant &p_error, uint64_t p_id);
+
+	~MessagePackRPCPool();
+};
+
+VARIANT_ENUM_CAST(MessagePackRPCPool::BalanceMode);
+
+#endif // MESSAGE_PACK_RPC_POOL_H
@@ -0,0 +1,120 @@
+/*************************************************************************/
+/*  message_pack_rpc_queue.h                                             */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef MESSAGE_PACK_RPC_QUEUE_H
+#define MESSAGE_PACK_RPC_QUEUE_H
+
+#include "core/os/memory.h"
+#include "core/typedefs.h"
+
+#include <atomic>
+
+// Bounded multi-producer single-consumer queue, all slots allocated up front.
+// Producers claim a slot with a single CAS (no lock, no allocation), publish the
+// value through the slot's sequence number, and the consumer takes the published
+// values in order without ever touching the producers' counter.
+template <class T>
+class MessagePackRPCQueue {
+	struct Cell {
+		std::atomic<uint32_t> sequence;
+		T data;
+	};
+
+	Cell *cells = nullptr;
+	uint32_t mask = 0;
+
+	// Separate cache lines, producers and the consumer don't share a counter.
+	alignas(64) std::atomic<uint32_t> enqueue_pos;
+	alignas(64) std::atomic<uint32_t> dequeue_pos;
+
+public:
+	// Returns false when the queue is full.
+	bool push(const T &p_val) {
+		uint32_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		while (true) {
+			Cell &cell = cells[pos & mask];
+			uint32_t seq = cell.sequence.load(std::memory_order_acquire);
+			int32_t diff = int32_t(seq - pos);
+			if (diff == 0) {
+				// Slot free, claim it.
+				if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.data = p_val;
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				// The consumer didn't release this slot yet.
+				return false;
+			} else {
+				// Another producer claimed it first.
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Consumer only.
+	bool pop(T &r_val) {
+		uint32_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		Cell &cell = cells[pos & mask];
+		if (int32_t(cell.sequence.load(std::memory_order_acquire) - (pos + 1)) < 0) {
+			// Empty, or the next value is not published yet.
+			return false;
+		}
+		r_val = cell.data;
+		cell.data = T();
+		cell.sequence.store(pos + mask + 1, std::memory_order_release);
+		dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Consumer only, drops every published value.
+	void clear() {
+		T val;
+		while (pop(val)) {
+		}
+	}
+
+	explicit MessagePackRPCQueue(uint32_t p_capacity) {
+		uint32_t capacity = next_power_of_2(MAX(p_capacity, 2u));
+		mask = capacity - 1;
+		cells = memnew_arr(Cell, capacity);
+		for (uint32_t i = 0; i < capacity; i++) {
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		enqueue_pos.store(0, std::memory_order_relaxed);
+		dequeue_pos.store(0, std::memory_order_relaxed);
+	}
+
+	~MessagePackRPCQueue() {
+		memdelete_arr(cells);
+	}
+};
+
+#endif // MESSAGE_PACK_RPC_QUEUE_H
@@ -0,0 +1,535 @@
+/*************************************************************************/
+/*  message_pack_rpc_server.cpp                                          */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "message_pack_rpc_server.h"
+#include "core/object/class_db.h"
+
+#ifdef UNIX_ENABLED
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+void MessagePackRPCServer::_loop_func(void *p_user_data) {
+	IOLoop *loop = (IOLoop *)p_user_data;
+	MessagePackRPCServer *server = loop->server;
+	bool accepts = loop == server->loops[0];
+	uint64_t idle_usec = 0;
+	while (server->running) {
+		bool active = accepts && server->_accept_peers();
+		{
+			std::lock_guard<std::mutex> lock(loop->peers_mutex);
+			for (uint32_t i = 0; i < loop->peers.size();) {
+				MessagePackRPC *peer = loop->peers[i];
+				if (peer->_io_step()) {
+					active = true;
+				}
+				if (!peer->connected) {
+					peer->_connection_lost();
+					loop->peers.remove_at_unordered(i);
+					server->call_deferred(SNAME("_peer_closed"), uint64_t(peer->get_instance_id()));
+					continue;
+				}
+				i++;
+			}
+		}
+		if (active) {
+			// Busy, go around again right away.
+			idle_usec = 0;
+			continue;
+		}
+		if (server->_poll_loop(loop, accepts)) {
+			idle_usec = 0;
+			continue;
+		}
+		// Some peer has no socket to poll, sleep a little longer each idle pass.
+		idle_usec = CLAMP(idle_usec * 2, uint64_t(_SERVER_IDLE_MIN_USEC), uint64_t(_SERVER_IDLE_MAX_USEC));
+		{
+			std::unique_lock<std::mutex> lock(loop->wake_mutex);
+			loop->wake_cond.wait_for(lock, std::chrono::microseconds(idle_usec), [loop] { return loop->woken; });
+		}
+		server->_clear_woken(loop);
+	}
+}
+
+bool MessagePackRPCServer::_poll_loop(IOLoop *p_loop, bool p_accepts) {
+	// Blocks in one poll() over the waker, the listener and every peer's socket,
+	// until one of them is ready or the next call timeout is due. False without
+	// waiting if any of them has no socket.
+#ifdef UNIX_ENABLED
+	if (p_loop->wake_pipe[0] < 0 || (p_accepts && tcp_server->is_listening())) {
+		return false;
+	}
+	LocalVector<struct pollfd> fds;
+	fds.push_back({ p_loop->wake_pipe[0], POLLIN, 0 });
+	if (p_accepts && listener.is_listening()) {
+		fds.push_back({ listener.get_fd(), POLLIN, 0 });
+	}
+	int timeout_msec = _IO_WAIT_TIMEOUT_MSEC;
+	{
+		std::lock_guard<std::mutex> lock(p_loop->peers_mutex);
+		for (MessagePackRPC *peer : p_loop->peers) {
+			int fd = peer->transport->get_fd();
+			if (fd < 0) {
+				return false;
+			}
+			fds.push_back({ fd, short(peer->_has_pending_output() ? POLLIN | POLLOUT : POLLIN), 0 });
+			timeout_msec = MIN(timeout_msec, peer->_get_call_wheel_wait_msec());
+		}
+	}
+	// A peer closed and freed meanwhile leaves a stale descriptor, at worst a spurious wake up.
+	::poll(fds.ptr(), fds.size(), timeout_msec);
+	_clear_woken(p_loop);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void MessagePackRPCServer::_clear_woken(IOLoop *p_loop) {
+	std::lock_guard<std::mutex> lock(p_loop->wake_mutex);
+	if (!p_loop->woken) {
+		return;
+	}
+	p_loop->woken = false;
+#ifdef UNIX_ENABLED
+	if (p_loop->wake_pipe[0] >= 0) {
+		uint8_t byte;
+		while (::read(p_loop->wake_pipe[0], &byte, 1) > 0) {
+		}
+	}
+#endif
+}
+
+Ref<MessagePackRPCTransport> MessagePackRPCServer::_take_connection() {
+	{
+		std::lock_guard<std::mutex> lock(adopted_mutex);
+		if (!adopted.is_empty()) {
+			Ref<MessagePackRPCTransport> conn = adopted[adopted.size() - 1];
+			adopted.resize(adopted.size() - 1);
+			return conn;
+		}
+	}
+	if (listener.is_listening()) {
+		return listener.take_connection();
+	}
+	if (!tcp_server->is_listening() || !tcp_server->is_connection_available()) {
+		return Ref<MessagePackRPCTransport>();
+	}
+	Ref<StreamPeerTCP> conn = tcp_server->take_connection();
+	if (conn.is_null()) {
+		return Ref<MessagePackRPCTransport>();
+	}
+	return memnew(MessagePackRPCTransportTCP(conn));
+}
+
+bool MessagePackRPCServer::_accept_peers() {
+	bool accepted = false;
+	while (true) {
+		Ref<MessagePackRPCTransport> conn = _take_connection();
+		if (conn.is_null()) {
+			break;
+		}
+		MessagePackRPC *peer = memnew(MessagePackRPC(conn));
+		peer->server = this;
+		peer->server_loop = next_loop;
+		next_loop = (next_loop + 1) % loops.size();
+		peer->_start_io();
+		{
+			std::lock_guard<std::mutex> lock(all_peers_mutex);
+			all_peers.push_back(peer);
+		}
+		// Deferred before the loop can report a disconnection, so the signals come in order.
+		call_deferred(SNAME("_peer_connected"), uint64_t(peer->get_instance_id()));
+
+		IOLoop *loop = loops[peer->server_loop];
+		{
+			std::lock_guard<std::mutex> lock(loop->peers_mutex);
+			loop->peers.push_back(peer);
+		}
+		_wake_loop(peer->server_loop);
+		accepted = true;
+	}
+	return accepted;
+}
+
+void MessagePackRPCServer::_wake_loop(int p_loop) {
+	if (p_loop >= int(loops.size())) {
+		return; // Stopped
+	}
+	IOLoop *loop = loops[p_loop];
+	{
+		std::lock_guard<std::mutex> lock(loop->wake_mutex);
+		if (loop->woken) {
+			return; // Not cleared by the loop yet.
+		}
+		loop->woken = true;
+#ifdef UNIX_ENABLED
+		if (loop->wake_pipe[1] >= 0) {
+			uint8_t byte = 1;
+			(void)::write(loop->wake_pipe[1], &byte, 1);
+		}
+#endif
+	}
+	loop->wake_cond.notify_one();
+}
+
+bool MessagePackRPCServer::_detach_peer(MessagePackRPC *p_peer) {
+	if (p_peer->server_loop >= int(loops.size())) {
+		return false; // Stopped
+	}
+	IOLoop *loop = loops[p_peer->server_loop];
+	std::lock_guard<std::mutex> lock(loop->peers_mutex);
+	int64_t idx = loop->peers.find(p_peer);
+	if (idx < 0) {
+		return false;
+	}
+	loop->peers.remove_at_unordered(idx);
+	return true;
+}
+
+void MessagePackRPCServer::_forget_peer(MessagePackRPC *p_peer) {
+	std::lock_guard<std::mutex> lock(all_peers_mutex);
+	int64_t idx = all_peers.find(p_peer);
+	if (idx >= 0) {
+		all_peers.remove_at_unordered(idx);
+	}
+}
+
+bool MessagePackRPCServer::_dispatch_request(MessagePackRPC *p_peer, const Array &p_msg) {
+	// Request [type, msgid, method, params]
+	MessagePackRPC::Handler *handler = request_map.getptr(p_msg[2]);
+	if (handler) {
+		Array args;
+		args.push_back(p_peer);
+		args.append_array(p_msg.slice(1));
+		handler->callable.callv(args);
+		return true;
+	}
+	emit_signal(SNAME("request_received"), p_peer, p_msg[1], p_msg[2], p_msg[3]);
+	return false;
+}
+
+bool MessagePackRPCServer::_dispatch_notification(MessagePackRPC *p_peer, const Array &p_msg) {
+	// Notification [type, method, params]
+	MessagePackRPC::Handler *handler = notify_map.getptr(p_msg[1]);
+	if (handler) {
+		Array args;
+		args.push_back(p_peer);
+		args.append_array(p_msg.slice(1));
+		handler->callable.callv(args);
+		return true;
+	}
+	emit_signal(SNAME("notification_received"), p_peer, p_msg[1], p_msg[2]);
+	return false;
+}
+
+void MessagePackRPCServer::_intern_method(const StringName &p_method) {
+	// Call with handlers_mutex locked.
+	if (!method_ids.has(p_method)) {
+		method_ids[p_method] = method_names.size();
+		method_names.push_back(p_method);
+	}
+}
+
+StringName MessagePackRPCServer::_get_method_name(int64_t p_id) {
+	MutexLock lock(handlers_mutex);
+	if (p_id < 0 || p_id >= int64_t(method_names.size())) {
+		return StringName();
+	}
+	return method_names[p_id];
+}
+
+Array MessagePackRPCServer::_get_method_names() {
+	MutexLock lock(handlers_mutex);
+	Array names;
+	for (const StringName &name : method_names) {
+		names.push_back(String(name));
+	}
+	return names;
+}
+
+bool MessagePackRPCServer::_get_threaded_handler(bool p_request, const StringName &p_method, Callable &r_callable) {
+	MutexLock lock(handlers_mutex);
+	const MessagePackRPC::Handler *handler = p_request ? request_map.getptr(p_method) : notify_map.getptr(p_method);
+	if (!handler || !handler->threaded) {
+		return false;
+	}
+	r_callable = handler->callable;
+	return true;
+}
+
+Error MessagePackRPCServer::listen(uint16_t p_port, const IPAddress &p_bind_address) {
+	ERR_FAIL_COND_V_MSG(running, ERR_ALREADY_IN_USE, "Server is already listening.");
+#ifdef UNIX_ENABLED
+	// A socket of our own, which the I/O loops can poll with the peers'.
+	Error err = listener.listen_tcp(p_port, p_bind_address);
+#else
+	Error err = tcp_server->listen(p_port, p_bind_address);
+#endif
+	if (err != OK) {
+		return err;
+	}
+	_start_loops();
+	return OK;
+}
+
+Error MessagePackRPCServer::listen_path(const String &p_path) {
+	ERR_FAIL_COND_V_MSG(running, ERR_ALREADY_IN_USE, "Server is already listening.");
+	Error err = listener.listen_path(p_path);
+	if (err != OK) {
+		return err;
+	}
+	_start_loops();
+	return OK;
+}
+
+Error MessagePackRPCServer::takeover_transport(const Ref<MessagePackRPCTransport> &p_transport) {
+	ERR_FAIL_COND_V_MSG(p_transport.is_null(), ERR_INVALID_PARAMETER, "Transport invalid.");
+	p_transport->poll();
+	ERR_FAIL_COND_V_MSG(!p_transport->is_open(), ERR_CONNECTION_ERROR, "Not connected.");
+	if (!running) {
+		// Serves handed over transports only.
+		_start_loops();
+	}
+	{
+		std::lock_guard<std::mutex> lock(adopted_mutex);
+		adopted.push_back(p_transport);
+	}
+	_wake_loop(0);
+	return OK;
+}
+
+void MessagePackRPCServer::_start_loops() {
+	running = true;
+	next_loop = 0;
+	for (int i = 0; i < loop_count; i++) {
+		IOLoop *loop = memnew(IOLoop);
+		loop->server = this;
+#ifdef UNIX_ENABLED
+		if (pipe(loop->wake_pipe) == 0) {
+			for (int fd : loop->wake_pipe) {
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+			}
+		} else {
+			// Loops without a waker fall back to sleeping.
+			loop->wake_pipe[0] = -1;
+			loop->wake_pipe[1] = -1;
+		}
+#endif
+		loops.push_back(loop);
+	}
+	for (IOLoop *loop : loops) {
+		loop->thread.start(_loop_func, loop);
+	}
+}
+
+bool MessagePackRPCServer::is_listening() const {
+	return running;
+}
+
+void MessagePackRPCServer::stop() {
+	if (!running) {
+		return;
+	}
+	running = false;
+	for (uint32_t i = 0; i < loops.size(); i++) {
+		_wake_loop(i);
+		loops[i]->thread.wait_to_finish();
+	}
+	for (IOLoop *loop : loops) {
+		// Closed and freed below rather than reported by the loops.
+		std::lock_guard<std::mutex> lock(loop->peers_mutex);
+		loop->peers.clear();
+	}
+	tcp_server->stop();
+	listener.stop();
+	{
+		std::lock_guard<std::mutex> lock(adopted_mutex);
+		for (Ref<MessagePackRPCTransport> &conn : adopted) {
+			conn->close();
+		}
+		adopted.clear();
+	}
+
+	LocalVector<MessagePackRPC *> peers;
+	{
+		std::lock_guard<std::mutex> lock(all_peers_mutex);
+		peers = all_peers;
+	}
+	for (MessagePackRPC *peer : peers) {
+		peer->close();
+		emit_signal(SNAME("peer_disconnected"), peer);
+		memdelete(peer);
+	}
+	// Only now, the peers' handler tasks were joined by close() and may wake their loop until then.
+	for (IOLoop *loop : loops) {
+#ifdef UNIX_ENABLED
+		for (int fd : loop->wake_pipe) {
+			if (fd >= 0) {
+				::close(fd);
+			}
+		}
+#endif
+		memdelete(loop);
+	}
+	loops.clear();
+}
+
+TypedArray<MessagePackRPC> MessagePackRPCServer::get_peers() {
+	std::lock_guard<std::mutex> lock(all_peers_mutex);
+	TypedArray<MessagePackRPC> peers;
+	for (MessagePackRPC *peer : all_peers) {
+		peers.push_back(peer);
+	}
+	return peers;
+}
+
+int MessagePackRPCServer::get_peer_count() {
+	std::lock_guard<std::mutex> lock(all_peers_mutex);
+	return all_peers.size();
+}
+
+void MessagePackRPCServer::disconnect_peer(Object *p_peer) {
+	MessagePackRPC *peer = Object::cast_to<MessagePackRPC>(p_peer);
+	ERR_FAIL_NULL_MSG(peer, "Not a MessagePackRPC peer.");
+	ERR_FAIL_COND_MSG(peer->server != this, "Peer doesn't belong to this server.");
+	// Freed by _peer_closed.
+	peer->close();
+}
+
+Error MessagePackRPCServer::register_request(const String &p_method, const Callable &p_callable, bool p_rewrite, bool p_threaded, int p_cache_ttl_msec, int p_cache_max_entries) {
+	ERR_FAIL_COND_V_MSG(p_cache_ttl_msec < 0 || p_cache_max_entries <= 0, ERR_INVALID_PARAMETER, "Invalid cache policy.");
+	MutexLock lock(handlers_mutex);
+	ERR_FAIL_COND_V_MSG((!p_rewrite && request_map.has(p_method)), ERR_ALREADY_EXISTS, "Request '" + p_method + "' already exist.");
+	MessagePackRPC::Handler handler;
+	handler.callable = p_callable;
+	handler.threaded = p_threaded;
+	request_map[p_method] = handler;
+	_intern_method(p_method);
+	if (p_cache_ttl_msec > 0) {
+		response_cache.set_policy(p_method, p_cache_ttl_msec, p_cache_max_entries);
+	} else {
+		response_cache.remove_policy(p_method);
+	}
+	return OK;
+}
+
+Error MessagePackRPCServer::unregister_request(const String &p_method) {
+	MutexLock lock(handlers_mutex);
+	ERR_FAIL_COND_V_MSG(!request_map.has(p_method), ERR_DOES_NOT_EXIST, "Request '" + p_method + "' is not registered.");
+	request_map.erase(p_method);
+	response_cache.remove_policy(p_method);
+	return OK;
+}
+
+Error MessagePackRPCServer::register_notification(const String &p_method, const Callable &p_callable, bool p_rewrite, bool p_threaded) {
+	MutexLock lock(handlers_mutex);
+	ERR_FAIL_COND_V_MSG((!p_rewrite && notify_map.has(p_method)), ERR_ALREADY_EXISTS, "Notify '" + p_method + "' already exist.");
+	MessagePackRPC::Handler handler;
+	handler.callable = p_callable;
+	handler.threaded = p_threaded;
+	notify_map[p_method] = handler;
+	_intern_method(p_method);
+	return OK;
+}
+
+Error MessagePackRPCServer::unregister_notification(const String &p_method) {
+	MutexLock lock(handlers_mutex);
+	ERR_FAIL_COND_V_MSG(!notify_map.has(p_method), ERR_DOES_NOT_EXIST, "Notify '" + p_method + "' is not registered.");
+	notify_map.erase(p_method);
+	return OK;
+}
+
+void MessagePackRPCServer::set_io_thread_count(int p_count) {
+	ERR_FAIL_COND_MSG(running, "Can't change the I/O thread count while listening.");
+	ERR_FAIL_COND(p_count < 1 || p_count > _SERVER_LOOP_MAX_COUNT);
+	loop_count = p_count;
+}
+
+int MessagePackRPCServer::get_io_thread_count() const {
+	return loop_count;
+}
+
+void MessagePackRPCServer::_peer_connected(uint64_t p_peer_id) {
+	MessagePackRPC *peer = Object::cast_to<MessagePackRPC>(ObjectDB::get_instance(ObjectID(p_peer_id)));
+	if (peer) {
+		emit_signal(SNAME("peer_connected"), peer);
+	}
+}
+
+void MessagePackRPCServer::_peer_closed(uint64_t p_peer_id) {
+	MessagePackRPC *peer = Object::cast_to<MessagePackRPC>(ObjectDB::get_instance(ObjectID(p_peer_id)));
+	if (!peer) {
+		return; // Freed already
+	}
+	peer->close();
+	emit_signal(SNAME("peer_disconnected"), peer);
+	memdelete(peer);
+}
+
+void MessagePackRPCServer::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("listen", "port", "bind_address"), &MessagePackRPCServer::listen, DEFVAL("*"));
+	ClassDB::bind_method(D_METHOD("listen_path", "path"), &MessagePackRPCServer::listen_path);
+	ClassDB::bind_method(D_METHOD("takeover_transport", "transport"), &MessagePackRPCServer::takeover_transport);
+	ClassDB::bind_method(D_METHOD("is_listening"), &MessagePackRPCServer::is_listening);
+	ClassDB::bind_method(D_METHOD("stop"), &MessagePackRPCServer::stop);
+
+	ClassDB::bind_method(D_METHOD("get_peers"), &MessagePackRPCServer::get_peers);
+	ClassDB::bind_method(D_METHOD("get_peer_count"), &MessagePackRPCServer::get_peer_count);
+	ClassDB::bind_method(D_METHOD("disconnect_peer", "peer"), &MessagePackRPCServer::disconnect_peer);
+
+	ClassDB::bind_method(D_METHOD("register_request", "method", "callable", "rewrite", "threaded", "cache_ttl_msec", "cache_max_entries"), &MessagePackRPCServer::register_request, DEFVAL(false), DEFVAL(false), DEFVAL(0), DEFVAL(_RPC_CACHE_MAX_ENTRIES));
+	ClassDB::bind_method(D_METHOD("unregister_request", "method"), &MessagePackRPCServer::unregister_request);
+	ClassDB::bind_method(D_METHOD("register_notification", "method", "callable", "rewrite", "threaded"), &MessagePackRPCServer::register_notification, DEFVAL(false), DEFVAL(false));
+	ClassDB::bind_method(D_METHOD("unregister_notification", "method"), &MessagePackRPCServer::unregister_notification);
+
+	ClassDB::bind_method(D_METHOD("set_io_thread_count", "count"), &MessagePackRPCServer::set_io_thread_count);
+	ClassDB::bind_method(D_METHOD("get_io_thread_count"), &MessagePackRPCServer::get_io_thread_count);
+
+	ClassDB::bind_method(D_METHOD("_peer_connected", "peer_id"), &MessagePackRPCServer::_peer_connected);
+	ClassDB::bind_method(D_METHOD("_peer_closed", "peer_id"), &MessagePackRPCServer::_peer_closed);
+
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "io_thread_count", PROPERTY_HINT_RANGE, "1,64,1"), "set_io_thread_count", "get_io_thread_count");
+
+	ADD_SIGNAL(MethodInfo("peer_connected", PropertyInfo(Variant::OBJECT, "peer", PROPERTY_HINT_RESOURCE_TYPE, "MessagePackRPC")));
+	ADD_SIGNAL(MethodInfo("peer_disconnected", PropertyInfo(Variant::OBJECT, "peer", PROPERTY_HINT_RESOURCE_TYPE, "MessagePackRPC")));
+	ADD_SIGNAL(MethodInfo("request_received", PropertyInfo(Variant::OBJECT, "peer", PROPERTY_HINT_RESOURCE_TYPE, "MessagePackRPC"), PropertyInfo(Variant::INT, "msgid"), PropertyInfo(Variant::STRING, "method"), PropertyInfo(Variant::ARRAY, "params")));
+	ADD_SIGNAL(MethodInfo("notification_received", PropertyInfo(Variant::OBJECT, "peer", PROPERTY_HINT_RESOURCE_TYPE, "MessagePackRPC"), PropertyInfo(Variant::STRING, "method"), PropertyInfo(Variant::ARRAY, "params")));
+}
+
+MessagePackRPCServer::MessagePackRPCServer() {
+	tcp_server.instantiate();
+}
+
+MessagePackRPCServer::~MessagePackRPCServer() {
+	stop();
+}
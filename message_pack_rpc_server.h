@@ -0,0 +1,144 @@
+/*************************************************************************/
+/*  message_pack_rpc_server.h                                            */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef MESSAGE_PACK_RPC_SERVER_H
+#define MESSAGE_PACK_RPC_SERVER_H
+
+#include "core/io/tcp_server.h"
+#include "core/object/object.h"
+#include "core/os/thread.h"
+#include "core/templates/hash_map.h"
+#include "core/templates/local_vector.h"
+
+#include "message_pack_rpc.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+// Max I/O loops (threads) a server may run
+#define _SERVER_LOOP_MAX_COUNT 64
+// An idle loop whose peers can't all be polled sleeps twice as long each pass,
+// from min to max, until something happens.
+#define _SERVER_IDLE_MIN_USEC 50
+#define _SERVER_IDLE_MAX_USEC 10000
+
+class MessagePackRPCServer : public Object {
+	GDCLASS(MessagePackRPCServer, Object);
+
+	friend class MessagePackRPC;
+
+	// One thread driving a share of the connections.
+	struct IOLoop {
+		Thread thread;
+		MessagePackRPCServer *server = nullptr;
+		// Guards peers, held for a whole pass over them.
+		std::mutex peers_mutex;
+		LocalVector<MessagePackRPC *> peers;
+		// Shared waker, posted when a peer of this loop queues a message. The
+		// pipe wakes a loop blocked polling its sockets, it holds a byte while woken.
+		std::mutex wake_mutex;
+		std::condition_variable wake_cond;
+		bool woken = false;
+		int wake_pipe[2] = { -1, -1 };
+	};
+
+	// Not used on Unix platforms, where the listener takes TCP connections too.
+	Ref<TCPServer> tcp_server;
+	MessagePackRPCListener listener;
+	// Transports handed over by takeover_transport, accepted by the first loop.
+	std::mutex adopted_mutex;
+	LocalVector<Ref<MessagePackRPCTransport>> adopted;
+	LocalVector<IOLoop *> loops;
+	int loop_count = 1;
+	uint32_t next_loop = 0;
+	std::atomic<bool> running{ false };
+
+	// Every accepted peer not freed yet.
+	std::mutex all_peers_mutex;
+	LocalVector<MessagePackRPC *> all_peers;
+
+	// Handlers shared by all peers, written on the main thread, looked up by the
+	// I/O threads under handlers_mutex.
+	Mutex handlers_mutex;
+	HashMap<StringName, MessagePackRPC::Handler> request_map;
+	HashMap<StringName, MessagePackRPC::Handler> notify_map;
+	// Method ids peers may send instead of names, append only.
+	LocalVector<StringName> method_names;
+	HashMap<StringName, int> method_ids;
+	// Responses of the methods registered with a cache_ttl_msec, shared by all peers.
+	MessagePackRPCCache response_cache;
+
+	static void _loop_func(void *p_user_data);
+	bool _poll_loop(IOLoop *p_loop, bool p_accepts);
+	void _clear_woken(IOLoop *p_loop);
+	void _start_loops();
+	Ref<MessagePackRPCTransport> _take_connection();
+	bool _accept_peers();
+	void _wake_loop(int p_loop);
+	bool _detach_peer(MessagePackRPC *p_peer);
+	void _forget_peer(MessagePackRPC *p_peer);
+	bool _dispatch_request(MessagePackRPC *p_peer, const Array &p_msg);
+	bool _dispatch_notification(MessagePackRPC *p_peer, const Array &p_msg);
+	bool _get_threaded_handler(bool p_request, const StringName &p_method, Callable &r_callable);
+	void _intern_method(const StringName &p_method);
+	StringName _get_method_name(int64_t p_id);
+	Array _get_method_names();
+
+protected:
+	static void _bind_methods();
+
+public:
+	Error listen(uint16_t p_port, const IPAddress &p_bind_address = IPAddress("*"));
+	Error listen_path(const String &p_path);
+	Error takeover_transport(const Ref<MessagePackRPCTransport> &p_transport);
+	bool is_listening() const;
+	void stop();
+
+	TypedArray<MessagePackRPC> get_peers();
+	int get_peer_count();
+	void disconnect_peer(Object *p_peer);
+
+	Error register_request(const String &p_method, const Callable &p_callable, bool p_rewrite = false, bool p_threaded = false, int p_cache_ttl_msec = 0, int p_cache_max_entries = _RPC_CACHE_MAX_ENTRIES);
+	Error unregister_request(const String &p_method);
+	Error register_notification(const String &p_method, const Callable &p_callable, bool p_rewrite = false, bool p_threaded = false);
+	Error unregister_notification(const String &p_method);
+
+	void set_io_thread_count(int p_count);
+	int get_io_thread_count() const;
+
+	void _peer_connected(uint64_t p_peer_id);
+	void _peer_closed(uint64_t p_peer_id);
+
+	MessagePackRPCServer();
+	~MessagePackRPCServer();
+};
+
+#endif // MESSAGE_PACK_RPC_SERVER_H
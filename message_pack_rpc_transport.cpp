@@ -0,0 +1,841 @@
+/*************************************************************************/
+/*  message_pack_rpc_transport.cpp                                       */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "message_pack_rpc_transport.h"
+#include "core/object/class_db.h"
+#include "core/os/os.h"
+
+#ifdef UNIX_ENABLED
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef MSG_NOSIGNAL
+#define _RPC_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define _RPC_SEND_FLAGS 0
+#endif
+#endif
+
+// How long connect_to_host waits for the TCP handshake.
+#define _RPC_TCP_CONNECT_TIMEOUT_MSEC 3000
+
+void MessagePackRPCTransport::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("is_open"), &MessagePackRPCTransport::is_open);
+	ClassDB::bind_method(D_METHOD("close"), &MessagePackRPCTransport::close);
+	ClassDB::bind_method(D_METHOD("is_direct"), &MessagePackRPCTransport::is_direct);
+	ClassDB::bind_method(D_METHOD("get_peer_host"), &MessagePackRPCTransport::get_peer_host);
+	ClassDB::bind_method(D_METHOD("get_peer_port"), &MessagePackRPCTransport::get_peer_port);
+}
+
+// Socket
+
+#ifdef UNIX_ENABLED
+static void _set_socket_options(int p_fd) {
+	fcntl(p_fd, F_SETFL, fcntl(p_fd, F_GETFL, 0) | O_NONBLOCK);
+	fcntl(p_fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+	setsockopt(p_fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+static bool _make_unix_address(const String &p_path, struct sockaddr_un &r_addr) {
+	CharString path = p_path.utf8();
+	if (path.length() == 0 || path.length() >= int(sizeof(r_addr.sun_path))) {
+		return false;
+	}
+	memset(&r_addr, 0, sizeof(r_addr));
+	r_addr.sun_family = AF_UNIX;
+	memcpy(r_addr.sun_path, path.get_data(), path.length());
+	return true;
+}
+
+static socklen_t _make_ip_address(const IPAddress &p_ip, uint16_t p_port, struct sockaddr_storage &r_addr) {
+	memset(&r_addr, 0, sizeof(r_addr));
+	if (p_ip.is_ipv4()) {
+		struct sockaddr_in *addr = (struct sockaddr_in *)&r_addr;
+		addr->sin_family = AF_INET;
+		addr->sin_port = htons(p_port);
+		memcpy(&addr->sin_addr.s_addr, p_ip.get_ipv4(), 4);
+		return sizeof(struct sockaddr_in);
+	}
+	// IPv6, the wildcard address included.
+	struct sockaddr_in6 *addr = (struct sockaddr_in6 *)&r_addr;
+	addr->sin6_family = AF_INET6;
+	addr->sin6_port = htons(p_port);
+	memcpy(addr->sin6_addr.s6_addr, p_ip.get_ipv6(), 16);
+	return sizeof(struct sockaddr_in6);
+}
+
+static void _read_ip_address(const struct sockaddr_storage &p_addr, IPAddress &r_ip, int &r_port) {
+	if (p_addr.ss_family == AF_INET) {
+		const struct sockaddr_in *addr = (const struct sockaddr_in *)&p_addr;
+		r_ip.set_ipv4((const uint8_t *)&addr->sin_addr.s_addr);
+		r_port = ntohs(addr->sin_port);
+	} else if (p_addr.ss_family == AF_INET6) {
+		const struct sockaddr_in6 *addr = (const struct sockaddr_in6 *)&p_addr;
+		r_ip.set_ipv6(addr->sin6_addr.s6_addr);
+		r_port = ntohs(addr->sin6_port);
+	}
+}
+#endif
+
+void MessagePackRPCSocket::set_fd(int p_fd) {
+	release();
+	fd = p_fd;
+	closed = false;
+}
+
+int MessagePackRPCSocket::get_fd() const {
+	return is_open() ? fd : -1;
+}
+
+bool MessagePackRPCSocket::is_valid() const {
+	return fd >= 0;
+}
+
+bool MessagePackRPCSocket::is_open() const {
+	return fd >= 0 && !closed;
+}
+
+void MessagePackRPCSocket::poll() {
+#ifdef UNIX_ENABLED
+	// A readable socket with nothing to read was closed by the peer.
+	if (!is_open()) {
+		return;
+	}
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	if (::poll(&pfd, 1, 0) > 0 && get_available_bytes() == 0) {
+		close();
+	}
+#endif
+}
+
+int MessagePackRPCSocket::get_available_bytes() const {
+#ifdef UNIX_ENABLED
+	int available = 0;
+	if (!is_open() || ioctl(fd, FIONREAD, &available) != 0) {
+		return 0;
+	}
+	return available;
+#else
+	return 0;
+#endif
+}
+
+Error MessagePackRPCSocket::get_partial_data(uint8_t *r_buffer, int p_bytes, int &r_received) {
+	r_received = 0;
+#ifdef UNIX_ENABLED
+	if (!is_open()) {
+		return ERR_UNAVAILABLE;
+	}
+	ssize_t ret = ::recv(fd, r_buffer, p_bytes, 0);
+	if (ret > 0) {
+		r_received = ret;
+		return OK;
+	}
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return OK;
+	}
+	close();
+	return ret == 0 ? ERR_FILE_EOF : ERR_CONNECTION_ERROR;
+#else
+	return ERR_UNAVAILABLE;
+#endif
+}
+
+Error MessagePackRPCSocket::put_partial_data(const uint8_t *p_data, int p_bytes, int &r_sent) {
+	r_sent = 0;
+#ifdef UNIX_ENABLED
+	if (!is_open()) {
+		return ERR_UNAVAILABLE;
+	}
+	ssize_t ret = ::send(fd, p_data, p_bytes, _RPC_SEND_FLAGS);
+	if (ret >= 0) {
+		r_sent = ret;
+		return OK;
+	}
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+		return OK;
+	}
+	close();
+	return ERR_CONNECTION_ERROR;
+#else
+	return ERR_UNAVAILABLE;
+#endif
+}
+
+Error MessagePackRPCSocket::wait(NetSocket::PollType p_type, int p_timeout_msec) {
+#ifdef UNIX_ENABLED
+	if (!is_open()) {
+		return ERR_UNAVAILABLE;
+	}
+	struct pollfd pfds[2] = { { fd, short(p_type == NetSocket::POLL_TYPE_OUT ? POLLOUT : POLLIN), 0 }, { -1, POLLIN, 0 } };
+	if (p_type == NetSocket::POLL_TYPE_IN) {
+		{
+			std::lock_guard<std::mutex> lock(wake_mutex);
+			if (wake_pipe[0] < 0 && pipe(wake_pipe) == 0) {
+				for (int wake_fd : wake_pipe) {
+					fcntl(wake_fd, F_SETFL, fcntl(wake_fd, F_GETFL, 0) | O_NONBLOCK);
+				}
+			}
+			pfds[1].fd = wake_pipe[0];
+		}
+		// An interrupt() from before the pipe existed only left the flag.
+		if (interrupted.load()) {
+			_clear_interrupt();
+			return ERR_BUSY;
+		}
+	}
+	int ret = ::poll(pfds, pfds[1].fd >= 0 ? 2 : 1, p_timeout_msec);
+	if (ret < 0) {
+		return errno == EINTR ? ERR_BUSY : FAILED;
+	}
+	if (pfds[1].revents) {
+		_clear_interrupt();
+	}
+	// Hang ups count as ready, the next read or write finds out.
+	return pfds[0].revents ? OK : ERR_BUSY;
+#else
+	return ERR_UNAVAILABLE;
+#endif
+}
+
+void MessagePackRPCSocket::_clear_interrupt() {
+#ifdef UNIX_ENABLED
+	interrupted = false;
+	std::lock_guard<std::mutex> lock(wake_mutex);
+	if (wake_pipe[0] >= 0) {
+		uint8_t byte;
+		while (::read(wake_pipe[0], &byte, 1) > 0) {
+		}
+	}
+#endif
+}
+
+void MessagePackRPCSocket::interrupt() {
+#ifdef UNIX_ENABLED
+	// The flag first, a wait() making the pipe meanwhile checks it afterwards.
+	interrupted = true;
+	std::lock_guard<std::mutex> lock(wake_mutex);
+	if (wake_pipe[1] >= 0) {
+		uint8_t byte = 1;
+		(void)::write(wake_pipe[1], &byte, 1);
+	}
+#endif
+}
+
+void MessagePackRPCSocket::close() {
+#ifdef UNIX_ENABLED
+	if (fd >= 0 && !closed.exchange(true)) {
+		::shutdown(fd, SHUT_RDWR);
+	}
+#endif
+}
+
+void MessagePackRPCSocket::release() {
+#ifdef UNIX_ENABLED
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+	std::lock_guard<std::mutex> lock(wake_mutex);
+	for (int &wake_fd : wake_pipe) {
+		if (wake_fd >= 0) {
+			::close(wake_fd);
+			wake_fd = -1;
+		}
+	}
+#endif
+	interrupted = false;
+}
+
+MessagePackRPCSocket::~MessagePackRPCSocket() {
+	release();
+}
+
+// TCP
+
+Error MessagePackRPCTransportTCP::connect_to_host(const IPAddress &p_ip, int p_port) {
+#ifdef UNIX_ENABLED
+	// Over a socket of our own, see the class.
+	ERR_FAIL_COND_V_MSG(!p_ip.is_valid() || p_ip.is_wildcard(), ERR_INVALID_PARAMETER, "Invalid address.");
+	struct sockaddr_storage addr;
+	socklen_t addr_size = _make_ip_address(p_ip, p_port, addr);
+	int sock = ::socket(addr.ss_family, SOCK_STREAM, 0);
+	ERR_FAIL_COND_V_MSG(sock < 0, ERR_CANT_CREATE, "Can't create socket.");
+	_set_socket_options(sock);
+	if (::connect(sock, (struct sockaddr *)&addr, addr_size) != 0) {
+		if (errno != EINPROGRESS) {
+			::close(sock);
+			ERR_FAIL_V_MSG(FAILED, "MessagePackRPC: Unable to connect: " + String(strerror(errno)) + ".");
+		}
+		struct pollfd pfd = { sock, POLLOUT, 0 };
+		int err = 0;
+		socklen_t err_size = sizeof(err);
+		if (::poll(&pfd, 1, _RPC_TCP_CONNECT_TIMEOUT_MSEC) <= 0) {
+			err = ETIMEDOUT;
+		} else if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_size) != 0) {
+			err = errno;
+		}
+		if (err != 0) {
+			::close(sock);
+			ERR_FAIL_V_MSG(FAILED, "MessagePackRPC: Unable to connect: " + String(strerror(err)) + ".");
+		}
+	}
+	print_verbose("MessagePackRPC tcp peer Connected!");
+	_set_fd(sock, p_ip, p_port);
+	return OK;
+#else
+	const int tries = 6;
+	const int waits[tries] = { 1, 10, 100, 1000, 1000, 1000 };
+
+	Ref<StreamPeerTCP> tcp;
+	tcp.instantiate();
+	tcp->connect_to_host(p_ip, p_port);
+
+	for (int i = 0; i < tries; i++) {
+		tcp->poll();
+		if (tcp->get_status() == StreamPeerTCP::STATUS_CONNECTED) {
+			print_verbose("MessagePackRPC tcp peer Connected!");
+			break;
+		} else {
+			const int ms = waits[i];
+			OS::get_singleton()->delay_usec(ms * 1000);
+			print_verbose("MessagePackRPC tcp peer: Connection failed with status: '" +
+					String::num(tcp->get_status()) + "', retrying in " + String::num(ms) + " msec.");
+		}
+	}
+
+	if (tcp->get_status() != StreamPeerTCP::STATUS_CONNECTED) {
+		ERR_PRINT("MessagePackRPC: Unable to connect. Status: " + String::num(tcp->get_status()) + ".");
+		return FAILED;
+	}
+	set_stream(tcp);
+	return OK;
+#endif
+}
+
+void MessagePackRPCTransportTCP::_set_fd(int p_fd, const IPAddress &p_ip, int p_port) {
+	set_stream(Ref<StreamPeerTCP>());
+	socket.set_fd(p_fd);
+	peer_ip = p_ip;
+	peer_port = p_port;
+}
+
+void MessagePackRPCTransportTCP::set_stream(const Ref<StreamPeerTCP> &p_stream) {
+	if (p_stream.is_valid()) {
+		socket.release();
+	}
+	MutexLock lock(mutex);
+	stream = p_stream;
+	closing = false;
+}
+
+Ref<StreamPeerTCP> MessagePackRPCTransportTCP::get_stream() const {
+	return stream;
+}
+
+bool MessagePackRPCTransportTCP::_is_open() const {
+	return !closing && stream.is_valid() && stream->get_status() == StreamPeerTCP::STATUS_CONNECTED;
+}
+
+bool MessagePackRPCTransportTCP::is_open() const {
+	if (socket.is_valid()) {
+		return socket.is_open();
+	}
+	MutexLock lock(mutex);
+	return _is_open();
+}
+
+void MessagePackRPCTransportTCP::poll() {
+	if (socket.is_valid()) {
+		socket.poll();
+		return;
+	}
+	MutexLock lock(mutex);
+	if (_is_open()) {
+		stream->poll();
+	}
+}
+
+int MessagePackRPCTransportTCP::get_available_bytes() const {
+	if (socket.is_valid()) {
+		return socket.get_available_bytes();
+	}
+	MutexLock lock(mutex);
+	return _is_open() ? stream->get_available_bytes() : 0;
+}
+
+Error MessagePackRPCTransportTCP::get_partial_data(uint8_t *r_buffer, int p_bytes, int &r_received) {
+	if (socket.is_valid()) {
+		return socket.get_partial_data(r_buffer, p_bytes, r_received);
+	}
+	MutexLock lock(mutex);
+	if (!_is_open()) {
+		r_received = 0;
+		return ERR_UNAVAILABLE;
+	}
+	return stream->get_partial_data(r_buffer, p_bytes, r_received);
+}
+
+Error MessagePackRPCTransportTCP::put_partial_data(const uint8_t *p_data, int p_bytes, int &r_sent) {
+	if (socket.is_valid()) {
+		return socket.put_partial_data(p_data, p_bytes, r_sent);
+	}
+	MutexLock lock(mutex);
+	if (!_is_open()) {
+		r_sent = 0;
+		return ERR_UNAVAILABLE;
+	}
+	return stream->put_partial_data(p_data, p_bytes, r_sent);
+}
+
+Error MessagePackRPCTransportTCP::wait(NetSocket::PollType p_type, int p_timeout_msec) {
+	if (socket.is_valid()) {
+		return socket.wait(p_type, p_timeout_msec);
+	}
+	Ref<StreamPeerTCP> waited;
+	{
+		MutexLock lock(mutex);
+		if (!_is_open()) {
+			return ERR_UNAVAILABLE;
+		}
+		waited = stream;
+		waiting++;
+	}
+	Error err = waited->wait(p_type, p_timeout_msec);
+	MutexLock lock(mutex);
+	waiting--;
+	if (closing && waiting == 0) {
+		// close() was called meanwhile and left the disconnection to us.
+		waited->disconnect_from_host();
+	}
+	return err;
+}
+
+void MessagePackRPCTransportTCP::close() {
+	if (socket.is_valid()) {
+		socket.close();
+		return;
+	}
+	MutexLock lock(mutex);
+	if (stream.is_null()) {
+		return;
+	}
+	if (waiting > 0) {
+		closing = true;
+	} else {
+		stream->disconnect_from_host();
+	}
+}
+
+bool MessagePackRPCTransportTCP::can_interrupt() const {
+	// A StreamPeerTCP gives nothing to wake its wait() with.
+	return socket.is_valid();
+}
+
+void MessagePackRPCTransportTCP::interrupt() {
+	if (socket.is_valid()) {
+		socket.interrupt();
+	}
+}
+
+int MessagePackRPCTransportTCP::get_fd() const {
+	return socket.get_fd();
+}
+
+void MessagePackRPCTransportTCP::set_no_delay(bool p_enabled) {
+	if (socket.is_valid()) {
+#ifdef UNIX_ENABLED
+		int value = p_enabled ? 1 : 0;
+		setsockopt(socket.get_fd(), IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+#endif
+		return;
+	}
+	MutexLock lock(mutex);
+	if (_is_open()) {
+		stream->set_no_delay(p_enabled);
+	}
+}
+
+String MessagePackRPCTransportTCP::get_peer_host() const {
+	if (socket.is_valid()) {
+		return String(peer_ip);
+	}
+	MutexLock lock(mutex);
+	return stream.is_valid() ? String(stream->get_connected_host()) : String();
+}
+
+int MessagePackRPCTransportTCP::get_peer_port() const {
+	if (socket.is_valid()) {
+		return peer_port;
+	}
+	MutexLock lock(mutex);
+	return stream.is_valid() ? stream->get_connected_port() : 0;
+}
+
+void MessagePackRPCTransportTCP::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("connect_to_host", "ip", "port"), &MessagePackRPCTransportTCP::connect_to_host);
+	ClassDB::bind_method(D_METHOD("set_stream", "stream"), &MessagePackRPCTransportTCP::set_stream);
+	ClassDB::bind_method(D_METHOD("get_stream"), &MessagePackRPCTransportTCP::get_stream);
+
+	ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "stream", PROPERTY_HINT_RESOURCE_TYPE, "StreamPeerTCP", PROPERTY_USAGE_NONE), "set_stream", "get_stream");
+}
+
+MessagePackRPCTransportTCP::MessagePackRPCTransportTCP(const Ref<StreamPeerTCP> &p_stream) {
+	stream = p_stream;
+}
+
+// Unix domain socket
+
+void MessagePackRPCTransportUnix::_set_fd(int p_fd, const String &p_path) {
+	socket.set_fd(p_fd);
+	path = p_path;
+}
+
+Error MessagePackRPCTransportUnix::connect_to_path(const String &p_path) {
+#ifdef UNIX_ENABLED
+	struct sockaddr_un addr;
+	ERR_FAIL_COND_V_MSG(!_make_unix_address(p_path, addr), ERR_INVALID_PARAMETER, "Invalid socket path: '" + p_path + "'.");
+	int sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	ERR_FAIL_COND_V_MSG(sock < 0, ERR_CANT_CREATE, "Can't create socket.");
+	// Local connects complete or fail right away, no need to retry like TCP.
+	if (::connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		::close(sock);
+		ERR_FAIL_V_MSG(ERR_CANT_CONNECT, "Can't connect to '" + p_path + "': " + String(strerror(errno)) + ".");
+	}
+	_set_socket_options(sock);
+	_set_fd(sock, p_path);
+	return OK;
+#else
+	ERR_FAIL_V_MSG(ERR_UNAVAILABLE, "Unix domain sockets are not available on this platform.");
+#endif
+}
+
+String MessagePackRPCTransportUnix::get_path() const {
+	return path;
+}
+
+bool MessagePackRPCTransportUnix::is_open() const {
+	return socket.is_open();
+}
+
+void MessagePackRPCTransportUnix::poll() {
+	socket.poll();
+}
+
+int MessagePackRPCTransportUnix::get_available_bytes() const {
+	return socket.get_available_bytes();
+}
+
+Error MessagePackRPCTransportUnix::get_partial_data(uint8_t *r_buffer, int p_bytes, int &r_received) {
+	return socket.get_partial_data(r_buffer, p_bytes, r_received);
+}
+
+Error MessagePackRPCTransportUnix::put_partial_data(const uint8_t *p_data, int p_bytes, int &r_sent) {
+	return socket.put_partial_data(p_data, p_bytes, r_sent);
+}
+
+Error MessagePackRPCTransportUnix::wait(NetSocket::PollType p_type, int p_timeout_msec) {
+	return socket.wait(p_type, p_timeout_msec);
+}
+
+void MessagePackRPCTransportUnix::close() {
+	socket.close();
+}
+
+void MessagePackRPCTransportUnix::interrupt() {
+	socket.interrupt();
+}
+
+int MessagePackRPCTransportUnix::get_fd() const {
+	return socket.get_fd();
+}
+
+String MessagePackRPCTransportUnix::get_peer_host() const {
+	return path;
+}
+
+void MessagePackRPCTransportUnix::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("connect_to_path", "path"), &MessagePackRPCTransportUnix::connect_to_path);
+	ClassDB::bind_method(D_METHOD("get_path"), &MessagePackRPCTransportUnix::get_path);
+}
+
+// Listener
+
+Error MessagePackRPCListener::listen_tcp(uint16_t p_port, const IPAddress &p_bind_address) {
+#ifdef UNIX_ENABLED
+	ERR_FAIL_COND_V_MSG(fd >= 0, ERR_ALREADY_IN_USE, "Already listening.");
+	ERR_FAIL_COND_V_MSG(!p_bind_address.is_valid(), ERR_INVALID_PARAMETER, "Invalid bind address.");
+	struct sockaddr_storage addr;
+	socklen_t addr_size = _make_ip_address(p_bind_address, p_port, addr);
+	int sock = ::socket(addr.ss_family, SOCK_STREAM, 0);
+	ERR_FAIL_COND_V_MSG(sock < 0, ERR_CANT_CREATE, "Can't create socket.");
+	int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (addr.ss_family == AF_INET6) {
+		// Like TCPServer, the wildcard address takes IPv4 connections too.
+		int v6_only = 0;
+		setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6_only, sizeof(v6_only));
+	}
+	if (::bind(sock, (struct sockaddr *)&addr, addr_size) != 0 || ::listen(sock, SOMAXCONN) != 0) {
+		String err = strerror(errno);
+		::close(sock);
+		ERR_FAIL_V_MSG(ERR_UNAVAILABLE, "Can't listen on port " + itos(p_port) + ": " + err + ".");
+	}
+	_set_socket_options(sock);
+	fd = sock;
+	return OK;
+#else
+	ERR_FAIL_V_MSG(ERR_UNAVAILABLE, "Listening sockets are not available on this platform, use a TCPServer.");
+#endif
+}
+
+Error MessagePackRPCListener::listen_path(const String &p_path) {
+#ifdef UNIX_ENABLED
+	ERR_FAIL_COND_V_MSG(fd >= 0, ERR_ALREADY_IN_USE, "Already listening.");
+	struct sockaddr_un addr;
+	ERR_FAIL_COND_V_MSG(!_make_unix_address(p_path, addr), ERR_INVALID_PARAMETER, "Invalid socket path: '" + p_path + "'.");
+	int sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	ERR_FAIL_COND_V_MSG(sock < 0, ERR_CANT_CREATE, "Can't create socket.");
+	if (::bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(sock, SOMAXCONN) != 0) {
+		String err = strerror(errno);
+		::close(sock);
+		ERR_FAIL_V_MSG(ERR_UNAVAILABLE, "Can't listen on '" + p_path + "': " + err + ".");
+	}
+	_set_socket_options(sock);
+	fd = sock;
+	path = p_path;
+	return OK;
+#else
+	ERR_FAIL_V_MSG(ERR_UNAVAILABLE, "Unix domain sockets are not available on this platform.");
+#endif
+}
+
+bool MessagePackRPCListener::is_listening() const {
+	return fd >= 0;
+}
+
+int MessagePackRPCListener::get_fd() const {
+	return fd;
+}
+
+Ref<MessagePackRPCTransport> MessagePackRPCListener::take_connection() {
+#ifdef UNIX_ENABLED
+	if (fd < 0) {
+		return Ref<MessagePackRPCTransport>();
+	}
+	struct sockaddr_storage addr;
+	socklen_t addr_size = sizeof(addr);
+	int sock = ::accept(fd, (struct sockaddr *)&addr, &addr_size);
+	if (sock < 0) {
+		return Ref<MessagePackRPCTransport>();
+	}
+	_set_socket_options(sock);
+	if (!path.is_empty()) {
+		Ref<MessagePackRPCTransportUnix> conn;
+		conn.instantiate();
+		conn->_set_fd(sock, path);
+		return conn;
+	}
+	IPAddress ip;
+	int port = 0;
+	_read_ip_address(addr, ip, port);
+	Ref<MessagePackRPCTransportTCP> conn;
+	conn.instantiate();
+	conn->_set_fd(sock, ip, port);
+	return conn;
+#else
+	return Ref<MessagePackRPCTransport>();
+#endif
+}
+
+void MessagePackRPCListener::stop() {
+#ifdef UNIX_ENABLED
+	if (fd < 0) {
+		return;
+	}
+	::close(fd);
+	fd = -1;
+	if (!path.is_empty()) {
+		unlink(path.utf8().get_data());
+		path = String();
+	}
+#endif
+}
+
+MessagePackRPCListener::~MessagePackRPCListener() {
+	stop();
+}
+
+// Loopback
+
+Array MessagePackRPCTransportLoopback::create_pair() {
+	Link *link = memnew(Link);
+	link->refcount.init(2);
+
+	Ref<MessagePackRPCTransportLoopback> a;
+	a.instantiate();
+	a->link = link;
+	a->in = &link->pipes[0];
+	a->out = &link->pipes[1];
+
+	Ref<MessagePackRPCTransportLoopback> b;
+	b.instantiate();
+	b->link = link;
+	b->in = &link->pipes[1];
+	b->out = &link->pipes[0];
+
+	Array pair;
+	pair.push_back(a);
+	pair.push_back(b);
+	return pair;
+}
+
+bool MessagePackRPCTransportLoopback::is_open() const {
+	if (!link || closed) {
+		return false;
+	}
+	// What the peer wrote before closing can still be read.
+	std::lock_guard<std::mutex> lock(in->mutex);
+	return !in->closed || !in->buf.is_empty();
+}
+
+int MessagePackRPCTransportLoopback::get_available_bytes() const {
+	if (!link) {
+		return 0;
+	}
+	std::lock_guard<std::mutex> lock(in->mutex);
+	return in->buf.data_left();
+}
+
+Error MessagePackRPCTransportLoopback::get_partial_data(uint8_t *r_buffer, int p_bytes, int &r_received) {
+	r_received = 0;
+	ERR_FAIL_COND_V(!link, ERR_UNCONFIGURED);
+	{
+		std::lock_guard<std::mutex> lock(in->mutex);
+		if (in->buf.is_empty()) {
+			return in->closed ? ERR_FILE_EOF : OK;
+		}
+		r_received = in->buf.read(r_buffer, p_bytes);
+	}
+	// The writer may be waiting for space.
+	in->cond.notify_all();
+	return OK;
+}
+
+Error MessagePackRPCTransportLoopback::put_partial_data(const uint8_t *p_data, int p_bytes, int &r_sent) {
+	r_sent = 0;
+	ERR_FAIL_COND_V(!link, ERR_UNCONFIGURED);
+	{
+		std::lock_guard<std::mutex> lock(out->mutex);
+		if (out->closed) {
+			return ERR_FILE_EOF;
+		}
+		// Grows up to _RPC_LOOPBACK_MAX_SIZE, then writes are partial like a full socket buffer.
+		out->buf.reserve(MIN(uint32_t(p_bytes), _RPC_LOOPBACK_MAX_SIZE - out->buf.data_left()));
+		r_sent = out->buf.write(p_data, p_bytes);
+	}
+	out->cond.notify_all();
+	return OK;
+}
+
+Error MessagePackRPCTransportLoopback::wait(NetSocket::PollType p_type, int p_timeout_msec) {
+	ERR_FAIL_COND_V(!link, ERR_UNCONFIGURED);
+	Pipe *pipe = p_type == NetSocket::POLL_TYPE_OUT ? out : in;
+	std::unique_lock<std::mutex> lock(pipe->mutex);
+	auto is_ready = [pipe, p_type] {
+		if (pipe->closed) {
+			return true;
+		}
+		return p_type == NetSocket::POLL_TYPE_OUT ? pipe->buf.data_left() < _RPC_LOOPBACK_MAX_SIZE : !pipe->buf.is_empty();
+	};
+	pipe->cond.wait_for(lock, std::chrono::milliseconds(p_timeout_msec), [pipe, p_type, &is_ready] {
+		return is_ready() || (p_type == NetSocket::POLL_TYPE_IN && pipe->interrupted);
+	});
+	if (p_type == NetSocket::POLL_TYPE_IN) {
+		pipe->interrupted = false;
+	}
+	return is_ready() ? OK : ERR_BUSY;
+}
+
+void MessagePackRPCTransportLoopback::interrupt() {
+	if (!link) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(in->mutex);
+		in->interrupted = true;
+	}
+	in->cond.notify_all();
+}
+
+void MessagePackRPCTransportLoopback::close() {
+	if (!link) {
+		return;
+	}
+	closed = true;
+	Pipe *pipes[2] = { in, out };
+	for (Pipe *pipe : pipes) {
+		{
+			std::lock_guard<std::mutex> lock(pipe->mutex);
+			pipe->closed = true;
+		}
+		pipe->cond.notify_all();
+	}
+}
+
+String MessagePackRPCTransportLoopback::get_peer_host() const {
+	return "loopback";
+}
+
+void MessagePackRPCTransportLoopback::_bind_methods() {
+	ClassDB::bind_static_method("MessagePackRPCTransportLoopback", D_METHOD("create_pair"), &MessagePackRPCTransportLoopback::create_pair);
+}
+
+MessagePackRPCTransportLoopback::~MessagePackRPCTransportLoopback() {
+	if (!link) {
+		return;
+	}
+	close();
+	if (link->refcount.unref()) {
+		memdelete(link);
+	}
+}
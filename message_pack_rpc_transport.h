@@ -0,0 +1,276 @@
+/*************************************************************************/
+/*  message_pack_rpc_transport.h                                         */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef MESSAGE_PACK_RPC_TRANSPORT_H
+#define MESSAGE_PACK_RPC_TRANSPORT_H
+
+#include "core/io/net_socket.h"
+#include "core/io/stream_peer_tcp.h"
+#include "core/object/ref_counted.h"
+#include "core/os/mutex.h"
+#include "core/string/ustring.h"
+#include "core/templates/safe_refcount.h"
+
+#include "message_pack_rpc_buffer.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+// Bytes one direction of a loopback pair holds before writes are partial: 4MiB.
+#define _RPC_LOOPBACK_MAX_SIZE (1 << 22)
+
+// A connected byte stream MessagePackRPC reads and writes messages through.
+// Reads and waits for POLL_TYPE_IN happen on the read thread, writes and waits
+// for POLL_TYPE_OUT on the write thread, close() on any thread.
+class MessagePackRPCTransport : public RefCounted {
+	GDCLASS(MessagePackRPCTransport, RefCounted);
+
+protected:
+	static void _bind_methods();
+
+public:
+	virtual bool is_open() const = 0;
+	// Updates the connection state, called before each read.
+	virtual void poll() {}
+	virtual int get_available_bytes() const = 0;
+	// Non-blocking, r_received or r_sent may be 0.
+	virtual Error get_partial_data(uint8_t *r_buffer, int p_bytes, int &r_received) = 0;
+	virtual Error put_partial_data(const uint8_t *p_data, int p_bytes, int &r_sent) = 0;
+	// Sleeps until the stream is readable or writable, ERR_BUSY on timeout.
+	virtual Error wait(NetSocket::PollType p_type, int p_timeout_msec) = 0;
+	virtual void close() = 0;
+	// Makes a wait(POLL_TYPE_IN) in progress, or the next one, return early
+	// with ERR_BUSY. Only when can_interrupt(), callable from any thread.
+	virtual bool can_interrupt() const { return false; }
+	virtual void interrupt() {}
+	// True when reads and writes are plain memory copies without system calls.
+	// The connection then copies messages straight in and out of the transport
+	// instead of batching them in its own buffers.
+	virtual bool is_direct() const { return false; }
+
+	// Socket the server's I/O loops can poll for readiness, -1 if there is none.
+	virtual int get_fd() const { return -1; }
+
+	virtual void set_no_delay(bool p_enabled) {}
+	virtual String get_peer_host() const { return String(); }
+	virtual int get_peer_port() const { return 0; }
+};
+
+// A connected non-blocking stream socket, what the TCP and Unix transports
+// read and write through on Unix platforms.
+// close() only shuts the socket down, which wakes a thread blocked on it. The
+// descriptor stays valid until release(), so the other thread never reads,
+// writes or waits on a reused one.
+class MessagePackRPCSocket {
+	int fd = -1;
+	std::atomic<bool> closed{ false };
+	// Wakes wait(POLL_TYPE_IN), made by its first call.
+	std::mutex wake_mutex;
+	int wake_pipe[2] = { -1, -1 };
+	std::atomic<bool> interrupted{ false };
+
+	void _clear_interrupt();
+
+public:
+	void set_fd(int p_fd);
+	// -1 once closed.
+	int get_fd() const;
+	// True from set_fd() to release(), closed or not.
+	bool is_valid() const;
+
+	bool is_open() const;
+	void poll();
+	int get_available_bytes() const;
+	Error get_partial_data(uint8_t *r_buffer, int p_bytes, int &r_received);
+	Error put_partial_data(const uint8_t *p_data, int p_bytes, int &r_sent);
+	Error wait(NetSocket::PollType p_type, int p_timeout_msec);
+	void interrupt();
+	void close();
+	// Closes the descriptor, once no thread uses the socket any more.
+	void release();
+
+	~MessagePackRPCSocket();
+};
+
+// On Unix platforms connect_to_host() and MessagePackRPCServer use a socket of
+// their own, which the server's I/O loops can poll. Otherwise, and when given a
+// StreamPeerTCP, it goes through that stream. StreamPeerTCP isn't thread-safe,
+// every call on it is made under the mutex. Waits are made outside of it so the
+// other thread isn't held up for their whole timeout, a close() during a wait
+// is finished by the waiting thread.
+class MessagePackRPCTransportTCP : public MessagePackRPCTransport {
+	GDCLASS(MessagePackRPCTransportTCP, MessagePackRPCTransport);
+
+	friend class MessagePackRPCListener;
+
+	MessagePackRPCSocket socket;
+	IPAddress peer_ip;
+	int peer_port = 0;
+
+	mutable Mutex mutex;
+	Ref<StreamPeerTCP> stream;
+	int waiting = 0;
+	bool closing = false;
+
+	bool _is_open() const;
+	void _set_fd(int p_fd, const IPAddress &p_ip, int p_port);
+
+protected:
+	static void _bind_methods();
+
+public:
+	Error connect_to_host(const IPAddress &p_ip, int p_port);
+	void set_stream(const Ref<StreamPeerTCP> &p_stream);
+	Ref<StreamPeerTCP> get_stream() const;
+
+	virtual bool is_open() const override;
+	virtual void poll() override;
+	virtual int get_available_bytes() const override;
+	virtual Error get_partial_data(uint8_t *r_buffer, int p_bytes, int &r_received) override;
+	virtual Error put_partial_data(const uint8_t *p_data, int p_bytes, int &r_sent) override;
+	virtual Error wait(NetSocket::PollType p_type, int p_timeout_msec) override;
+	virtual void close() override;
+	virtual bool can_interrupt() const override;
+	virtual void interrupt() override;
+	virtual int get_fd() const override;
+
+	virtual void set_no_delay(bool p_enabled) override;
+	virtual String get_peer_host() const override;
+	virtual int get_peer_port() const override;
+
+	MessagePackRPCTransportTCP(const Ref<StreamPeerTCP> &p_stream = Ref<StreamPeerTCP>());
+};
+
+// Unix domain stream socket, for peers on the same host. Only available on Unix
+// platforms, elsewhere connecting fails with ERR_UNAVAILABLE.
+class MessagePackRPCTransportUnix : public MessagePackRPCTransport {
+	GDCLASS(MessagePackRPCTransportUnix, MessagePackRPCTransport);
+
+	friend class MessagePackRPCListener;
+
+	MessagePackRPCSocket socket;
+	String path;
+
+	void _set_fd(int p_fd, const String &p_path);
+
+protected:
+	static void _bind_methods();
+
+public:
+	Error connect_to_path(const String &p_path);
+	String get_path() const;
+
+	virtual bool is_open() const override;
+	virtual void poll() override;
+	virtual int get_available_bytes() const override;
+	virtual Error get_partial_data(uint8_t *r_buffer, int p_bytes, int &r_received) override;
+	virtual Error put_partial_data(const uint8_t *p_data, int p_bytes, int &r_sent) override;
+	virtual Error wait(NetSocket::PollType p_type, int p_timeout_msec) override;
+	virtual void close() override;
+	virtual bool can_interrupt() const override { return true; }
+	virtual void interrupt() override;
+	virtual int get_fd() const override;
+
+	virtual String get_peer_host() const override;
+};
+
+// Listening socket of a MessagePackRPCServer, on a TCP port or a Unix domain
+// socket path. Only available on Unix platforms, elsewhere the server listens
+// for TCP with a TCPServer.
+class MessagePackRPCListener {
+	int fd = -1;
+	// Set when listening on a Unix domain socket.
+	String path;
+
+public:
+	Error listen_tcp(uint16_t p_port, const IPAddress &p_bind_address);
+	Error listen_path(const String &p_path);
+	bool is_listening() const;
+	int get_fd() const;
+	// Next pending connection, null if there is none.
+	Ref<MessagePackRPCTransport> take_connection();
+	// Stops listening and removes the socket file.
+	void stop();
+
+	~MessagePackRPCListener();
+};
+
+// One end of an in-process pair made by create_pair(), what one end writes
+// the other reads. No sockets involved, for tests and benchmarks.
+class MessagePackRPCTransportLoopback : public MessagePackRPCTransport {
+	GDCLASS(MessagePackRPCTransportLoopback, MessagePackRPCTransport);
+
+	// One direction of the pair.
+	struct Pipe {
+		std::mutex mutex;
+		std::condition_variable cond;
+		MessagePackRPCBuffer buf;
+		bool closed = false;
+		// Set by interrupt() on the reading end's pipe.
+		bool interrupted = false;
+
+		Pipe() :
+				buf(_RPC_LOOPBACK_MAX_SIZE) {}
+	};
+	// Both directions, freed with the last end.
+	struct Link {
+		Pipe pipes[2];
+		SafeRefCount refcount;
+	};
+
+	Link *link = nullptr;
+	Pipe *in = nullptr;
+	Pipe *out = nullptr;
+	std::atomic<bool> closed{ false };
+
+protected:
+	static void _bind_methods();
+
+public:
+	// Two connected ends, [a, b].
+	static Array create_pair();
+
+	virtual bool is_open() const override;
+	virtual int get_available_bytes() const override;
+	virtual Error get_partial_data(uint8_t *r_buffer, int p_bytes, int &r_received) override;
+	virtual Error put_partial_data(const uint8_t *p_data, int p_bytes, int &r_sent) override;
+	virtual Error wait(NetSocket::PollType p_type, int p_timeout_msec) override;
+	virtual void close() override;
+	virtual bool can_interrupt() const override { return true; }
+	virtual void interrupt() override;
+	virtual bool is_direct() const override { return true; }
+
+	virtual String get_peer_host() const override;
+
+	~MessagePackRPCTransportLoopback();
+};
+
+#endif // MESSAGE_PACK_RPC_TRANSPORT_H
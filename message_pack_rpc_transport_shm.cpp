@@ -0,0 +1,363 @@
+/*************************************************************************/
+/*  message_pack_rpc_transport_shm.cpp                                   */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "message_pack_rpc_transport_shm.h"
+#include "core/object/class_db.h"
+#include "core/os/os.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Futex words must be plain 32 bit integers.");
+
+// Not FUTEX_PRIVATE_FLAG, the waker is another process.
+static void _futex_wait(std::atomic<uint32_t> &p_word, uint32_t p_value, int p_timeout_msec) {
+	struct timespec timeout = { p_timeout_msec / 1000, (p_timeout_msec % 1000) * 1000000L };
+	syscall(SYS_futex, (uint32_t *)&p_word, FUTEX_WAIT, p_value, &timeout, nullptr, 0);
+}
+
+static void _futex_wake(std::atomic<uint32_t> &p_word) {
+	syscall(SYS_futex, (uint32_t *)&p_word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+#endif
+
+uint64_t MessagePackRPCTransportSharedMemory::_get_data_offset() {
+	// The ring data starts on the first page after the header.
+	const uint64_t page = 4096;
+	return (sizeof(Header) + page - 1) & ~(page - 1);
+}
+
+Error MessagePackRPCTransportSharedMemory::_map(int p_fd, uint64_t p_size) {
+#ifdef __linux__
+	void *base = mmap(nullptr, p_size, PROT_READ | PROT_WRITE, MAP_SHARED, p_fd, 0);
+	ERR_FAIL_COND_V_MSG(base == MAP_FAILED, ERR_CANT_CREATE, "Can't map shared memory: " + String(strerror(errno)) + ".");
+	header = (Header *)base;
+	map_size = p_size;
+	return OK;
+#else
+	return ERR_UNAVAILABLE;
+#endif
+}
+
+void MessagePackRPCTransportSharedMemory::_unmap() {
+#ifdef __linux__
+	if (header) {
+		munmap(header, map_size);
+	}
+#endif
+	header = nullptr;
+	rx = tx = nullptr;
+	rx_data = tx_data = nullptr;
+	map_size = 0;
+}
+
+void MessagePackRPCTransportSharedMemory::_ring_bell(std::atomic<uint32_t> &p_bell, std::atomic<uint32_t> &p_waiting) {
+	// Bumped after the position moved, a sleeper that read the old value wakes
+	// right away, one that reads the new value also sees the new position.
+	p_bell.fetch_add(1);
+#ifdef __linux__
+	if (p_waiting.load()) {
+		_futex_wake(p_bell);
+	}
+#endif
+}
+
+bool MessagePackRPCTransportSharedMemory::_is_peer_closed() const {
+	return (header->closed.load() & (side ^ 3)) || _is_peer_dead();
+}
+
+bool MessagePackRPCTransportSharedMemory::_is_peer_dead() const {
+#ifdef __linux__
+	if (peer_dead.load()) {
+		return true;
+	}
+	uint64_t now_msec = OS::get_singleton()->get_ticks_msec();
+	if (now_msec - peer_checked_msec.load() < _RPC_SHM_LIVENESS_CHECK_MSEC) {
+		return false;
+	}
+	peer_checked_msec = now_msec;
+	// Signal 0 only checks the process exists.
+	int32_t pid = header->pids[2 - side].load();
+	if (pid > 0 && kill(pid, 0) != 0 && errno == ESRCH) {
+		peer_dead = true;
+	}
+	return peer_dead.load();
+#else
+	return false;
+#endif
+}
+
+Error MessagePackRPCTransportSharedMemory::_corrupted() {
+	close();
+	ERR_FAIL_V_MSG(ERR_FILE_CORRUPT, "Shared memory '" + name + "' holds invalid ring positions, closed.");
+}
+
+Error MessagePackRPCTransportSharedMemory::create(const String &p_name, int p_ring_size) {
+#ifdef __linux__
+	ERR_FAIL_COND_V_MSG(header, ERR_ALREADY_IN_USE, "Already created or attached.");
+	ERR_FAIL_COND_V_MSG(p_ring_size < _RPC_SHM_RING_MIN_SIZE || p_ring_size > _RPC_SHM_RING_MAX_SIZE || (p_ring_size & (p_ring_size - 1)), ERR_INVALID_PARAMETER, "Ring size must be a power of two between 64KiB and 1GiB.");
+	CharString shm_name = p_name.utf8();
+	int fd = shm_open(shm_name.get_data(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	ERR_FAIL_COND_V_MSG(fd < 0, ERR_CANT_CREATE, "Can't create shared memory '" + p_name + "': " + String(strerror(errno)) + ".");
+	uint64_t size = _get_data_offset() + 2 * uint64_t(p_ring_size);
+	Error err = ftruncate(fd, size) == 0 ? _map(fd, size) : ERR_CANT_CREATE;
+	::close(fd);
+	if (err != OK) {
+		shm_unlink(shm_name.get_data());
+		ERR_FAIL_V_MSG(err, "Can't size shared memory '" + p_name + "'.");
+	}
+
+	// The new segment is zero filled, which is the initial state of the rings.
+	header->version = _RPC_SHM_VERSION;
+	header->ring_size = p_ring_size;
+	header->pids[0] = getpid();
+	std::atomic_thread_fence(std::memory_order_release);
+	header->magic = _RPC_SHM_MAGIC;
+
+	ring_size = p_ring_size;
+	side = 1;
+	tx = &header->rings[0];
+	rx = &header->rings[1];
+	tx_data = (uint8_t *)header + _get_data_offset();
+	rx_data = tx_data + ring_size;
+	name = p_name;
+	return OK;
+#else
+	ERR_FAIL_V_MSG(ERR_UNAVAILABLE, "Shared memory transport is only available on Linux.");
+#endif
+}
+
+Error MessagePackRPCTransportSharedMemory::attach(const String &p_name) {
+#ifdef __linux__
+	ERR_FAIL_COND_V_MSG(header, ERR_ALREADY_IN_USE, "Already created or attached.");
+	CharString shm_name = p_name.utf8();
+	int fd = shm_open(shm_name.get_data(), O_RDWR, 0);
+	ERR_FAIL_COND_V_MSG(fd < 0, ERR_CANT_OPEN, "Can't open shared memory '" + p_name + "': " + String(strerror(errno)) + ".");
+	struct stat st;
+	Error err = ERR_FILE_CORRUPT;
+	if (fstat(fd, &st) == 0 && uint64_t(st.st_size) > _get_data_offset()) {
+		err = _map(fd, st.st_size);
+	}
+	::close(fd);
+	ERR_FAIL_COND_V_MSG(err != OK, err, "Can't map shared memory '" + p_name + "'.");
+
+	uint32_t magic = header->magic;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	uint32_t size = header->ring_size;
+	bool valid_size = size >= _RPC_SHM_RING_MIN_SIZE && size <= _RPC_SHM_RING_MAX_SIZE && !(size & (size - 1)) && _get_data_offset() + 2 * uint64_t(size) == map_size;
+	if (magic != _RPC_SHM_MAGIC || header->version != _RPC_SHM_VERSION || !valid_size || header->attached.exchange(1)) {
+		_unmap();
+		ERR_FAIL_V_MSG(ERR_FILE_CORRUPT, "'" + p_name + "' is not a free MessagePackRPC shared memory segment.");
+	}
+	// Nobody else can attach, the mapping keeps the segment alive.
+	shm_unlink(shm_name.get_data());
+	header->pids[1] = getpid();
+
+	ring_size = size;
+	side = 2;
+	tx = &header->rings[1];
+	rx = &header->rings[0];
+	rx_data = (uint8_t *)header + _get_data_offset();
+	tx_data = rx_data + ring_size;
+	name = p_name;
+	return OK;
+#else
+	ERR_FAIL_V_MSG(ERR_UNAVAILABLE, "Shared memory transport is only available on Linux.");
+#endif
+}
+
+String MessagePackRPCTransportSharedMemory::get_name() const {
+	return name;
+}
+
+bool MessagePackRPCTransportSharedMemory::is_peer_attached() const {
+	return header && header->attached.load();
+}
+
+bool MessagePackRPCTransportSharedMemory::is_open() const {
+	if (!header || (header->closed.load() & side)) {
+		return false;
+	}
+	// Found out by the next read or write, which closes.
+	if (rx->write_pos.load() - rx->read_pos.load() > ring_size || tx->write_pos.load() - tx->read_pos.load() > ring_size) {
+		return false;
+	}
+	// What the peer wrote before closing can still be read.
+	return !_is_peer_closed() || get_available_bytes() > 0;
+}
+
+int MessagePackRPCTransportSharedMemory::get_available_bytes() const {
+	if (!header) {
+		return 0;
+	}
+	uint32_t used = rx->write_pos.load(std::memory_order_acquire) - rx->read_pos.load(std::memory_order_relaxed);
+	return used <= ring_size ? used : 0;
+}
+
+Error MessagePackRPCTransportSharedMemory::get_partial_data(uint8_t *r_buffer, int p_bytes, int &r_received) {
+	r_received = 0;
+	ERR_FAIL_COND_V(!header, ERR_UNCONFIGURED);
+	uint32_t read_pos = rx->read_pos.load(std::memory_order_relaxed);
+	uint32_t used = rx->write_pos.load(std::memory_order_acquire) - read_pos;
+	if (used > ring_size) {
+		return _corrupted();
+	}
+	uint32_t size = MIN(used, uint32_t(p_bytes));
+	if (size == 0) {
+		return _is_peer_closed() ? ERR_FILE_EOF : OK;
+	}
+	uint32_t offset = read_pos & (ring_size - 1);
+	uint32_t first = MIN(size, ring_size - offset);
+	memcpy(r_buffer, rx_data + offset, first);
+	memcpy(r_buffer + first, rx_data, size - first);
+	rx->read_pos.store(read_pos + size, std::memory_order_release);
+	_ring_bell(rx->space_bell, rx->writer_waiting);
+	r_received = size;
+	return OK;
+}
+
+Error MessagePackRPCTransportSharedMemory::put_partial_data(const uint8_t *p_data, int p_bytes, int &r_sent) {
+	r_sent = 0;
+	ERR_FAIL_COND_V(!header, ERR_UNCONFIGURED);
+	if (_is_peer_closed()) {
+		return ERR_FILE_EOF;
+	}
+	uint32_t write_pos = tx->write_pos.load(std::memory_order_relaxed);
+	uint32_t used = write_pos - tx->read_pos.load(std::memory_order_acquire);
+	if (used > ring_size) {
+		return _corrupted();
+	}
+	uint32_t size = MIN(ring_size - used, uint32_t(p_bytes));
+	if (size == 0) {
+		return OK;
+	}
+	uint32_t offset = write_pos & (ring_size - 1);
+	uint32_t first = MIN(size, ring_size - offset);
+	memcpy(tx_data + offset, p_data, first);
+	memcpy(tx_data, p_data + first, size - first);
+	tx->write_pos.store(write_pos + size, std::memory_order_release);
+	_ring_bell(tx->data_bell, tx->reader_waiting);
+	r_sent = size;
+	return OK;
+}
+
+Error MessagePackRPCTransportSharedMemory::wait(NetSocket::PollType p_type, int p_timeout_msec) {
+	ERR_FAIL_COND_V(!header, ERR_UNCONFIGURED);
+	bool out = p_type == NetSocket::POLL_TYPE_OUT;
+	Ring *ring = out ? tx : rx;
+	std::atomic<uint32_t> &bell = out ? ring->space_bell : ring->data_bell;
+	std::atomic<uint32_t> &waiting = out ? ring->writer_waiting : ring->reader_waiting;
+	auto is_ready = [this, ring, out]() {
+		if (header->closed.load()) {
+			return true; // The next read or write finds out.
+		}
+		uint32_t used = ring->write_pos.load() - ring->read_pos.load();
+		if (used > ring_size) {
+			return true; // Corrupt, likewise.
+		}
+		return out ? used < ring_size : used > 0;
+	};
+
+	uint32_t seq = bell.load();
+	waiting.store(1);
+	if (!is_ready() && (out || !interrupted.load())) {
+#ifdef __linux__
+		_futex_wait(bell, seq, p_timeout_msec);
+#endif
+	}
+	waiting.store(0);
+	if (!out) {
+		interrupted = false;
+	}
+	return is_ready() ? OK : ERR_BUSY;
+}
+
+void MessagePackRPCTransportSharedMemory::interrupt() {
+	if (!header) {
+		return;
+	}
+	// Checked by a wait() that didn't sleep yet, the bell wakes one that did.
+	interrupted = true;
+	rx->data_bell.fetch_add(1);
+#ifdef __linux__
+	_futex_wake(rx->data_bell);
+#endif
+}
+
+void MessagePackRPCTransportSharedMemory::close() {
+	if (!header) {
+		return;
+	}
+	if (header->closed.fetch_or(side) & side) {
+		return;
+	}
+	// Wake whatever sleeps on either side.
+	for (Ring &ring : header->rings) {
+		ring.data_bell.fetch_add(1);
+		ring.space_bell.fetch_add(1);
+#ifdef __linux__
+		_futex_wake(ring.data_bell);
+		_futex_wake(ring.space_bell);
+#endif
+	}
+#ifdef __linux__
+	if (side == 1 && !header->attached.load()) {
+		// Nobody attached, don't let anyone do it now. Otherwise the other side
+		// already removed the name.
+		shm_unlink(name.utf8().get_data());
+	}
+#endif
+}
+
+String MessagePackRPCTransportSharedMemory::get_peer_host() const {
+	return name;
+}
+
+void MessagePackRPCTransportSharedMemory::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("create", "name", "ring_size"), &MessagePackRPCTransportSharedMemory::create, DEFVAL(_RPC_SHM_RING_SIZE));
+	ClassDB::bind_method(D_METHOD("attach", "name"), &MessagePackRPCTransportSharedMemory::attach);
+	ClassDB::bind_method(D_METHOD("get_name"), &MessagePackRPCTransportSharedMemory::get_name);
+	ClassDB::bind_method(D_METHOD("is_peer_attached"), &MessagePackRPCTransportSharedMemory::is_peer_attached);
+}
+
+MessagePackRPCTransportSharedMemory::~MessagePackRPCTransportSharedMemory() {
+	close();
+	_unmap();
+}
@@ -0,0 +1,133 @@
+/*************************************************************************/
+/*  message_pack_rpc_transport_shm.h                                     */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2022 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2022 Godot Engine contributors (cf. AUTHORS.md).   */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef MESSAGE_PACK_RPC_TRANSPORT_SHM_H
+#define MESSAGE_PACK_RPC_TRANSPORT_SHM_H
+
+#include "message_pack_rpc_transport.h"
+
+#include <atomic>
+
+// Default size of each direction's ring: 4MiB.
+#define _RPC_SHM_RING_SIZE (1 << 22)
+#define _RPC_SHM_RING_MIN_SIZE (1 << 16)
+#define _RPC_SHM_RING_MAX_SIZE (1 << 30)
+// "MPRS", and the layout version.
+#define _RPC_SHM_MAGIC 0x5352504d
+#define _RPC_SHM_VERSION 2
+// How often the peer's process is checked for being still alive.
+#define _RPC_SHM_LIVENESS_CHECK_MSEC 100
+
+// Two single producer, single consumer byte rings in a POSIX shared memory
+// segment, one per direction, with a futex doorbell each way. The creator makes
+// the segment, the other process attaches to it by name. Only available on
+// Linux, elsewhere create() and attach() fail with ERR_UNAVAILABLE.
+// The positions are written by the other process and checked on every access,
+// a ring that can't be right closes the transport as corrupt.
+class MessagePackRPCTransportSharedMemory : public MessagePackRPCTransport {
+	GDCLASS(MessagePackRPCTransportSharedMemory, MessagePackRPCTransport);
+
+	// One direction. Positions run free, the offset in data is pos & (size - 1).
+	// Each doorbell is a futex word, bumped after the positions move, the
+	// waiting flags spare the system call when nobody sleeps.
+	struct Ring {
+		alignas(64) std::atomic<uint32_t> write_pos;
+		std::atomic<uint32_t> data_bell;
+		std::atomic<uint32_t> reader_waiting;
+		alignas(64) std::atomic<uint32_t> read_pos;
+		std::atomic<uint32_t> space_bell;
+		std::atomic<uint32_t> writer_waiting;
+	};
+
+	// Start of the segment, the ring data follows.
+	struct Header {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t ring_size;
+		std::atomic<uint32_t> attached;
+		// One bit per side, set when it closes.
+		std::atomic<uint32_t> closed;
+		// Process of each side, 0 until it created or attached. A side that died
+		// without closing is noticed by its process being gone.
+		std::atomic<int32_t> pids[2];
+		Ring rings[2];
+	};
+
+	Header *header = nullptr;
+	uint64_t map_size = 0;
+	uint8_t *rx_data = nullptr;
+	uint8_t *tx_data = nullptr;
+	Ring *rx = nullptr;
+	Ring *tx = nullptr;
+	uint32_t ring_size = 0;
+	// Bit of this side in Header::closed, 1 for the creator, 2 for the other side.
+	uint32_t side = 0;
+	String name;
+	// Set by interrupt(), local to this side.
+	std::atomic<bool> interrupted{ false };
+	mutable std::atomic<uint64_t> peer_checked_msec{ 0 };
+	mutable std::atomic<bool> peer_dead{ false };
+
+	static uint64_t _get_data_offset();
+	Error _map(int p_fd, uint64_t p_size);
+	void _unmap();
+	void _ring_bell(std::atomic<uint32_t> &p_bell, std::atomic<uint32_t> &p_waiting);
+	bool _is_peer_closed() const;
+	bool _is_peer_dead() const;
+	Error _corrupted();
+
+protected:
+	static void _bind_methods();
+
+public:
+	// Creates the segment, the name must start with "/" (see shm_open).
+	Error create(const String &p_name, int p_ring_size = _RPC_SHM_RING_SIZE);
+	// Maps a segment made by create() in another process. The name is unlinked
+	// once attached, the segment lives until both sides closed.
+	Error attach(const String &p_name);
+	String get_name() const;
+	bool is_peer_attached() const;
+
+	virtual bool is_open() const override;
+	virtual int get_available_bytes() const override;
+	virtual Error get_partial_data(uint8_t *r_buffer, int p_bytes, int &r_received) override;
+	virtual Error put_partial_data(const uint8_t *p_data, int p_bytes, int &r_sent) override;
+	virtual Error wait(NetSocket::PollType p_type, int p_timeout_msec) override;
+	virtual void close() override;
+	virtual bool can_interrupt() const override { return true; }
+	virtual void interrupt() override;
+	virtual bool is_direct() const override { return true; }
+
+	virtual String get_peer_host() const override;
+
+	~MessagePackRPCTransportSharedMemory();
+};
+
+#endif // MESSAGE_PACK_RPC_TRANSPORT_SHM_H
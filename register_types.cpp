@@ -31,7 +31,16 @@
 #include "register_types.h"
 #include "core/object/class_db.h"
 #include "message_pack.h"
+#include "message_pack_delta.h"
 #include "message_pack_rpc.h"
+#include "message_pack_rpc_benchmark.h"
+#include "message_pack_rpc_buffer.h"
+#include "message_pack_rpc_call.h"
+#include "message_pack_rpc_capture.h"
+#include "message_pack_rpc_pool.h"
+#include "message_pack_rpc_server.h"
+#include "message_pack_rpc_transport.h"
+#include "message_pack_rpc_transport_shm.h"
 
 void initialize_message_pack_module(ModuleInitializationLevel p_level) {
 	if (p_level != MODULE_INITIALIZATION_LEVEL_SCENE) {
@@ -39,11 +48,24 @@ void initialize_message_pack_module(ModuleInitializationLevel p_level) {
 	}
 
 	GDREGISTER_CLASS(MessagePack);
+	GDREGISTER_CLASS(MessagePackDelta);
 	GDREGISTER_CLASS(MessagePackRPC);
+	GDREGISTER_CLASS(MessagePackRPCBenchmark);
+	GDREGISTER_CLASS(MessagePackRPCCall);
+	GDREGISTER_CLASS(MessagePackRPCPool);
+	GDREGISTER_CLASS(MessagePackRPCReplayer);
+	GDREGISTER_CLASS(MessagePackRPCServer);
+	GDREGISTER_ABSTRACT_CLASS(MessagePackRPCTransport);
+	GDREGISTER_CLASS(MessagePackRPCTransportTCP);
+	GDREGISTER_CLASS(MessagePackRPCTransportUnix);
+	GDREGISTER_CLASS(MessagePackRPCTransportLoopback);
+	GDREGISTER_CLASS(MessagePackRPCTransportSharedMemory);
 }
 
 void uninitialize_message_pack_module(ModuleInitializationLevel p_level) {
 	if (p_level != MODULE_INITIALIZATION_LEVEL_SCENE) {
 		return;
 	}
+
+	MessagePackRPCBufferPool::clear();
 }